@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <mqueue.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../src/mailslot.h"
+#include "../src/mailslot_driver.h"
+
+#define DEVICE_FILE "/dev/test_mailslot"
+#define REPLY_FILE  "/dev/mailslot1"
+#define DEFAULT_MSGS 1000000
+#define DEFAULT_SIZE 64
+#define DEFAULT_ROUND_TRIPS 100000
+#define MQ_DEPTH 10 /* default of /proc/sys/fs/mqueue/msg_max */
+
+#define T_MAILSLOT 0
+#define T_PIPE     1
+#define T_MQ       2
+#define T_UNIX     3
+
+static const char* transport_names[] = { "mailslot", "pipe", "mq", "unix" };
+
+/* The same workload runs on each transport through a channel: a pipe is a byte stream, hence a message is read
+ * with as many reads as needed, whereas a slot, a message queue and a datagram socket preserve message boundaries. */
+struct channel {
+    int rfd;        /* read end (a message queue descriptor for mq) */
+    int wfd;        /* write end */
+    int config_fd;  /* mailslot: keeps the slot (and its configuration) alive while the children open and close it */
+    char name[ 64 ]; /* mailslot: device file, mq: queue name */
+};
+
+static int transport = T_MAILSLOT;
+static size_t size = DEFAULT_SIZE;
+static int non_blocking = 0;
+static unsigned int busy_poll = 0; /* mailslot: microseconds a blocking read spins before sleeping */
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_transport( const char* name ) {
+    int i;
+    for ( i = 0; i < (int)( sizeof( transport_names ) / sizeof( transport_names[0] ) ); ++i ) {
+        if ( strcmp( name, transport_names[i] ) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage( const char* prog ) {
+    fprintf( stderr, "usage: %s [-t mailslot|pipe|mq|unix] [-d device] [-D reply device] [-n msgs] [-s size] "
+                     "[-p producers] [-c consumers] [-l round trips] [-N] [-b busy poll usecs]\n", prog );
+}
+
+/* Returns the share of msgs moved by the i-th of n processes. */
+static long share( long msgs, int n, int i ) {
+    return msgs / n + ( i < msgs % n ? 1 : 0 );
+}
+
+/* Creates a channel in the parent, before forking: the children inherit its descriptors. */
+static int channel_create( struct channel* ch, const char* device, int index ) {
+    int fds[2];
+    struct mq_attr attr = { .mq_maxmsg = MQ_DEPTH, .mq_msgsize = size };
+
+    ch->rfd = ch->wfd = ch->config_fd = -1;
+    switch ( transport ) {
+        case T_MAILSLOT:
+            snprintf( ch->name, sizeof( ch->name ), "%s", device );
+            ch->config_fd = open( device, O_RDWR );
+            if ( ch->config_fd < 0 ) {
+                return -1;
+            }
+            return ioctl( ch->config_fd, MAILSLOT_SET_MAX_MSG_SIZE, size );
+        case T_PIPE:
+            if ( pipe( fds ) != 0 ) {
+                return -1;
+            }
+            ch->rfd = fds[0];
+            ch->wfd = fds[1];
+            break;
+        case T_MQ:
+            snprintf( ch->name, sizeof( ch->name ), "/bench_compare.%d.%d", (int)getpid(), index );
+            ch->rfd = ch->wfd = mq_open( ch->name, O_RDWR | O_CREAT | O_EXCL, 0600, &attr );
+            if ( ch->rfd < 0 ) {
+                return -1;
+            }
+            mq_unlink( ch->name ); /* it lives as long as its descriptors */
+            break;
+        case T_UNIX:
+            if ( socketpair( AF_UNIX, SOCK_DGRAM, 0, fds ) != 0 ) {
+                return -1;
+            }
+            ch->wfd = fds[0];
+            ch->rfd = fds[1];
+            break;
+    }
+    if ( non_blocking ) { /* mq descriptors are file descriptors on Linux */
+        fcntl( ch->rfd, F_SETFL, fcntl( ch->rfd, F_GETFL ) | O_NONBLOCK );
+        fcntl( ch->wfd, F_SETFL, fcntl( ch->wfd, F_GETFL ) | O_NONBLOCK );
+    }
+    return 0;
+}
+
+/* Attaches a child to a channel: each process opens the slot on its own, as independent readers and writers do. */
+static int channel_attach( struct channel* ch ) {
+    if ( transport == T_MAILSLOT ) {
+        ch->rfd = ch->wfd = open( ch->name, O_RDWR | ( non_blocking ? O_NONBLOCK : 0 ) );
+        if ( ch->rfd >= 0 && busy_poll > 0 ) {
+            return ioctl( ch->rfd, MAILSLOT_SET_BUSY_POLL, busy_poll );
+        }
+        return ch->rfd < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+static void channel_destroy( struct channel* ch ) {
+    if ( ch->config_fd >= 0 ) {
+        ioctl( ch->config_fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
+        close( ch->config_fd );
+    }
+    if ( ch->rfd >= 0 ) {
+        close( ch->rfd );
+    }
+    if ( ch->wfd >= 0 && ch->wfd != ch->rfd ) {
+        close( ch->wfd );
+    }
+}
+
+/* In non-blocking mode, waits for the channel to be ready as an event loop would. */
+static int channel_wait( int fd, short events ) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    return poll( &pfd, 1, -1 ) < 0 && errno != EINTR ? -1 : 0;
+}
+
+static int channel_send( struct channel* ch, const char* buffer ) {
+    ssize_t res;
+    size_t sent = 0;
+    while ( sent < size ) { /* a pipe may take just a part of a big message */
+        if ( transport == T_MQ ) {
+            res = mq_send( ch->wfd, buffer, size, 0 ) == 0 ? (ssize_t)size : -1;
+        } else {
+            res = write( ch->wfd, buffer + sent, size - sent );
+        }
+        if ( res < 0 ) {
+            if ( errno != EAGAIN || channel_wait( ch->wfd, POLLOUT ) != 0 ) {
+                return -1;
+            }
+            continue;
+        }
+        if ( transport != T_PIPE && (size_t)res != size ) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        sent += res;
+    }
+    return 0;
+}
+
+static int channel_recv( struct channel* ch, char* buffer ) {
+    ssize_t res;
+    size_t got = 0;
+    while ( got < size ) {
+        if ( transport == T_MQ ) {
+            res = mq_receive( ch->rfd, buffer, size, NULL );
+        } else {
+            res = read( ch->rfd, buffer + got, size - got );
+        }
+        if ( res < 0 ) {
+            if ( errno != EAGAIN || channel_wait( ch->rfd, POLLIN ) != 0 ) {
+                return -1;
+            }
+            continue;
+        }
+        if ( res == 0 ) {
+            errno = EPIPE;
+            return -1;
+        }
+        if ( transport != T_PIPE && (size_t)res != size ) { /* message boundaries are preserved */
+            errno = EMSGSIZE;
+            return -1;
+        }
+        got += res;
+    }
+    return 0;
+}
+
+/* A producer or a consumer runs in a child process and moves exactly msgs messages. */
+static int run_worker( struct channel* ch, long msgs, int producer ) {
+    long i;
+    char* buffer = malloc( size );
+    if ( buffer == NULL || channel_attach( ch ) != 0 ) {
+        perror( "worker" );
+        return 1;
+    }
+    memset( buffer, 'x', size );
+    for ( i = 0; i < msgs; ++i ) {
+        if ( ( producer ? channel_send( ch, buffer ) : channel_recv( ch, buffer ) ) != 0 ) {
+            perror( producer ? "send" : "recv" );
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Moves msgs messages from producers to consumers, all children contending for the channel. */
+static int run_throughput( struct channel* ch, long msgs, int producers, int consumers, double* elapsed ) {
+    int i, status, failed = 0;
+    double start = now();
+    pid_t pid;
+
+    for ( i = 0; i < producers + consumers; ++i ) {
+        pid = fork();
+        if ( pid < 0 ) {
+            perror( "fork" );
+            kill( 0, SIGKILL );
+            return 1;
+        }
+        if ( pid == 0 ) {
+            exit( i < producers ? run_worker( ch, share( msgs, producers, i ), 1 )
+                                : run_worker( ch, share( msgs, consumers, i - producers ), 0 ) );
+        }
+    }
+    for ( i = 0; i < producers + consumers; ++i ) {
+        wait( &status );
+        failed = failed || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0;
+    }
+    *elapsed = now() - start;
+    return failed;
+}
+
+static int compare_u64( const void* a, const void* b ) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Ping-pong with an echo child, one message in flight: each sample is a round trip through both channels. */
+static int run_latency( struct channel* req, struct channel* rep, long trips, uint64_t* samples ) {
+    long i;
+    int status;
+    uint64_t start;
+    char* buffer = malloc( size );
+    pid_t pid;
+
+    if ( buffer == NULL ) {
+        return 1;
+    }
+    memset( buffer, 'x', size );
+    pid = fork();
+    if ( pid < 0 ) {
+        perror( "fork" );
+        return 1;
+    }
+    if ( pid == 0 ) {
+        if ( channel_attach( req ) != 0 || channel_attach( rep ) != 0 ) {
+            exit( 1 );
+        }
+        for ( i = 0; i < trips; ++i ) {
+            if ( channel_recv( req, buffer ) != 0 || channel_send( rep, buffer ) != 0 ) {
+                perror( "echo" );
+                exit( 1 );
+            }
+        }
+        exit( 0 );
+    }
+
+    if ( channel_attach( req ) != 0 || channel_attach( rep ) != 0 ) {
+        kill( pid, SIGKILL );
+        return 1;
+    }
+    for ( i = 0; i < trips; ++i ) {
+        start = now_ns();
+        if ( channel_send( req, buffer ) != 0 || channel_recv( rep, buffer ) != 0 ) {
+            perror( "ping" );
+            kill( pid, SIGKILL );
+            return 1;
+        }
+        samples[i] = now_ns() - start;
+    }
+    wait( &status );
+    free( buffer );
+    qsort( samples, trips, sizeof( uint64_t ), compare_u64 );
+    return !WIFEXITED( status ) || WEXITSTATUS( status ) != 0;
+}
+
+/* One line of key=value pairs per run, as the other benchmarks, so that runs of different module versions
+ * (or transports) can be compared by a script. */
+int main( int argc, char** argv ) {
+    int opt, failed, producers = 1, consumers = 1;
+    long msgs = DEFAULT_MSGS, trips = DEFAULT_ROUND_TRIPS;
+    const char* device = DEVICE_FILE;
+    const char* reply = REPLY_FILE;
+    double elapsed = 0;
+    uint64_t* samples = NULL;
+    struct channel data, req, rep;
+
+    while ( ( opt = getopt( argc, argv, "t:d:D:n:s:p:c:l:Nb:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 't': transport = parse_transport( optarg ); break;
+            case 'd': device = optarg; break;
+            case 'D': reply = optarg; break;
+            case 'n': msgs = atol( optarg ); break;
+            case 's': size = strtoul( optarg, NULL, 10 ); break;
+            case 'p': producers = atoi( optarg ); break;
+            case 'c': consumers = atoi( optarg ); break;
+            case 'l': trips = atol( optarg ); break;
+            case 'N': non_blocking = 1; break;
+            case 'b': busy_poll = strtoul( optarg, NULL, 10 ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( transport < 0 || msgs <= 0 || size == 0 || size > LIMIT_MAX_MSG_SIZE || producers <= 0 || consumers <= 0 ||
+         trips < 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    printf( "transport=%s io=%s size=%zu producers=%d consumers=%d msgs=%ld ", transport_names[ transport ],
+            non_blocking ? "nonblocking" : "blocking", size, producers, consumers, msgs );
+    if ( transport == T_MAILSLOT && busy_poll > 0 ) {
+        printf( "busy_poll_us=%u ", busy_poll );
+    }
+    fflush( stdout ); /* not to be printed again by the children */
+
+    if ( channel_create( &data, device, 0 ) != 0 ) { /* e.g. a message queue bigger than msgsize_max */
+        printf( "error=\"%s\"\n", strerror( errno ) );
+        return 2;
+    }
+    failed = run_throughput( &data, msgs, producers, consumers, &elapsed );
+    channel_destroy( &data );
+    if ( failed ) {
+        printf( "error=\"throughput run failed\"\n" );
+        return 1;
+    }
+    printf( "seconds=%.3f msgs/sec=%.0f MB/sec=%.1f", elapsed, msgs / elapsed, msgs * size / elapsed / 1e6 );
+    fflush( stdout );
+
+    if ( trips > 0 ) {
+        samples = malloc( trips * sizeof( uint64_t ) );
+        if ( samples == NULL || channel_create( &req, device, 1 ) != 0 || channel_create( &rep, reply, 2 ) != 0 ) {
+            printf( " error=\"%s\"\n", strerror( errno ) );
+            return 2;
+        }
+        failed = run_latency( &req, &rep, trips, samples );
+        channel_destroy( &req );
+        channel_destroy( &rep );
+        if ( failed ) {
+            printf( " error=\"latency run failed\"\n" );
+            return 1;
+        }
+        printf( " rtt_p50_us=%.2f rtt_p99_us=%.2f rtt_p999_us=%.2f", samples[ trips / 2 ] / 1e3,
+                samples[ trips * 99 / 100 ] / 1e3, samples[ trips * 999 / 1000 ] / 1e3 );
+        free( samples );
+    }
+    printf( "\n" );
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "../src/mailslot.h"
+#include "../src/mailslot_driver.h"
+
+#define DEVICE_FILE "/dev/test_mailslot"
+#define DEFAULT_MSGS 1000000
+#define DEFAULT_SIZE 12
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_mode( const char* name ) {
+    if ( strcmp( name, "list" ) == 0 ) {
+        return MAILSLOT_MODE_LIST;
+    }
+    if ( strcmp( name, "ring" ) == 0 ) {
+        return MAILSLOT_MODE_RING;
+    }
+    if ( strcmp( name, "shared" ) == 0 ) {
+        return MAILSLOT_MODE_SHARED;
+    }
+    if ( strcmp( name, "sharded" ) == 0 ) {
+        return MAILSLOT_MODE_SHARDED;
+    }
+    return -1;
+}
+
+static void usage( const char* prog ) {
+    fprintf( stderr, "usage: %s [-d device] [-m list|ring|shared|sharded] [-n msgs] [-s size] [-w writers] [-r readers] "
+                     "[-M numa node]\n", prog );
+}
+
+/* Returns the share of msgs moved by the i-th of n processes. */
+static long share( long msgs, int n, int i ) {
+    return msgs / n + ( i < msgs % n ? 1 : 0 );
+}
+
+/* A writer runs in a child process and enqueues exactly msgs messages. */
+static int run_writer( const char* device, long msgs, size_t size ) {
+    long i;
+    char* buffer = malloc( size );
+    int fd = open( device, O_WRONLY );
+    if ( fd < 0 || buffer == NULL ) {
+        perror( "open (writer)" );
+        return 1;
+    }
+    memset( buffer, 'x', size );
+    for ( i = 0; i < msgs; ++i ) {
+        if ( write( fd, buffer, size ) != (ssize_t)size ) {
+            perror( "write" );
+            close( fd );
+            return 1;
+        }
+    }
+    close( fd );
+    return 0;
+}
+
+/* A reader runs in a child process and drains exactly msgs messages. */
+static int run_reader( const char* device, long msgs, size_t size ) {
+    long i;
+    char* buffer = malloc( size );
+    int fd = open( device, O_RDONLY );
+    if ( fd < 0 || buffer == NULL ) {
+        perror( "open (reader)" );
+        return 1;
+    }
+    for ( i = 0; i < msgs; ++i ) {
+        if ( read( fd, buffer, size ) != (ssize_t)size ) {
+            perror( "read" );
+            close( fd );
+            return 1;
+        }
+    }
+    close( fd );
+    return 0;
+}
+
+int main( int argc, char** argv ) {
+    static const char* mode_names[] = { "list", "ring", "shared", "broadcast", "sharded" };
+    int opt, fd, i, status, failed = 0;
+    int mode = MAILSLOT_MODE_LIST, writers = 1, readers = 1, node = MAILSLOT_NODE_LOCAL;
+    long msgs = DEFAULT_MSGS;
+    size_t size = DEFAULT_SIZE;
+    const char* device = DEVICE_FILE;
+    double start, elapsed;
+    pid_t pid;
+
+    while ( ( opt = getopt( argc, argv, "d:m:n:s:w:r:M:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'd': device = optarg; break;
+            case 'm': mode = parse_mode( optarg ); break;
+            case 'n': msgs = atol( optarg ); break;
+            case 's': size = strtoul( optarg, NULL, 10 ); break;
+            case 'w': writers = atoi( optarg ); break;
+            case 'r': readers = atoi( optarg ); break;
+            case 'M': node = atoi( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( mode < 0 || msgs <= 0 || size == 0 || size > LIMIT_MAX_MSG_SIZE || writers <= 0 || readers <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    fd = open( device, O_WRONLY );
+    if ( fd < 0 ) {
+        perror( "open" );
+        return 1;
+    }
+    if ( ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, size ) != 0 || ioctl( fd, MAILSLOT_SET_MODE, mode ) != 0 ) {
+        perror( "ioctl (the slot must be empty)" );
+        return 1;
+    }
+    if ( node != MAILSLOT_NODE_LOCAL && ioctl( fd, MAILSLOT_SET_NUMA_NODE, node ) != 0 ) {
+        perror( "ioctl (NUMA node)" );
+        return 1;
+    }
+
+    /* all the writers and readers are children: the slot is contended from both sides */
+    start = now();
+    for ( i = 0; i < writers + readers; ++i ) {
+        pid = fork();
+        if ( pid < 0 ) {
+            perror( "fork" );
+            kill( 0, SIGKILL );
+            return 1;
+        }
+        if ( pid == 0 ) {
+            return i < writers ? run_writer( device, share( msgs, writers, i ), size )
+                               : run_reader( device, share( msgs, readers, i - writers ), size );
+        }
+    }
+    for ( i = 0; i < writers + readers; ++i ) {
+        wait( &status );
+        failed = failed || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0;
+    }
+    elapsed = now() - start;
+
+    printf( "mode=%s size=%zu writers=%d readers=%d node=%d msgs=%ld seconds=%.3f msgs/sec=%.0f MiB/sec=%.1f\n",
+            mode_names[ mode ], size, writers, readers, node, msgs, elapsed, msgs / elapsed, msgs * size / elapsed / ( 1 << 20 ) );
+
+    ioctl( fd, MAILSLOT_SET_NUMA_NODE, MAILSLOT_NODE_LOCAL );
+    ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+    ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
+    close( fd );
+    return failed;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <liburing.h>
+
+#include "../src/mailslot.h"
+#include "../src/mailslot_driver.h"
+
+#define DEVICE_FILE "/dev/test_mailslot"
+#define DEFAULT_MSGS 1000000
+#define DEFAULT_SIZE 12
+#define DEFAULT_DEPTH 16
+
+#define OP_WRITE 0
+#define OP_READ  1
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage( const char* prog ) {
+    fprintf( stderr, "usage: %s [-d device] [-m list|ring] [-n msgs] [-s size] [-q depth]\n", prog );
+}
+
+/* Queues a read or a write of a message, tagging it with its opcode and the index of its buffer. */
+static int queue_op( struct io_uring* ring, int fd, int op, int index, char* buffer, size_t size ) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe( ring );
+    if ( sqe == NULL ) {
+        return -1;
+    }
+    if ( op == OP_WRITE ) {
+        io_uring_prep_write( sqe, fd, buffer, size, 0 );
+    } else {
+        io_uring_prep_read( sqe, fd, buffer, size, 0 );
+    }
+    io_uring_sqe_set_data64( sqe, ( (__u64)index << 1 ) | op );
+    return 0;
+}
+
+/* A single thread keeps depth writes and depth reads in flight on the slot: with FMODE_NOWAIT, the kernel arms
+ * poll on the slot for the ones which would block, instead of handing them to io-wq worker threads. */
+int main( int argc, char** argv ) {
+    int opt, fd, i, error, mode = MAILSLOT_MODE_LIST, depth = DEFAULT_DEPTH;
+    long msgs = DEFAULT_MSGS, writes = 0, reads = 0, completed = 0;
+    size_t size = DEFAULT_SIZE;
+    const char* device = DEVICE_FILE;
+    char* wbuffer = NULL;
+    char* rbuffers = NULL;
+    double start, elapsed;
+    struct io_uring ring;
+    struct io_uring_cqe* cqe;
+    unsigned head, seen;
+
+    while ( ( opt = getopt( argc, argv, "d:m:n:s:q:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'd': device = optarg; break;
+            case 'm': mode = strcmp( optarg, "ring" ) == 0 ? MAILSLOT_MODE_RING : MAILSLOT_MODE_LIST; break;
+            case 'n': msgs = atol( optarg ); break;
+            case 's': size = strtoul( optarg, NULL, 10 ); break;
+            case 'q': depth = atoi( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( msgs <= 0 || size == 0 || size > LIMIT_MAX_MSG_SIZE || depth <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    fd = open( device, O_RDWR );
+    if ( fd < 0 ) {
+        perror( "open" );
+        return 1;
+    }
+    if ( ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, size ) != 0 || ioctl( fd, MAILSLOT_SET_MODE, mode ) != 0 ) {
+        perror( "ioctl (the slot must be empty)" );
+        return 1;
+    }
+
+    /* all the writes share a buffer, each read has its own */
+    wbuffer = malloc( size );
+    rbuffers = malloc( size * depth );
+    if ( wbuffer == NULL || rbuffers == NULL ) {
+        perror( "malloc" );
+        return 1;
+    }
+    memset( wbuffer, 'x', size );
+
+    error = io_uring_queue_init( 2 * depth, &ring, 0 );
+    if ( error ) {
+        fprintf( stderr, "io_uring_queue_init: %s\n", strerror( -error ) );
+        return 1;
+    }
+
+    start = now();
+    for ( i = 0; i < depth && writes < msgs; ++i, ++writes ) {
+        queue_op( &ring, fd, OP_WRITE, 0, wbuffer, size );
+    }
+    for ( i = 0; i < depth && reads < msgs; ++i, ++reads ) {
+        queue_op( &ring, fd, OP_READ, i, rbuffers + i * size, size );
+    }
+
+    while ( completed < msgs ) {
+        error = io_uring_submit_and_wait( &ring, 1 );
+        if ( error < 0 ) {
+            fprintf( stderr, "io_uring_submit_and_wait: %s\n", strerror( -error ) );
+            return 1;
+        }
+        seen = 0;
+        io_uring_for_each_cqe( &ring, head, cqe ) {
+            seen++;
+            if ( cqe->res != (int)size ) {
+                fprintf( stderr, "%s: %s\n", ( cqe->user_data & 1 ) == OP_WRITE ? "write" : "read",
+                         cqe->res < 0 ? strerror( -cqe->res ) : "short transfer" );
+                return 1;
+            }
+            i = cqe->user_data >> 1;
+            if ( ( cqe->user_data & 1 ) == OP_WRITE ) {
+                if ( writes < msgs ) {
+                    queue_op( &ring, fd, OP_WRITE, 0, wbuffer, size );
+                    writes++;
+                }
+            } else {
+                completed++;
+                if ( reads < msgs ) {
+                    queue_op( &ring, fd, OP_READ, i, rbuffers + i * size, size );
+                    reads++;
+                }
+            }
+        }
+        io_uring_cq_advance( &ring, seen );
+    }
+    elapsed = now() - start;
+
+    printf( "path=uring mode=%s size=%zu depth=%d msgs=%ld seconds=%.3f msgs/sec=%.0f MiB/sec=%.1f\n",
+            mode == MAILSLOT_MODE_RING ? "ring" : "list", size, depth, msgs, elapsed, msgs / elapsed,
+            msgs * size / elapsed / ( 1 << 20 ) );
+
+    io_uring_queue_exit( &ring );
+    ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+    ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
+    close( fd );
+    free( wbuffer );
+    free( rbuffers );
+    return 0;
+}
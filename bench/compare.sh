@@ -0,0 +1,23 @@
+#!/bin/sh
+# Throughput and round-trip latency of a slot against pipes, POSIX message queues and UNIX datagram sockets, for
+# 1 to 4 producers and consumers, a few message sizes and blocking/non-blocking I/O. Each run prints a line of
+# key=value pairs; the runs a transport cannot do (e.g. messages bigger than the mq msgsize_max) print an error.
+# Blocking runs of the slot are repeated with readers spinning for 50 us before sleeping (busy poll).
+# Usage: bench/compare.sh [msgs] [round trips]
+
+BENCH=$(dirname "$0")/bench_compare
+MSGS=${1:-1000000}
+TRIPS=${2:-100000}
+
+for transport in mailslot pipe mq unix; do
+    for size in 64 4096 65536; do
+        for io in "" -N; do
+            for n in 1 2 4; do
+                "$BENCH" -t $transport -n "$MSGS" -s $size -p $n -c $n -l "$TRIPS" $io
+                if [ $transport = mailslot ] && [ -z "$io" ]; then
+                    "$BENCH" -t $transport -n "$MSGS" -s $size -p $n -c $n -l "$TRIPS" -b 50
+                fi
+            done
+        done
+    done
+done
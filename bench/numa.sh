@@ -0,0 +1,20 @@
+#!/bin/sh
+# Throughput of a slot whose writers and readers all run on node 0, with the messages (and the ring, in ring mode)
+# allocated on node 0 and on each remote node, for a few message sizes: the gap is the cost of remote memory.
+# Requires numactl; on a single node machine only the local runs take place.
+# Usage: bench/numa.sh [msgs] [writers and readers]
+
+BENCH=$(dirname "$0")/bench_mailslot
+MSGS=${1:-1000000}
+N=${2:-1}
+NODES=$(numactl --hardware | awk '/^available:/ { print $2 }')
+
+for mode in list ring; do
+    for size in 64 4096 65536; do
+        node=0
+        while [ $node -lt "$NODES" ]; do
+            numactl --cpunodebind=0 "$BENCH" -m $mode -n "$MSGS" -s $size -w "$N" -r "$N" -M $node || exit 1
+            node=$((node + 1))
+        done
+    done
+done
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Throughput of a slot with 1 to 16 writers and as many readers, for each kernel-side storage mode: a slot in list
+# mode is a single queue, whereas in sharded mode each CPU has its own.
+# Usage: bench/scaling.sh [msgs] [size]
+
+BENCH=$(dirname "$0")/bench_mailslot
+MSGS=${1:-1000000}
+SIZE=${2:-64}
+
+for mode in list ring sharded; do
+    for n in 1 2 4 8 16; do
+        "$BENCH" -m $mode -n "$MSGS" -s "$SIZE" -w $n -r $n || exit 1
+    done
+done
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Throughput of a slot with a writer and a reader, for message sizes from 64 bytes to 4 MiB.
+# Usage: bench/sizes.sh [bytes per run]
+
+BENCH=$(dirname "$0")/bench_mailslot
+BYTES=${1:-1073741824}
+
+for mode in list ring; do
+    size=64
+    while [ $size -le 4194304 ]; do
+        msgs=$(( BYTES / size ))
+        [ $msgs -lt 256 ] && msgs=256
+        "$BENCH" -m $mode -n $msgs -s $size || exit 1
+        size=$(( size * 4 ))
+    done
+done
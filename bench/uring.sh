@@ -0,0 +1,14 @@
+#!/bin/sh
+# Throughput of the blocking path (a writer and a reader process) against io_uring (a single thread with a growing
+# number of reads and writes in flight), for a few message sizes.
+# Usage: bench/uring.sh [msgs]
+
+DIR=$(dirname "$0")
+MSGS=${1:-1000000}
+
+for size in 64 4096 65536; do
+    "$DIR"/bench_mailslot -n "$MSGS" -s $size || exit 1
+    for depth in 1 4 16 64; do
+        "$DIR"/bench_uring -n "$MSGS" -s $size -q $depth || exit 1
+    done
+done
@@ -17,197 +17,2449 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include "mailslot.h"
+#include "mailslot_ring.h"
+#include "mailslot_stats.h"
 
 #include <linux/slab.h>    /* for kzalloc */
+#include <linux/gfp.h>     /* for alloc_page */
+#include <linux/mm.h>      /* for kvmalloc */
+#include <linux/vmalloc.h> /* for __vmalloc */
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
 #include <linux/mutex.h>   /* for mutex */
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/percpu.h>  /* for the shards */
+#include <linux/cpumask.h>
+#include <linux/nodemask.h> /* for node_online */
+#include <linux/topology.h> /* for numa_node_id */
 #include <linux/uaccess.h> /* for copy_to_user and copy_from_user functions */
 #include <linux/wait.h>    /* for wait_queue */
+#include <linux/poll.h>    /* for poll_wait */
+#include <linux/sched.h>   /* for current pointer */
+#include <linux/sched/clock.h> /* for local_clock */
+#include <linux/pipe_fs_i.h> /* for splice */
+
+#define CREATE_TRACE_POINTS
+#include "mailslot_trace.h"
+
+DEFINE_STATIC_KEY_FALSE( mailslot_debug_enabled );
+
+#define MAILSLOT_INLINE_SIZE PAGE_SIZE /* bigger contents are kept in a vector of pages */
 
 typedef struct message {
-    char* content;
+    char* content;       /* content of up to MAILSLOT_INLINE_SIZE bytes */
+    struct page** pages; /* or the pages of a bigger one */
     size_t size;
+    u64 tstamp; /* enqueue time */
+    pid_t pid;  /* writer */
+    int lane;   /* priority of the message */
     struct message* next;
+    u64 seq;          /* broadcast mode: position of the message in the stream of the slot */
+    refcount_t refs;  /* broadcast mode: held by the ring of the slot and by the readers copying the message */
+    atomic_t pending; /* broadcast mode: subscribers which have still to read the message */
 } message_t;
 
-struct mailslot {
-    struct mutex mutex;
-    wait_queue_head_t rd_queue, wr_queue;
-    message_t* head;
+/* a subscriber of a slot in broadcast mode, reading all the messages through its own cursor */
+struct mailslot_sub {
+    struct mutex lock; /* serializes the reads through the cursor (e.g. threads sharing a file) */
+    u64 next;          /* seq of the next message to read */
+    u64 dropped;       /* messages overwritten before being read (drop policy) */
+};
+
+/* a reader parked on an empty slot in list mode, to which a writer can hand its message directly */
+typedef struct mailslot_waiter {
+    struct list_head node;
+    struct task_struct* task;
+    size_t size;    /* size of the buffer of the reader */
+    message_t* msg; /* set by the writer, under the consumers lock */
+} mailslot_waiter_t;
+
+/* a list of a slot in sharded mode, holding the messages written through the files opened on a CPU */
+struct mailslot_shard {
+    spinlock_t lock;
+    message_t* head; /* oldest message, NULL if the shard is empty */
     message_t* tail;
+};
+
+/* the ring of a slot in ring or shared mode */
+typedef struct mailslot_storage {
+    struct mailslot_ring_view view; /* trusted geometry: in shared mode the header is writable by user space */
+    size_t size;                    /* size in bytes of the ring, header included */
+    int shared;                     /* allocated via __vmalloc, so that its pages can be mapped */
+} mailslot_storage_t;
+
+/* Readers and writers never wait for each other: in list mode the slot is a two-lock queue (with a dummy node, so
+ * producers only touch the tail and consumers only the head), in ring and shared mode it's a lock-free ring.
+ * In list mode each priority has its own FIFO lane: a bitmap of the lanes holding messages lets consumers find
+ * the highest non-empty one with a single find-last-set, however long the lanes are.
+ * The configuration of the slot is changed only holding config for writing, i.e. with no operation in progress. */
+struct mailslot {
+    struct percpu_rw_semaphore config;
+    mailslot_storage_t __rcu* storage; /* NULL in list mode: poll and sleepers access it under RCU */
+    struct mutex storage_lock;         /* serializes mmap with the replacement of the storage */
+    atomic_t mappings;                 /* number of vmas mapping the storage (shared mode only) */
+    size_t ring_budget;                /* bytes requested for the ring by the mode change (0: no limit) */
     size_t max_msg_size;
-    int msg_count;
+    int max_msgs;                      /* capacity limits set via mailslot_set_capacity */
+    size_t max_bytes;                  /* 0: no limit */
+    int capacity;                      /* max_msgs, or the number of cells of the ring */
+    int mode;
+    int node; /* NUMA node of the messages and of the ring, or MAILSLOT_NODE_LOCAL, MAILSLOT_NODE_READER */
     int id; /* needed only to help debugging! */
+    struct mailslot_stats __percpu* stats;
+    struct dentry* debugfs;
+
+    /* producers side (list mode) */
+    spinlock_t prod_lock ____cacheline_aligned_in_smp;
+    message_t* tail[ MAILSLOT_LANES ];
+    atomic_t used;            /* messages in the list or being copied by producers */
+    atomic_long_t used_bytes; /* content bytes of the same messages (in broadcast mode, of the unread ones) */
+
+    /* broadcast mode: each message is copied once and kept in a ring (under prod_lock) until overwritten,
+     * the subscribers read it through their own cursor */
+    message_t** bcast; /* capacity entries: the message seq is at seq % capacity */
+    u64 bcast_tail;    /* seq of the next message */
+    int subscribers;
+    int bcast_policy;  /* what to do when a subscriber lags capacity messages behind */
+
+    /* watermarks (0: not set), as SO_RCVLOWAT and SO_SNDLOWAT: readers other than subscribers are woken up once
+     * rd_lowat messages or rd_lowat_bytes bytes are queued, or after rd_flush jiffies of waiting if any message is;
+     * writers waiting for room are woken up once fewer than wr_lowat messages are queued */
+    int rd_lowat;
+    size_t rd_lowat_bytes;
+    long rd_flush;
+    int wr_lowat;
+    atomic_t wr_blocked; /* writers sleeping for room: the read watermarks no longer hold, not to wait for each other */
+
+    /* sharded mode: the limits are still enforced through used and used_bytes, which cost an atomic operation per
+     * message, whereas the lists are locked on their own */
+    struct mailslot_shard __percpu* shards;
+
+    /* consumers side (list mode) */
+    spinlock_t cons_lock ____cacheline_aligned_in_smp;
+    message_t* head[ MAILSLOT_LANES ]; /* dummy nodes: the oldest message of a lane is head[lane]->next */
+    unsigned long lanes;               /* bit i is set if lane i may hold messages (set by producers) */
+    atomic_t msg_count;                /* in broadcast mode, the messages not yet read by every subscriber */
+    struct list_head parked; /* mailslot_waiter_t, parked only while the list is empty */
+
+    wait_queue_head_t rd_queue ____cacheline_aligned_in_smp;
+    wait_queue_head_t wr_queue;
 };
 
-mailslot_t* mailslot_alloc( void ) {
-    return kzalloc( sizeof( mailslot_t ), GFP_KERNEL );
+/* Prints the queue only when debugging, since it walks all the messages. */
+static inline void mailslot_debug_printqueue( mailslot_t* slot ) {
+    if ( static_branch_unlikely( &mailslot_debug_enabled ) ) {
+        mailslot_printqueue( slot );
+    }
 }
 
-void mailslot_init( mailslot_t* slot, int id ) {
-    mutex_init( &( slot->mutex ) );
-    init_waitqueue_head( &( slot->rd_queue ) );
-    init_waitqueue_head( &( slot->wr_queue ) );
-    slot->head = NULL;
-    slot->tail = NULL;
-    slot->max_msg_size = DEFAULT_MAX_MSG_SIZE;
-    slot->id = id;
+/* Data operations run concurrently, holding the configuration for reading. */
+static int mailslot_enter( mailslot_t* slot, int non_blocking ) {
+    if ( !non_blocking ) {
+        percpu_down_read( &( slot->config ) );
+    } else if ( !percpu_down_read_trylock( &( slot->config ) ) ) {
+        mailslot_debug( "mailslot (id %d): the configuration of the slot is being changed\n", slot->id );
+        mailslot_account_error( slot, -EAGAIN );
+        return -EAGAIN;
+    }
+    return 0;
 }
 
-ssize_t mailslot_enqueue( mailslot_t* slot, const char* content, size_t size, int non_blocking ) {
-    int error;
-    int count = slot->msg_count;
-    message_t* msg = NULL;
+static inline void mailslot_exit( mailslot_t* slot ) {
+    percpu_up_read( &( slot->config ) );
+}
 
-    if ( count == MAX_SLOT_SIZE ) {
-        printk( KERN_ERR "mailslot (id %d): cannot enqueue msg, slot is full\n", slot->id );
-        return -ENOSPC;
+static inline void mailslot_spin_lock( mailslot_t* slot, spinlock_t* lock, int consumer ) {
+    u64 start = mailslot_stats_clock();
+    spin_lock( lock );
+    mailslot_stats_hist( slot->stats, lock_wait, start );
+    trace_mailslot_lock( slot->id, consumer );
+}
+
+/* Returns the storage of the slot, which is replaced only holding the configuration for writing. */
+static inline mailslot_storage_t* mailslot_storage( mailslot_t* slot ) {
+    return rcu_dereference_protected( slot->storage, lockdep_is_held( &( slot->config ) ) );
+}
+
+/* Returns the node on which the messages are allocated (NUMA_NO_NODE: the local node of the caller). */
+static inline int mailslot_msg_node( mailslot_t* slot ) {
+    int node = READ_ONCE( slot->node );
+    return node >= 0 ? node : NUMA_NO_NODE;
+}
+
+/* The first reader of a slot placed on the node of its reader claims the slot for its node. */
+static inline void mailslot_node_claim( mailslot_t* slot ) {
+    if ( unlikely( READ_ONCE( slot->node ) == MAILSLOT_NODE_READER ) ) {
+        cmpxchg( &( slot->node ), MAILSLOT_NODE_READER, numa_node_id() );
     }
+}
+
+/* Returns the number of messages in the slot: in shared mode it's read from the ring, which user space may change. */
+static int mailslot_count( mailslot_t* slot ) {
+    int count;
+    mailslot_storage_t* storage = NULL;
 
-    if ( size > slot->max_msg_size ) { /* all or nothing */
-        printk( KERN_ERR "mailslot (id %d): cannot write msg, size (%lu) greater than max allowed by the slot (%lu)\n", slot->id, size, slot->max_msg_size );
-        return -EPERM;
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    count = storage != NULL ? mailslot_ring_count( &( storage->view ) ) : atomic_read( &( slot->msg_count ) );
+    rcu_read_unlock();
+    return count;
+}
+
+/* Returns whether a message can be read; in shared mode a reader about to sleep (sleeper) raises readers_waiting
+ * first, so that user space producers know they must issue a MAILSLOT_RING_NOTIFY. */
+static int mailslot_readable( mailslot_t* slot, int sleeper ) {
+    int readable;
+    mailslot_storage_t* storage = NULL;
+
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    if ( storage == NULL ) {
+        readable = atomic_read( &( slot->msg_count ) ) > 0;
+    } else {
+        if ( storage->shared && sleeper ) {
+            WRITE_ONCE( storage->view.ring->readers_waiting, 1 );
+            smp_mb(); /* pairs with the barrier in mailslot_ring_need_notify */
+        }
+        readable = mailslot_ring_readable( &( storage->view ) );
     }
+    rcu_read_unlock();
+    return readable;
+}
 
-    msg = kzalloc( sizeof( message_t ), non_blocking ? GFP_ATOMIC : GFP_KERNEL );
-    if ( msg == NULL ) {
-        printk( KERN_ERR "mailslot (id %d): failed to allocate space for the new msg\n", slot->id );
-        return non_blocking ? -EAGAIN : -ENOMEM;
+/* Returns whether the subscriber sub (if not NULL) has messages to read; in broadcast mode the slot is never readable
+ * by the others. */
+static int mailslot_sub_readable( mailslot_t* slot, mailslot_sub_t* sub, int sleeper ) {
+    if ( sub != NULL ) {
+        return READ_ONCE( sub->next ) != READ_ONCE( slot->bcast_tail );
     }
+    return READ_ONCE( slot->mode ) != MAILSLOT_MODE_BROADCAST && mailslot_readable( slot, sleeper );
+}
 
-    msg->content = kzalloc( size, non_blocking ? GFP_ATOMIC : GFP_KERNEL );
-    if ( msg->content == NULL ) {
-        printk( KERN_ERR "mailslot (id %d): failed to allocate space for the new msg's content\n", slot->id );
-        kfree( msg );
-        return non_blocking ? -EAGAIN : -ENOMEM;
+int mailslot_has_room( mailslot_t* slot, int n, size_t bytes, int sleeper ) {
+    int writable;
+    size_t max_bytes;
+    mailslot_storage_t* storage = NULL;
+
+    if ( READ_ONCE( slot->mode ) == MAILSLOT_MODE_BROADCAST ) { /* the unread messages are the newest ones */
+        return READ_ONCE( slot->bcast_policy ) == MAILSLOT_BCAST_DROP ||
+               atomic_read( &( slot->msg_count ) ) + n <= READ_ONCE( slot->capacity );
     }
 
-    if ( non_blocking ) { /* disabling the pagefault handler, so that copy_from_user won't sleep */
-        pagefault_disable();
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    if ( storage == NULL ) {
+        max_bytes = READ_ONCE( slot->max_bytes );
+        writable = atomic_read( &( slot->used ) ) + n <= READ_ONCE( slot->max_msgs ) &&
+                   ( max_bytes == 0 || atomic_long_read( &( slot->used_bytes ) ) + bytes <= max_bytes );
+    } else {
+        if ( storage->shared && sleeper ) {
+            WRITE_ONCE( storage->view.ring->writers_waiting, 1 );
+            smp_mb();
+        }
+        writable = n == 1 ? mailslot_ring_writable( &( storage->view ) )
+                          : mailslot_ring_count( &( storage->view ) ) + n <= storage->view.mask + 1;
     }
-    error = copy_from_user( msg->content, content, size );
-    if ( non_blocking ) {
-        pagefault_enable();
+    rcu_read_unlock();
+    return writable;
+}
+
+static inline void mailslot_account_enqueue( mailslot_t* slot, size_t size ) {
+    mailslot_stats_inc( slot->stats, enqueued );
+    mailslot_stats_add( slot->stats, bytes_in, size );
+    mailslot_stats_occupancy( slot->stats, mailslot_count( slot ) );
+}
+
+static inline void mailslot_account_dequeue( mailslot_t* slot, size_t size ) {
+    mailslot_stats_inc( slot->stats, dequeued );
+    mailslot_stats_add( slot->stats, bytes_out, size );
+}
+
+int mailslot_capacity( mailslot_t* slot ) {
+    return READ_ONCE( slot->capacity );
+}
+
+static void mailslot_msg_free_content( message_t* msg ) {
+    size_t i;
+    if ( msg->pages != NULL ) {
+        for ( i = 0; i < DIV_ROUND_UP( msg->size, PAGE_SIZE ); i++ ) {
+            __free_page( msg->pages[i] );
+        }
+        kvfree( msg->pages );
     }
-    if ( error ) {
-        printk( KERN_ERR "mailslot (id %d): failed to copy msg from user space\n", slot->id );
-        kfree( msg->content );
+    kfree( msg->content );
+    msg->content = NULL;
+    msg->pages = NULL;
+}
+
+static void mailslot_msg_free( message_t* msg ) {
+    mailslot_msg_free_content( msg );
+    kfree( msg );
+}
+
+/* Allocates the content of a message on a node: a big one takes order-0 pages only, which don't fail under fragmentation. */
+static int mailslot_msg_alloc_content( message_t* msg, size_t size, int node ) {
+    size_t i, nr_pages = DIV_ROUND_UP( size, PAGE_SIZE );
+
+    msg->size = size;
+    msg->content = NULL;
+    msg->pages = NULL;
+    if ( size <= MAILSLOT_INLINE_SIZE ) {
+        msg->content = kmalloc_node( size, GFP_KERNEL_ACCOUNT, node );
+        return msg->content == NULL ? -ENOMEM : 0;
+    }
+
+    msg->pages = kvzalloc_node( array_size( nr_pages, sizeof( struct page* ) ), GFP_KERNEL_ACCOUNT, node );
+    if ( msg->pages == NULL ) {
+        return -ENOMEM;
+    }
+    for ( i = 0; i < nr_pages; i++ ) {
+        msg->pages[i] = alloc_pages_node( node, GFP_KERNEL_ACCOUNT, 0 );
+        if ( msg->pages[i] == NULL ) {
+            while ( i-- > 0 ) {
+                __free_page( msg->pages[i] );
+            }
+            kvfree( msg->pages );
+            msg->pages = NULL;
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* Copies the content of a message from an iterator (user space, or pipe pages), a page at a time;
+ * it returns the bytes not copied. */
+static size_t mailslot_msg_copy_in( message_t* msg, struct iov_iter* from ) {
+    size_t offset, chunk;
+
+    if ( msg->pages == NULL ) {
+        return msg->size - copy_from_iter( msg->content, msg->size, from );
+    }
+    for ( offset = 0; offset < msg->size; offset += chunk ) {
+        chunk = min_t( size_t, msg->size - offset, PAGE_SIZE );
+        if ( copy_from_iter( page_address( msg->pages[ offset / PAGE_SIZE ] ), chunk, from ) != chunk ) {
+            return msg->size - offset;
+        }
+    }
+    return 0;
+}
+
+/* Copies the content of a message to user space, a page at a time; it returns the bytes not copied. */
+static unsigned long mailslot_msg_copy_out( const message_t* msg, char __user* dst ) {
+    size_t offset, chunk;
+
+    if ( msg->pages == NULL ) {
+        return copy_to_user( dst, msg->content, msg->size );
+    }
+    for ( offset = 0; offset < msg->size; offset += chunk ) {
+        chunk = min_t( size_t, msg->size - offset, PAGE_SIZE );
+        if ( copy_to_user( dst + offset, page_address( msg->pages[ offset / PAGE_SIZE ] ), chunk ) ) {
+            return msg->size - offset;
+        }
+    }
+    return 0;
+}
+
+/* Writes the header of the record of a message for the caller of the dequeue (if any), before the message is taken. */
+static int mailslot_hdr_put( mailslot_hdr_t* hdr, u64 tstamp, pid_t pid, int prio, size_t size ) {
+    mailslot_meta_t meta;
+    if ( hdr == NULL ) {
+        return 0;
+    }
+    meta.tstamp = tstamp;
+    meta.pid = pid;
+    meta.prio = prio;
+    return hdr->put( hdr, &meta, size );
+}
+
+/* Moves the content and the metadata of a message to another node (e.g. a dummy one, whose fields are unused). */
+static void mailslot_msg_move( message_t* dst, message_t* src ) {
+    dst->content = src->content;
+    dst->pages = src->pages;
+    dst->size = src->size;
+    dst->tstamp = src->tstamp;
+    dst->pid = src->pid;
+    dst->lane = src->lane;
+    src->content = NULL;
+    src->pages = NULL;
+}
+
+/* Allocates a message and copies its content, i.e. what is left in the iterator (no locks held). */
+static message_t* mailslot_msg_new( mailslot_t* slot, struct iov_iter* content, int lane ) {
+    size_t size = iov_iter_count( content );
+    int node = mailslot_msg_node( slot );
+    message_t* msg = kmalloc_node( sizeof( message_t ), GFP_KERNEL_ACCOUNT, node ); /* charged to the memory cgroup of the writer */
+    if ( msg == NULL ) {
+        mailslot_debug( "mailslot (id %d): failed to allocate space for the new msg\n", slot->id );
+        return ERR_PTR( -ENOMEM );
+    }
+
+    if ( mailslot_msg_alloc_content( msg, size, node ) ) {
+        mailslot_debug( "mailslot (id %d): failed to allocate space for the new msg's content\n", slot->id );
         kfree( msg );
-        return -EFAULT;
+        return ERR_PTR( -ENOMEM );
     }
-    msg->size = size;
+
+    if ( mailslot_msg_copy_in( msg, content ) ) {
+        mailslot_debug( "mailslot (id %d): failed to copy msg from user space\n", slot->id );
+        mailslot_msg_free( msg );
+        return ERR_PTR( -EFAULT );
+    }
+    msg->tstamp = ktime_get_ns();
+    msg->pid = task_tgid_nr( current );
+    msg->lane = lane;
     msg->next = NULL;
+    return msg;
+}
 
-    if ( count == 0 ) {
-        slot->head = msg;
-    } else {
-        slot->tail->next = msg;
+/* Returns the highest priority lane holding messages, or -1 if the list is empty (consumers lock held).
+ * Producers set the bit of a lane after linking to it, so a bit found set on an empty lane is cleared and the lane
+ * is checked again, not to miss a concurrent producer: each lane is visited at most once. */
+static int mailslot_list_front( mailslot_t* slot ) {
+    int lane;
+    unsigned long lanes;
+
+    while ( ( lanes = READ_ONCE( slot->lanes ) ) != 0 ) {
+        lane = __fls( lanes );
+        if ( smp_load_acquire( &( slot->head[ lane ]->next ) ) != NULL ) {
+            return lane;
+        }
+        clear_bit( lane, &( slot->lanes ) );
+        smp_mb__after_atomic(); /* pairs with the barrier in mailslot_list_put */
+        if ( smp_load_acquire( &( slot->head[ lane ]->next ) ) != NULL ) {
+            set_bit( lane, &( slot->lanes ) );
+            return lane;
+        }
+    }
+    return -1;
+}
+
+/* Hands a single message to the first reader parked on the slot, if the list is still empty (so that the order
+ * of the messages is preserved) and the buffer of the reader is large enough. The message keeps counting in used
+ * until the reader is done with it. */
+static int mailslot_list_handoff( mailslot_t* slot, message_t* msg ) {
+    mailslot_waiter_t* waiter = NULL;
+
+    if ( list_empty_careful( &( slot->parked ) ) ) { /* just a hint: readers park under the consumers lock */
+        return 0;
     }
-    slot->tail = msg;
-    slot->msg_count++;
-    mailslot_printqueue( slot ); /* debug help */
 
-    return size;
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    if ( mailslot_list_front( slot ) < 0 && !list_empty( &( slot->parked ) ) ) {
+        waiter = list_first_entry( &( slot->parked ), mailslot_waiter_t, node );
+        if ( waiter->size >= msg->size ) {
+            list_del_init( &( waiter->node ) );
+            WRITE_ONCE( waiter->msg, msg );
+            wake_up_process( waiter->task ); /* under the lock, since the waiter lives on the stack of the reader */
+        } else {
+            waiter = NULL;
+        }
+    }
+    spin_unlock( &( slot->cons_lock ) );
+
+    if ( waiter != NULL ) {
+        mailslot_stats_inc( slot->stats, handoffs );
+    }
+    return waiter != NULL;
 }
 
-ssize_t mailslot_dequeue( mailslot_t* slot, char* buffer, size_t size, int non_blocking ) {
-    int res, error;
-    int count = slot->msg_count;
+/* Allocates n messages and copies their contents (no locks held), returning them chained via next, all or nothing. */
+static message_t* mailslot_msg_chain( mailslot_t* slot, const struct iov_iter* msgs, int n, int lane ) {
+    int i;
+    struct iov_iter from;
+    message_t* first = NULL;
+    message_t* last = NULL;
     message_t* msg = NULL;
 
-    if ( count == 0 ) { /* not an error */
-        printk( KERN_INFO "mailslot (id %d): no msg to read, empty slot\n", slot->id );
-        return 0;
+    for ( i = 0; i < n; i++ ) {
+        from = msgs[i]; /* the iterators of the caller are left untouched */
+        msg = mailslot_msg_new( slot, &from, lane );
+        if ( IS_ERR( msg ) ) {
+            while ( first != NULL ) {
+                last = first->next;
+                mailslot_msg_free( first );
+                first = last;
+            }
+            return msg;
+        }
+        if ( first == NULL ) {
+            first = msg;
+        } else {
+            last->next = msg;
+        }
+        last = msg;
     }
+    return first;
+}
 
-    msg = slot->head;
-    if ( msg->size > size ) { /* all or nothing */
-        printk( KERN_ERR "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+/* Reserves room in the slot (list and sharded mode) for n messages, whose overall size is returned in *bytes. */
+static int mailslot_reserve( mailslot_t* slot, const struct iov_iter* msgs, int n, size_t* bytes ) {
+    int i, full;
+
+    *bytes = 0;
+    for ( i = 0; i < n; i++ ) {
+        *bytes += iov_iter_count( &msgs[i] );
+    }
+    if ( n > slot->max_msgs || ( slot->max_bytes && *bytes > slot->max_bytes ) ) {
+        mailslot_debug( "mailslot (id %d): msgs can never fit in the slot\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
         return -EMSGSIZE;
     }
 
-    if ( non_blocking ) {
-        pagefault_disable();
+    full = atomic_add_return( n, &( slot->used ) ) > slot->max_msgs;
+    if ( atomic_long_add_return( *bytes, &( slot->used_bytes ) ) > slot->max_bytes && slot->max_bytes ) {
+        full = 1;
     }
-    error = copy_to_user( buffer, msg->content, msg->size );
-    if ( non_blocking ) {
-        pagefault_enable();
+    if ( full ) {
+        atomic_sub( n, &( slot->used ) );
+        atomic_long_sub( *bytes, &( slot->used_bytes ) );
+        mailslot_debug( "mailslot (id %d): cannot enqueue msg, slot is full\n", slot->id );
+        mailslot_account_error( slot, -ENOSPC );
+        return -ENOSPC;
     }
+    return 0;
+}
+
+/* Reserves room for n messages and copies them in a private chain, returning its first message (or an ERR_PTR). */
+static message_t* mailslot_reserve_chain( mailslot_t* slot, const struct iov_iter* msgs, int n, int lane, message_t** last ) {
+    size_t bytes;
+    message_t* first = NULL;
+    int error = mailslot_reserve( slot, msgs, n, &bytes );
     if ( error ) {
-        printk( KERN_ERR "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        return ERR_PTR( error );
+    }
+
+    first = mailslot_msg_chain( slot, msgs, n, lane );
+    if ( IS_ERR( first ) ) {
+        atomic_sub( n, &( slot->used ) );
+        atomic_long_sub( bytes, &( slot->used_bytes ) );
+        return first;
+    }
+    *last = first;
+    while ( ( *last )->next != NULL ) {
+        *last = ( *last )->next;
+    }
+    return first;
+}
+
+/* Builds the chain of n messages privately, then links it to the tail of a lane with a single short critical section. */
+static int mailslot_list_put( mailslot_t* slot, const struct iov_iter* msgs, int n, int lane ) {
+    message_t* last = NULL;
+    message_t* first = mailslot_reserve_chain( slot, msgs, n, lane, &last );
+    if ( IS_ERR( first ) ) {
+        return PTR_ERR( first );
+    }
+
+    if ( n == 1 && mailslot_list_handoff( slot, first ) ) {
+        return 0;
+    }
+
+    mailslot_spin_lock( slot, &( slot->prod_lock ), 0 );
+    smp_store_release( &( slot->tail[ lane ]->next ), first ); /* consumers see the messages fully written */
+    slot->tail[ lane ] = last;
+    spin_unlock( &( slot->prod_lock ) );
+    smp_mb__before_atomic(); /* the messages are linked before the lane is marked, see mailslot_list_front */
+    set_bit( lane, &( slot->lanes ) );
+    atomic_add( n, &( slot->msg_count ) );
+    return 0;
+}
+
+/* Puts a message which couldn't be copied to user space back at the front of its lane: the current dummy node
+ * takes its fields, and the node of the message becomes the new dummy. */
+static void mailslot_list_giveback( mailslot_t* slot, message_t* msg ) {
+    message_t* dummy = NULL;
+    int lane = msg->lane;
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    dummy = slot->head[ lane ];
+    mailslot_msg_move( dummy, msg );
+    msg->next = dummy;
+    slot->head[ lane ] = msg;
+    set_bit( lane, &( slot->lanes ) );
+    spin_unlock( &( slot->cons_lock ) );
+    atomic_inc( &( slot->msg_count ) );
+}
+
+/* Unlinks the oldest message of the highest priority lane (whose node becomes the new dummy), returning the old dummy
+ * node holding its content, NULL if the list is empty or ERR_PTR( -EMSGSIZE ) if it doesn't fit in size bytes.
+ * The content is moved to the old dummy node, since another consumer may free the node of the message meanwhile. */
+static message_t* mailslot_list_take( mailslot_t* slot, size_t size ) {
+    message_t* dummy = NULL;
+    message_t* msg = NULL;
+    int lane;
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    lane = mailslot_list_front( slot );
+    if ( lane < 0 ) { /* not an error */
+        spin_unlock( &( slot->cons_lock ) );
+        return NULL;
+    }
+    dummy = slot->head[ lane ];
+    msg = smp_load_acquire( &( dummy->next ) );
+    if ( msg->size > size ) { /* all or nothing */
+        spin_unlock( &( slot->cons_lock ) );
+        mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
+        return ERR_PTR( -EMSGSIZE );
+    }
+    mailslot_msg_move( dummy, msg );
+    slot->head[ lane ] = msg;
+    spin_unlock( &( slot->cons_lock ) );
+    atomic_dec( &( slot->msg_count ) );
+    return dummy;
+}
+
+/* Unlinks the oldest message and copies it (and its header) out of the critical section. */
+static ssize_t mailslot_list_get( mailslot_t* slot, char __user* buffer, size_t size, mailslot_hdr_t* hdr ) {
+    size_t msg_size;
+    message_t* msg = mailslot_list_take( slot, size );
+    if ( IS_ERR_OR_NULL( msg ) ) {
+        return PTR_ERR_OR_ZERO( msg );
+    }
+
+    if ( mailslot_msg_copy_out( msg, buffer ) || mailslot_hdr_put( hdr, msg->tstamp, msg->pid, msg->lane, msg->size ) ) {
+        mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        mailslot_list_giveback( slot, msg );
         return -EFAULT;
     }
 
-    res = msg->size;
-    slot->head = slot->head->next; /* if count == 1, here head becomes NULL! */
-    kfree( msg->content );
-    kfree( msg );
-    if ( count == 1 ) {
-        slot->tail = NULL; /* here head == NULL and tail == (deallocated) msg */
+    msg_size = msg->size;
+    atomic_dec( &( slot->used ) );
+    atomic_long_sub( msg_size, &( slot->used_bytes ) );
+    mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+    mailslot_msg_free( msg );
+    return msg_size;
+}
+
+/* Unlinks up to n messages within a single critical section, the i-th fitting in bufs[i] as a whole, chaining the old
+ * dummy nodes holding them in *first (as mailslot_list_take). It returns how many were taken, stopping at the first
+ * message which doesn't fit, or -EMSGSIZE if not even the first one does. */
+static int mailslot_list_take_batch( mailslot_t* slot, const struct iovec* bufs, int n, message_t** first ) {
+    message_t* dummy = NULL;
+    message_t* msg = NULL;
+    message_t** link = first;
+    int i, lane = -1;
+
+    *first = NULL;
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    for ( i = 0; i < n; i++ ) {
+        lane = mailslot_list_front( slot );
+        if ( lane < 0 ) {
+            break;
+        }
+        dummy = slot->head[ lane ];
+        msg = smp_load_acquire( &( dummy->next ) );
+        if ( msg->size > bufs[i].iov_len ) {
+            break;
+        }
+        mailslot_msg_move( dummy, msg );
+        slot->head[ lane ] = msg;
+        dummy->next = NULL; /* no longer reachable from the list */
+        *link = dummy;
+        link = &( dummy->next );
+    }
+    spin_unlock( &( slot->cons_lock ) );
+
+    if ( i == 0 && lane >= 0 ) {
+        mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
+        return -EMSGSIZE;
+    }
+    atomic_sub( i, &( slot->msg_count ) );
+    return i;
+}
+
+/* Dequeues up to n messages taken at once, then copies them out of the critical section, storing their sizes.
+ * If a copy fails, the messages left are given back in reverse order, which restores the order of their lanes. */
+static int mailslot_list_get_batch( mailslot_t* slot, const struct iovec* bufs, int n, u32* sizes ) {
+    int i;
+    message_t* msg = NULL;
+    message_t* first = NULL;
+    message_t* rest = NULL;
+    int taken = mailslot_list_take_batch( slot, bufs, n, &first );
+    if ( taken <= 0 ) {
+        return taken;
+    }
+
+    for ( i = 0; i < taken; i++ ) {
+        msg = first;
+        if ( mailslot_msg_copy_out( msg, bufs[i].iov_base ) ) {
+            mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+            break;
+        }
+        first = msg->next;
+        sizes[i] = msg->size;
+        atomic_dec( &( slot->used ) );
+        atomic_long_sub( msg->size, &( slot->used_bytes ) );
+        mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+        mailslot_msg_free( msg );
+    }
+    if ( i == taken ) {
+        return taken;
+    }
+
+    while ( first != NULL ) {
+        msg = first;
+        first = msg->next;
+        msg->next = rest;
+        rest = msg;
+    }
+    while ( rest != NULL ) {
+        msg = rest;
+        rest = msg->next;
+        mailslot_list_giveback( slot, msg );
+    }
+    return i > 0 ? i : -EFAULT;
+}
+
+/* The copy of a message made by a peek under the lock of its list, which leaves it linked: an inline content is copied
+ * in a bounce buffer, while the pages of a big one are referenced, so that the copy to user space happens later. */
+struct mailslot_peek_copy {
+    message_t msg;
+    char* bounce;
+    struct page** pages;
+};
+
+/* Allocates the room for the copy of a message of up to size bytes, since the lock can't be held while allocating. */
+static int mailslot_peek_alloc( struct mailslot_peek_copy* copy, size_t size ) {
+    size = min_t( size_t, size, LIMIT_MAX_MSG_SIZE );
+    copy->msg.size = 0;
+    copy->msg.content = NULL;
+    copy->msg.pages = NULL;
+    copy->pages = NULL;
+    copy->bounce = kmalloc( clamp_t( size_t, size, 1, MAILSLOT_INLINE_SIZE ), GFP_KERNEL );
+    if ( copy->bounce == NULL ) {
+        return -ENOMEM;
+    }
+    if ( size > MAILSLOT_INLINE_SIZE ) {
+        copy->pages = kvcalloc( DIV_ROUND_UP( size, PAGE_SIZE ), sizeof( struct page* ), GFP_KERNEL );
+        if ( copy->pages == NULL ) {
+            kfree( copy->bounce );
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* Copies a message fitting in size bytes (lock held), returning its size or -EMSGSIZE. */
+static ssize_t mailslot_peek_copy( struct mailslot_peek_copy* copy, const message_t* msg, size_t size ) {
+    size_t i;
+
+    if ( msg->size > size ) { /* all or nothing */
+        return -EMSGSIZE;
+    }
+    copy->msg.size = msg->size;
+    if ( msg->pages == NULL ) {
+        memcpy( copy->bounce, msg->content, msg->size );
+        copy->msg.content = copy->bounce;
+        return msg->size;
+    }
+    for ( i = 0; i < DIV_ROUND_UP( msg->size, PAGE_SIZE ); i++ ) {
+        copy->pages[i] = msg->pages[i];
+        get_page( copy->pages[i] ); /* the message may be read and freed as soon as the lock is released */
     }
-    slot->msg_count--;
-    mailslot_printqueue( slot ); /* debug help */
+    copy->msg.pages = copy->pages;
+    return msg->size;
+}
+
+/* Copies the message copied by mailslot_peek_copy (if res is its size) to user space, then frees the copy. */
+static ssize_t mailslot_peek_finish( mailslot_t* slot, struct mailslot_peek_copy* copy, char __user* buffer, ssize_t res ) {
+    size_t i;
 
+    if ( res > 0 && mailslot_msg_copy_out( &( copy->msg ), buffer ) ) {
+        mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        res = -EFAULT;
+    } else if ( res == -EMSGSIZE ) {
+        mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+    }
+    if ( copy->msg.pages != NULL ) {
+        for ( i = 0; i < DIV_ROUND_UP( copy->msg.size, PAGE_SIZE ); i++ ) {
+            put_page( copy->pages[i] );
+        }
+    }
+    kvfree( copy->pages );
+    kfree( copy->bounce );
     return res;
 }
 
-int mailslot_lock( mailslot_t* slot, int non_blocking ) {
-    printk( KERN_INFO "mailslot (id %d): pid %d wants to lock the slot", slot->id, current->pid );
-    if ( non_blocking ) {
-        printk( KERN_CONT " without blocking\n" );
-        return mutex_trylock( &(slot->mutex) );
+/* Copies the oldest message to user space without consuming it, nor unlinking it: readers and writers see no change. */
+static ssize_t mailslot_list_peek( mailslot_t* slot, char __user* buffer, size_t size ) {
+    ssize_t res = 0;
+    int lane;
+    struct mailslot_peek_copy copy;
+
+    if ( mailslot_peek_alloc( &copy, size ) ) {
+        return -ENOMEM;
+    }
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    lane = mailslot_list_front( slot );
+    if ( lane >= 0 ) {
+        res = mailslot_peek_copy( &copy, smp_load_acquire( &( slot->head[ lane ]->next ) ), size );
+    }
+    spin_unlock( &( slot->cons_lock ) );
+    return mailslot_peek_finish( slot, &copy, buffer, res );
+}
+
+/* Returns the size of the oldest message of the highest priority lane (0 if the list is empty). */
+static size_t mailslot_list_next_size( mailslot_t* slot ) {
+    size_t size = 0;
+    int lane;
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    lane = mailslot_list_front( slot );
+    if ( lane >= 0 ) {
+        size = smp_load_acquire( &( slot->head[ lane ]->next ) )->size;
+    }
+    spin_unlock( &( slot->cons_lock ) );
+    return size;
+}
+
+/* Links a chain of n messages to the tail of a shard (its lane field, set by mailslot_msg_chain). */
+static int mailslot_shard_put( mailslot_t* slot, const struct iov_iter* msgs, int n, int shard ) {
+    struct mailslot_shard* sh = NULL;
+    message_t* last = NULL;
+    message_t* first = NULL;
+
+    if ( shard < 0 || shard >= nr_cpu_ids || !cpu_possible( shard ) ) {
+        shard = raw_smp_processor_id();
+    }
+    first = mailslot_reserve_chain( slot, msgs, n, shard, &last );
+    if ( IS_ERR( first ) ) {
+        return PTR_ERR( first );
+    }
+
+    sh = per_cpu_ptr( slot->shards, shard );
+    mailslot_spin_lock( slot, &( sh->lock ), 0 );
+    if ( sh->tail != NULL ) {
+        sh->tail->next = first;
     } else {
-        printk( KERN_CONT "\n" );
-        return mutex_lock_interruptible( &(slot->mutex) ) == 0;
+        WRITE_ONCE( sh->head, first );
     }
+    sh->tail = last;
+    spin_unlock( &( sh->lock ) );
+    atomic_add( n, &( slot->msg_count ) );
+    return 0;
 }
 
-void mailslot_unlock( mailslot_t* slot ) {
-    mutex_unlock( &(slot->mutex) );
+/* Unlinks the oldest message of the shard of the current CPU or, if it's empty, of the first non-empty one after it.
+ * It returns NULL if all the shards are empty, ERR_PTR( -EMSGSIZE ) if the message doesn't fit in size bytes. */
+static message_t* mailslot_shard_take( mailslot_t* slot, size_t size ) {
+    unsigned int i, cpu, start = raw_smp_processor_id();
+    struct mailslot_shard* sh = NULL;
+    message_t* msg = NULL;
+
+    for ( i = 0; i < nr_cpu_ids; i++ ) {
+        cpu = ( start + i ) % nr_cpu_ids;
+        if ( !cpu_possible( cpu ) ) {
+            continue;
+        }
+        sh = per_cpu_ptr( slot->shards, cpu );
+        if ( READ_ONCE( sh->head ) == NULL ) { /* not taking the locks of the empty shards */
+            continue;
+        }
+        mailslot_spin_lock( slot, &( sh->lock ), 1 );
+        msg = sh->head;
+        if ( msg == NULL ) { /* stolen meanwhile */
+            spin_unlock( &( sh->lock ) );
+            continue;
+        }
+        if ( msg->size > size ) { /* all or nothing */
+            spin_unlock( &( sh->lock ) );
+            mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+            mailslot_account_error( slot, -EMSGSIZE );
+            return ERR_PTR( -EMSGSIZE );
+        }
+        WRITE_ONCE( sh->head, msg->next );
+        if ( msg->next == NULL ) {
+            sh->tail = NULL;
+        }
+        spin_unlock( &( sh->lock ) );
+        atomic_dec( &( slot->msg_count ) );
+        msg->next = NULL;
+        return msg;
+    }
+    return NULL;
 }
 
-int mailslot_wait_msg( mailslot_t* slot ) {
-    return wait_event_interruptible_exclusive( slot->rd_queue, slot->msg_count > 0 );
+/* Puts a message which couldn't be copied to user space back at the front of its shard. */
+static void mailslot_shard_giveback( mailslot_t* slot, message_t* msg ) {
+    struct mailslot_shard* sh = per_cpu_ptr( slot->shards, msg->lane );
+
+    mailslot_spin_lock( slot, &( sh->lock ), 1 );
+    msg->next = sh->head;
+    if ( sh->head == NULL ) {
+        sh->tail = msg;
+    }
+    WRITE_ONCE( sh->head, msg );
+    spin_unlock( &( sh->lock ) );
+    atomic_inc( &( slot->msg_count ) );
 }
 
-int mailslot_wait_space( mailslot_t* slot ) {
-    return wait_event_interruptible_exclusive( slot->wr_queue, slot->msg_count < MAX_SLOT_SIZE );
+static ssize_t mailslot_shard_get( mailslot_t* slot, char __user* buffer, size_t size, mailslot_hdr_t* hdr ) {
+    size_t msg_size;
+    message_t* msg = mailslot_shard_take( slot, size );
+    if ( IS_ERR_OR_NULL( msg ) ) {
+        return PTR_ERR_OR_ZERO( msg );
+    }
+
+    if ( mailslot_msg_copy_out( msg, buffer ) || mailslot_hdr_put( hdr, msg->tstamp, msg->pid, 0, msg->size ) ) {
+        mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        mailslot_shard_giveback( slot, msg );
+        return -EFAULT;
+    }
+
+    msg_size = msg->size;
+    atomic_dec( &( slot->used ) );
+    atomic_long_sub( msg_size, &( slot->used_bytes ) );
+    mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+    mailslot_msg_free( msg );
+    return msg_size;
 }
 
-void mailslot_notify_msg( mailslot_t* slot ) {
-    wake_up_interruptible( &(slot->rd_queue) );
+/* Copies the message mailslot_shard_take would return to user space, leaving it in its shard (as mailslot_list_peek). */
+static ssize_t mailslot_shard_peek( mailslot_t* slot, char __user* buffer, size_t size ) {
+    unsigned int i, cpu, start = raw_smp_processor_id();
+    ssize_t res = 0;
+    struct mailslot_shard* sh = NULL;
+    struct mailslot_peek_copy copy;
+
+    if ( mailslot_peek_alloc( &copy, size ) ) {
+        return -ENOMEM;
+    }
+
+    for ( i = 0; i < nr_cpu_ids && res == 0; i++ ) {
+        cpu = ( start + i ) % nr_cpu_ids;
+        if ( !cpu_possible( cpu ) ) {
+            continue;
+        }
+        sh = per_cpu_ptr( slot->shards, cpu );
+        if ( READ_ONCE( sh->head ) == NULL ) {
+            continue;
+        }
+        mailslot_spin_lock( slot, &( sh->lock ), 1 );
+        if ( sh->head != NULL ) {
+            res = mailslot_peek_copy( &copy, sh->head, size );
+        }
+        spin_unlock( &( sh->lock ) );
+    }
+    return mailslot_peek_finish( slot, &copy, buffer, res );
 }
 
-void mailslot_notify_space( mailslot_t* slot ) {
-    wake_up_interruptible( &(slot->wr_queue) );
+/* Returns the size of the message mailslot_shard_take would return (0 if all the shards are empty). */
+static size_t mailslot_shard_next_size( mailslot_t* slot ) {
+    unsigned int i, cpu, start = raw_smp_processor_id();
+    size_t size = 0;
+    struct mailslot_shard* sh = NULL;
+
+    for ( i = 0; i < nr_cpu_ids && size == 0; i++ ) {
+        cpu = ( start + i ) % nr_cpu_ids;
+        if ( !cpu_possible( cpu ) ) {
+            continue;
+        }
+        sh = per_cpu_ptr( slot->shards, cpu );
+        mailslot_spin_lock( slot, &( sh->lock ), 1 );
+        if ( sh->head != NULL ) {
+            size = sh->head->size;
+        }
+        spin_unlock( &( sh->lock ) );
+    }
+    return size;
 }
 
-void mailslot_set_max_msg_size( mailslot_t* slot, size_t size ) {
-    slot->max_msg_size = size;
+static struct mailslot_shard __percpu* mailslot_shards_alloc( void ) {
+    int cpu;
+    struct mailslot_shard __percpu* shards = alloc_percpu( struct mailslot_shard );
+    if ( shards == NULL ) {
+        return NULL;
+    }
+    for_each_possible_cpu( cpu ) {
+        spin_lock_init( &( per_cpu_ptr( shards, cpu )->lock ) );
+    }
+    return shards;
 }
 
-void mailslot_free( mailslot_t* slot ) {
-    int i;
+/* Frees the shards of a slot (no operations in progress), with the messages left in them. */
+static void mailslot_shards_destroy( mailslot_t* slot ) {
+    int cpu;
     message_t* msg = NULL;
-    for ( i = 0; i < slot->msg_count; i++ ) {
-        msg = slot->head->next;
-        kfree( slot->head->content );
-        kfree( slot->head );
-        slot->head = msg;
+    struct mailslot_shard* sh = NULL;
+
+    if ( slot->shards == NULL ) {
+        return;
     }
-    kfree( slot );
+    for_each_possible_cpu( cpu ) {
+        sh = per_cpu_ptr( slot->shards, cpu );
+        while ( sh->head != NULL ) {
+            msg = sh->head;
+            sh->head = msg->next;
+            mailslot_msg_free( msg );
+        }
+    }
+    free_percpu( slot->shards );
+    slot->shards = NULL;
 }
 
-void mailslot_printqueue( mailslot_t* slot ) {
-    message_t* msg = slot->head;
-    printk( KERN_INFO "mailslot (id %d): (slot content) head = ", slot->id );
-    while ( msg != NULL ) {
-        printk( KERN_CONT "\"%s\"", msg->content );
-        if ( msg->next != NULL ) {
-            printk( KERN_CONT ", " );
-        }
-        msg = msg->next;
+static void mailslot_bcast_release( message_t* msg ) {
+    if ( msg != NULL && refcount_dec_and_test( &( msg->refs ) ) ) {
+        mailslot_msg_free( msg );
     }
-    if ( msg == NULL ){
-        printk( KERN_CONT " = tail\n" );
+}
+
+/* Marks a message as read by one more subscriber (or as dropped for all of them, if all is set): the message leaves
+ * the count of the slot once, when no subscriber has still to read it. */
+static void mailslot_bcast_consumed( mailslot_t* slot, message_t* msg, int all ) {
+    int left = all ? ( atomic_xchg( &( msg->pending ), 0 ) > 0 ? 0 : -1 ) : atomic_dec_if_positive( &( msg->pending ) );
+    if ( left == 0 ) {
+        atomic_dec( &( slot->msg_count ) );
+        atomic_long_sub( msg->size, &( slot->used_bytes ) );
+    }
+}
+
+/* Copies n messages once, then stores them in the ring for all the current subscribers. With the block policy the
+ * entries reused must have been read by every subscriber, with the drop policy unread messages are overwritten. */
+static int mailslot_bcast_put( mailslot_t* slot, const struct iov_iter* msgs, int n, int lane ) {
+    int i, full = 0, capacity = slot->capacity;
+    message_t* msg = NULL;
+    message_t* next = NULL;
+    message_t* old = NULL;
+    message_t* overwritten = NULL;
+
+    if ( n > capacity ) {
+        mailslot_debug( "mailslot (id %d): msgs can never fit in the slot\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
+        return -EMSGSIZE;
     }
-}
\ No newline at end of file
+
+    msg = mailslot_msg_chain( slot, msgs, n, lane );
+    if ( IS_ERR( msg ) ) {
+        return PTR_ERR( msg );
+    }
+
+    mailslot_spin_lock( slot, &( slot->prod_lock ), 0 );
+    if ( slot->bcast_policy == MAILSLOT_BCAST_BLOCK ) {
+        for ( i = 0; i < n && !full; i++ ) {
+            old = slot->bcast[ ( slot->bcast_tail + i ) % capacity ];
+            full = old != NULL && atomic_read( &( old->pending ) ) > 0;
+        }
+    }
+    for ( ; msg != NULL && !full; msg = next ) {
+        next = msg->next;
+        msg->seq = slot->bcast_tail++;
+        refcount_set( &( msg->refs ), 1 ); /* the reference of the ring */
+        atomic_set( &( msg->pending ), slot->subscribers );
+        if ( slot->subscribers > 0 ) {
+            atomic_inc( &( slot->msg_count ) );
+            atomic_long_add( msg->size, &( slot->used_bytes ) );
+        }
+        old = slot->bcast[ msg->seq % capacity ];
+        slot->bcast[ msg->seq % capacity ] = msg;
+        if ( old != NULL ) { /* released out of the lock: readers may be copying it */
+            mailslot_bcast_consumed( slot, old, 1 );
+            old->next = overwritten;
+            overwritten = old;
+        }
+    }
+    spin_unlock( &( slot->prod_lock ) );
+
+    if ( full ) {
+        while ( msg != NULL ) {
+            next = msg->next;
+            mailslot_msg_free( msg );
+            msg = next;
+        }
+        mailslot_debug( "mailslot (id %d): cannot enqueue msg, a subscriber is too slow\n", slot->id );
+        mailslot_account_error( slot, -ENOSPC );
+        return -ENOSPC;
+    }
+    while ( overwritten != NULL ) {
+        old = overwritten;
+        overwritten = old->next;
+        mailslot_bcast_release( old );
+    }
+    return 0;
+}
+
+/* Reads the next message of a subscriber: messages overwritten before being read (drop policy) are skipped. */
+static ssize_t mailslot_bcast_get( mailslot_t* slot, mailslot_sub_t* sub, char __user* buffer, size_t size, mailslot_hdr_t* hdr ) {
+    ssize_t res;
+    u64 capacity = slot->capacity;
+    message_t* msg = NULL;
+
+    mutex_lock( &( sub->lock ) );
+    mailslot_spin_lock( slot, &( slot->prod_lock ), 1 );
+    if ( slot->bcast_tail - sub->next > capacity ) {
+        sub->dropped += slot->bcast_tail - capacity - sub->next;
+        sub->next = slot->bcast_tail - capacity;
+    }
+    if ( sub->next == slot->bcast_tail ) { /* not an error */
+        spin_unlock( &( slot->prod_lock ) );
+        mutex_unlock( &( sub->lock ) );
+        return 0;
+    }
+    msg = slot->bcast[ sub->next % capacity ];
+    if ( msg->size > size ) { /* all or nothing */
+        spin_unlock( &( slot->prod_lock ) );
+        mutex_unlock( &( sub->lock ) );
+        mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
+        return -EMSGSIZE;
+    }
+    refcount_inc( &( msg->refs ) ); /* the message may be overwritten while being copied */
+    spin_unlock( &( slot->prod_lock ) );
+
+    if ( mailslot_msg_copy_out( msg, buffer ) || mailslot_hdr_put( hdr, msg->tstamp, msg->pid, 0, msg->size ) ) {
+        mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        res = -EFAULT;
+    } else {
+        sub->next++;
+        res = msg->size;
+        mailslot_bcast_consumed( slot, msg, 0 );
+        mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+    }
+    mutex_unlock( &( sub->lock ) );
+    mailslot_bcast_release( msg );
+    return res;
+}
+
+/* Frees the ring of a slot in broadcast mode (no operations in progress). */
+static void mailslot_bcast_destroy( mailslot_t* slot ) {
+    int i;
+    if ( slot->bcast != NULL ) {
+        for ( i = 0; i < slot->capacity; i++ ) {
+            mailslot_bcast_release( slot->bcast[i] );
+        }
+        kvfree( slot->bcast );
+        slot->bcast = NULL;
+    }
+}
+
+static void mailslot_storage_destroy( mailslot_storage_t* storage ) {
+    if ( storage != NULL ) {
+        kvfree( storage->view.ring );
+        kfree( storage );
+    }
+}
+
+/* Allocates a ring for messages of at most max_msg_size bytes: the number of cells is a power of 2 (max_msgs,
+ * or as many as fit in budget bytes if less). A shared ring can be mapped in user space, and its cells are cache aligned. */
+static mailslot_storage_t* mailslot_storage_alloc( mailslot_t* slot, size_t max_msg_size, int max_msgs, size_t budget, int shared ) {
+    u32 i;
+    size_t cell_size = ALIGN( sizeof( struct mailslot_cell ) + max_msg_size,
+                              shared ? L1_CACHE_BYTES : __alignof__( struct mailslot_cell ) );
+    size_t cells = budget ? min_t( size_t, budget / cell_size, max_msgs ) : max_msgs;
+    mailslot_storage_t* storage = NULL;
+    struct mailslot_ring* ring = NULL;
+
+    if ( cells == 0 || cells > INT_MAX ) {
+        mailslot_debug( "mailslot (id %d): ring budget (%lu) cannot hold msgs of %lu bytes\n", slot->id, budget, max_msg_size );
+        return ERR_PTR( -EINVAL );
+    }
+    cells = max_t( size_t, rounddown_pow_of_two( cells ), 2 ); /* a single cell would look free once published */
+
+    storage = kzalloc_node( sizeof( mailslot_storage_t ), GFP_KERNEL, mailslot_msg_node( slot ) );
+    if ( storage == NULL ) {
+        return ERR_PTR( -ENOMEM );
+    }
+    storage->size = sizeof( struct mailslot_ring ) + cells * cell_size;
+    if ( shared ) { /* __vmalloc has no node variant: the pages follow the memory policy of the caller */
+        storage->size = PAGE_ALIGN( storage->size );
+        ring = __vmalloc( storage->size, GFP_KERNEL_ACCOUNT | __GFP_ZERO ); /* charged, unlike vmalloc_user */
+    } else {
+        ring = kvzalloc_node( storage->size, GFP_KERNEL_ACCOUNT, mailslot_msg_node( slot ) );
+    }
+    if ( ring == NULL ) {
+        mailslot_debug( "mailslot (id %d): failed to allocate the ring\n", slot->id );
+        kfree( storage );
+        return ERR_PTR( -ENOMEM );
+    }
+    ring->cells = cells;
+    ring->cell_size = cell_size;
+    ring->max_msg_size = max_msg_size;
+    ring->data_offset = sizeof( struct mailslot_ring );
+
+    storage->shared = shared;
+    storage->view.ring = ring;
+    storage->view.cells = (char*)ring + sizeof( struct mailslot_ring );
+    storage->view.mask = cells - 1;
+    storage->view.cell_size = cell_size;
+    storage->view.max_msg_size = max_msg_size;
+    for ( i = 0; i < cells; i++ ) {
+        mailslot_ring_cell( &( storage->view ), i )->seq = i;
+    }
+    return storage;
+}
+
+/* Replaces the storage of the slot (new may be NULL), unless user space still maps the old one. */
+static int mailslot_storage_replace( mailslot_t* slot, mailslot_storage_t* new ) {
+    mailslot_storage_t* old = NULL;
+
+    mutex_lock( &( slot->storage_lock ) );
+    if ( atomic_read( &( slot->mappings ) ) > 0 ) {
+        mutex_unlock( &( slot->storage_lock ) );
+        mailslot_debug( "mailslot (id %d): the shared ring is still mapped\n", slot->id );
+        return -EBUSY;
+    }
+    old = rcu_dereference_protected( slot->storage, lockdep_is_held( &( slot->storage_lock ) ) );
+    rcu_assign_pointer( slot->storage, new );
+    mutex_unlock( &( slot->storage_lock ) );
+
+    if ( old != NULL ) {
+        synchronize_rcu(); /* waiting for poll and sleepers looking at the old ring */
+        mailslot_storage_destroy( old );
+    }
+    return 0;
+}
+
+/* Reserves n cells at once and publishes them after copying all the messages.
+ * A reserved cell cannot be given back: if a copy fails, all the cells are published as holes (0-size messages). */
+static int mailslot_ring_put( mailslot_t* slot, const struct iov_iter* msgs, int n ) {
+    int i, error = 0;
+    u64 pos;
+    struct iov_iter from;
+    struct mailslot_cell* cell = NULL;
+    struct mailslot_ring_view* view = &( mailslot_storage( slot )->view );
+
+    if ( !mailslot_ring_reserve_n( view, n, &pos ) ) {
+        mailslot_debug( "mailslot (id %d): cannot enqueue msg, slot is full\n", slot->id );
+        mailslot_account_error( slot, -ENOSPC );
+        return -ENOSPC;
+    }
+
+    for ( i = 0; i < n && error == 0; i++ ) {
+        cell = mailslot_ring_cell( view, pos + i );
+        from = msgs[i];
+        cell->size = iov_iter_count( &from );
+        if ( copy_from_iter( cell->content, cell->size, &from ) != cell->size ) {
+            mailslot_debug( "mailslot (id %d): failed to copy msg from user space\n", slot->id );
+            error = -EFAULT;
+        }
+        cell->tstamp = ktime_get_ns();
+        cell->pid = task_tgid_nr( current );
+    }
+
+    for ( i = 0; i < n; i++ ) {
+        cell = mailslot_ring_cell( view, pos + i );
+        if ( error ) {
+            cell->size = 0;
+        }
+        mailslot_ring_publish( cell, pos + i );
+    }
+    return error;
+}
+
+/* The message (and its header) is copied before being taken: if another consumer takes it first, the copy is simply
+ * redone, and if the copy fails the message stays in the ring. The content of a shared ring is written by user space,
+ * hence sizes are clamped to the geometry known by the kernel. Holes are skipped.
+ * Retries and holes are bounded by MAILSLOT_RING_MAX_TRIES: past it, -EAGAIN is returned. */
+static ssize_t mailslot_ring_get( mailslot_t* slot, char __user* buffer, size_t size, mailslot_hdr_t* hdr ) {
+    int tries;
+    u64 pos, tstamp;
+    u32 msg_size;
+    pid_t pid;
+    struct mailslot_ring_view* view = &( mailslot_storage( slot )->view );
+    struct mailslot_cell* cell = NULL;
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        if ( tries > 0 ) {
+            cond_resched();
+        }
+        cell = mailslot_ring_peek( view, &pos );
+        if ( cell == NULL ) {
+            return 0;
+        }
+        msg_size = min( READ_ONCE( cell->size ), view->max_msg_size );
+        if ( msg_size > size ) { /* all or nothing */
+            mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+            mailslot_account_error( slot, -EMSGSIZE );
+            return -EMSGSIZE;
+        }
+        if ( copy_to_user( buffer, cell->content, msg_size ) ) {
+            mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+            return -EFAULT;
+        }
+        tstamp = READ_ONCE( cell->tstamp );
+        pid = READ_ONCE( cell->pid );
+        if ( msg_size > 0 && mailslot_hdr_put( hdr, tstamp, pid, 0, msg_size ) ) {
+            mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+            return -EFAULT;
+        }
+        if ( !mailslot_ring_take( view, pos ) ) {
+            continue; /* consumed by someone else in the meantime */
+        }
+        mailslot_ring_release( view, cell, pos );
+        if ( msg_size == 0 ) {
+            continue;
+        }
+        mailslot_stats_hist( slot->stats, residence, tstamp );
+        return msg_size;
+    }
+    mailslot_debug( "mailslot (id %d): too many retries reading the ring\n", slot->id );
+    return -EAGAIN;
+}
+
+/* Copies the oldest message in the ring to user space without consuming it: the copy is valid if the cell
+ * was not released meanwhile, since producers cannot reuse it before. */
+static ssize_t mailslot_ring_peek_msg( mailslot_t* slot, char __user* buffer, size_t size ) {
+    int tries;
+    u64 pos;
+    u32 msg_size;
+    struct mailslot_ring_view* view = &( mailslot_storage( slot )->view );
+    struct mailslot_cell* cell = NULL;
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        if ( tries > 0 ) {
+            cond_resched();
+        }
+        cell = mailslot_ring_peek( view, &pos );
+        if ( cell == NULL ) {
+            return 0;
+        }
+        msg_size = min( READ_ONCE( cell->size ), view->max_msg_size );
+        if ( msg_size > size ) { /* all or nothing, but not a failed read for the statistics */
+            mailslot_debug( "mailslot (id %d): user buffer too small for the msg\n", slot->id );
+            return -EMSGSIZE;
+        }
+        if ( copy_to_user( buffer, cell->content, msg_size ) ) {
+            return -EFAULT;
+        }
+        smp_rmb(); /* the content is read before checking the cell was not released */
+        if ( READ_ONCE( cell->seq ) == pos + 1 ) {
+            return msg_size;
+        }
+    }
+    mailslot_debug( "mailslot (id %d): too many retries reading the ring\n", slot->id );
+    return -EAGAIN;
+}
+
+/* Returns the content bytes of the messages in the ring, walking its published cells (approximate under concurrency). */
+static size_t mailslot_ring_bytes( struct mailslot_ring_view* view ) {
+    size_t bytes = 0;
+    u64 pos, head = READ_ONCE( view->ring->head ), tail = READ_ONCE( view->ring->tail );
+    struct mailslot_cell* cell = NULL;
+
+    if ( tail - head > (u64)view->mask + 1 ) { /* a shared ring is written by user space: as mailslot_ring_count */
+        tail = head + view->mask + 1;
+    }
+    for ( pos = head; pos != tail; pos++ ) {
+        cell = mailslot_ring_cell( view, pos );
+        if ( smp_load_acquire( &( cell->seq ) ) == pos + 1 ) {
+            bytes += min( READ_ONCE( cell->size ), view->max_msg_size );
+        }
+    }
+    return bytes;
+}
+
+/* Checks that a message of size bytes can be spliced as a whole in len bytes of the pipe (locked by the caller). */
+static int mailslot_pipe_check( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len, size_t size ) {
+    unsigned int bufs = DIV_ROUND_UP( size, PAGE_SIZE );
+
+    if ( size > len || bufs > pipe->max_usage ) { /* all or nothing */
+        mailslot_debug( "mailslot (id %d): pipe too small for the msg\n", slot->id );
+        mailslot_account_error( slot, -EMSGSIZE );
+        return -EMSGSIZE;
+    }
+    if ( bufs > pipe->max_usage - pipe_occupancy( pipe->head, pipe->tail ) ) {
+        mailslot_debug( "mailslot (id %d): the pipe must be drained before splicing the msg\n", slot->id );
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/* pipe buffers made of pages handed over by the slot: the pipe holds the only reference to them */
+static const struct pipe_buf_operations mailslot_pipe_buf_ops = {
+    .release   = generic_pipe_buf_release,
+    .try_steal = generic_pipe_buf_try_steal,
+    .get       = generic_pipe_buf_get
+};
+
+/* Moves size bytes held by pages (the references of which are handed over) in the pipe, a buffer per page. */
+static void mailslot_pipe_fill( struct pipe_inode_info* pipe, struct page** pages, size_t size ) {
+    size_t offset, chunk;
+    struct pipe_buffer buf;
+
+    for ( offset = 0; offset < size; offset += chunk ) {
+        chunk = min_t( size_t, size - offset, PAGE_SIZE );
+        buf = (struct pipe_buffer){
+            .page = pages[ offset / PAGE_SIZE ],
+            .offset = 0,
+            .len = chunk,
+            .ops = &mailslot_pipe_buf_ops
+        };
+        add_to_pipe( pipe, &buf ); /* there's room, see mailslot_pipe_check */
+    }
+}
+
+/* Moves a message taken from a list (list and sharded mode) to a pipe, already checked to have room for it, freeing
+ * the message. It returns the size of the message or -ENOMEM, leaving the message to the caller. */
+static ssize_t mailslot_msg_splice( mailslot_t* slot, struct pipe_inode_info* pipe, message_t* msg ) {
+    ssize_t res;
+    struct page* page = NULL;
+
+    if ( msg->pages != NULL ) {
+        mailslot_pipe_fill( pipe, msg->pages, msg->size );
+        kvfree( msg->pages );
+        msg->pages = NULL;
+    } else { /* a small message is copied in a page of its own */
+        page = alloc_page( GFP_KERNEL_ACCOUNT );
+        if ( page == NULL ) {
+            return -ENOMEM;
+        }
+        memcpy( page_address( page ), msg->content, msg->size );
+        mailslot_pipe_fill( pipe, &page, msg->size );
+    }
+
+    res = msg->size;
+    atomic_dec( &( slot->used ) );
+    atomic_long_sub( res, &( slot->used_bytes ) );
+    mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+    mailslot_msg_free( msg );
+    return res;
+}
+
+/* As mailslot_list_get, but the oldest message goes to a pipe: the pages of a big one are moved without copies. */
+static ssize_t mailslot_list_splice( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len ) {
+    ssize_t res;
+    message_t* dummy = NULL;
+    message_t* msg = NULL;
+    int lane;
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    lane = mailslot_list_front( slot );
+    if ( lane < 0 ) {
+        spin_unlock( &( slot->cons_lock ) );
+        return 0;
+    }
+    dummy = slot->head[ lane ];
+    msg = smp_load_acquire( &( dummy->next ) );
+    res = mailslot_pipe_check( slot, pipe, len, msg->size );
+    if ( res ) {
+        spin_unlock( &( slot->cons_lock ) );
+        return res;
+    }
+    mailslot_msg_move( dummy, msg );
+    slot->head[ lane ] = msg;
+    spin_unlock( &( slot->cons_lock ) );
+    atomic_dec( &( slot->msg_count ) );
+
+    res = mailslot_msg_splice( slot, pipe, dummy );
+    if ( res < 0 ) {
+        mailslot_list_giveback( slot, dummy );
+    }
+    return res;
+}
+
+static ssize_t mailslot_shard_splice( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len ) {
+    ssize_t res;
+    message_t* msg = mailslot_shard_take( slot, SIZE_MAX ); /* checked against the pipe */
+    if ( msg == NULL ) {
+        return 0;
+    }
+
+    res = mailslot_pipe_check( slot, pipe, len, msg->size );
+    if ( res == 0 ) {
+        res = mailslot_msg_splice( slot, pipe, msg );
+    }
+    if ( res < 0 ) {
+        mailslot_shard_giveback( slot, msg );
+    }
+    return res;
+}
+
+/* As mailslot_ring_get, but the oldest message is copied in pages moved to a pipe, since cells are reused. */
+static ssize_t mailslot_ring_splice( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len ) {
+    int tries;
+    u64 pos, tstamp;
+    u32 msg_size;
+    ssize_t res = 0;
+    size_t offset, chunk, nr_pages = 0, used = 0;
+    struct page** pages = NULL;
+    struct mailslot_ring_view* view = &( mailslot_storage( slot )->view );
+    struct mailslot_cell* cell = NULL;
+
+    pages = kvcalloc( DIV_ROUND_UP( view->max_msg_size, PAGE_SIZE ), sizeof( struct page* ), GFP_KERNEL );
+    if ( pages == NULL ) {
+        return -ENOMEM;
+    }
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        if ( tries > 0 ) {
+            cond_resched();
+        }
+        cell = mailslot_ring_peek( view, &pos );
+        if ( cell == NULL ) {
+            res = 0;
+            break;
+        }
+        msg_size = min( READ_ONCE( cell->size ), view->max_msg_size );
+        res = mailslot_pipe_check( slot, pipe, len, msg_size );
+        if ( res ) {
+            break;
+        }
+        for ( ; nr_pages < DIV_ROUND_UP( msg_size, PAGE_SIZE ); nr_pages++ ) {
+            pages[ nr_pages ] = alloc_page( GFP_KERNEL_ACCOUNT );
+            if ( pages[ nr_pages ] == NULL ) {
+                res = -ENOMEM;
+                goto out;
+            }
+        }
+        for ( offset = 0; offset < msg_size; offset += chunk ) {
+            chunk = min_t( size_t, msg_size - offset, PAGE_SIZE );
+            memcpy( page_address( pages[ offset / PAGE_SIZE ] ), cell->content + offset, chunk );
+        }
+        tstamp = READ_ONCE( cell->tstamp );
+        if ( !mailslot_ring_take( view, pos ) ) {
+            continue; /* consumed by someone else in the meantime */
+        }
+        mailslot_ring_release( view, cell, pos );
+        if ( msg_size == 0 ) {
+            continue;
+        }
+        mailslot_pipe_fill( pipe, pages, msg_size );
+        used = DIV_ROUND_UP( msg_size, PAGE_SIZE );
+        mailslot_stats_hist( slot->stats, residence, tstamp );
+        res = msg_size;
+        break;
+    }
+    if ( tries == MAILSLOT_RING_MAX_TRIES ) {
+        mailslot_debug( "mailslot (id %d): too many retries reading the ring\n", slot->id );
+        res = -EAGAIN;
+    }
+
+out:
+    while ( nr_pages > used ) { /* the pages not moved to the pipe */
+        __free_page( pages[ --nr_pages ] );
+    }
+    kvfree( pages );
+    return res;
+}
+
+mailslot_t* mailslot_alloc( int node ) {
+    int lane;
+    mailslot_t* slot = kzalloc_node( sizeof( mailslot_t ), GFP_KERNEL, node >= 0 ? node : NUMA_NO_NODE );
+    if ( slot == NULL ) {
+        return NULL;
+    }
+    slot->node = node;
+    slot->stats = alloc_percpu( struct mailslot_stats );
+    if ( slot->stats == NULL ) {
+        goto fail_stats;
+    }
+    for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) { /* the dummy nodes */
+        slot->head[ lane ] = kzalloc_node( sizeof( message_t ), GFP_KERNEL, mailslot_msg_node( slot ) );
+        if ( slot->head[ lane ] == NULL ) {
+            goto fail_head;
+        }
+    }
+    if ( percpu_init_rwsem( &( slot->config ) ) ) {
+        goto fail_config;
+    }
+    return slot;
+
+fail_config:
+fail_head: for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+        kfree( slot->head[ lane ] );
+    }
+    free_percpu( slot->stats );
+fail_stats: kfree( slot );
+    return NULL;
+}
+
+void mailslot_init( mailslot_t* slot, int id ) {
+    spin_lock_init( &( slot->prod_lock ) );
+    spin_lock_init( &( slot->cons_lock ) );
+    mutex_init( &( slot->storage_lock ) );
+    atomic_set( &( slot->mappings ), 0 );
+    atomic_set( &( slot->used ), 0 );
+    atomic_long_set( &( slot->used_bytes ), 0 );
+    atomic_set( &( slot->msg_count ), 0 );
+    atomic_set( &( slot->wr_blocked ), 0 );
+    INIT_LIST_HEAD( &( slot->parked ) );
+    init_waitqueue_head( &( slot->rd_queue ) );
+    init_waitqueue_head( &( slot->wr_queue ) );
+    memcpy( slot->tail, slot->head, sizeof( slot->tail ) ); /* empty lanes */
+    slot->lanes = 0;
+    RCU_INIT_POINTER( slot->storage, NULL );
+    slot->ring_budget = 0;
+    slot->max_msg_size = DEFAULT_MAX_MSG_SIZE;
+    slot->max_msgs = MAX_SLOT_SIZE;
+    slot->max_bytes = 0;
+    slot->capacity = MAX_SLOT_SIZE;
+    slot->mode = MAILSLOT_MODE_LIST;
+    slot->id = id;
+    slot->debugfs = mailslot_stats_register( id, slot->stats );
+}
+
+int mailslot_enqueue_batch( mailslot_t* slot, const struct iov_iter* msgs, int n, int prio, int shard, int non_blocking ) {
+    int i, error;
+    size_t size;
+
+    error = mailslot_enter( slot, non_blocking );
+    if ( error ) {
+        return error;
+    }
+
+    for ( i = 0; i < n; i++ ) {
+        size = iov_iter_count( &msgs[i] );
+        if ( size > slot->max_msg_size ) { /* all or nothing */
+            mailslot_debug( "mailslot (id %d): cannot write msg, size (%lu) greater than max allowed by the slot (%lu)\n", slot->id, size, slot->max_msg_size );
+            mailslot_exit( slot );
+            return -EPERM;
+        }
+    }
+
+    if ( slot->mode == MAILSLOT_MODE_LIST ) {
+        error = mailslot_list_put( slot, msgs, n, prio );
+    } else if ( slot->mode == MAILSLOT_MODE_SHARDED ) {
+        error = mailslot_shard_put( slot, msgs, n, shard );
+    } else if ( slot->mode == MAILSLOT_MODE_BROADCAST ) {
+        error = mailslot_bcast_put( slot, msgs, n, prio );
+    } else { /* no allocations: the messages are copied straight into the ring */
+        error = mailslot_ring_put( slot, msgs, n );
+    }
+
+    if ( error == 0 ) {
+        for ( i = 0; i < n; i++ ) {
+            mailslot_account_enqueue( slot, iov_iter_count( &msgs[i] ) );
+            if ( trace_mailslot_enqueue_enabled() ) {
+                trace_mailslot_enqueue( slot->id, iov_iter_count( &msgs[i] ), mailslot_count( slot ) );
+            }
+        }
+        mailslot_debug_printqueue( slot );
+    }
+    mailslot_exit( slot );
+    return error;
+}
+
+ssize_t mailslot_enqueue( mailslot_t* slot, const char __user* content, size_t size, int prio, int shard, int non_blocking ) {
+    struct iov_iter msg;
+    int error = import_ubuf( ITER_SOURCE, (void __user*)content, size, &msg );
+    if ( error == 0 ) {
+        error = mailslot_enqueue_batch( slot, &msg, 1, prio, shard, non_blocking );
+    }
+    return error ? error : size;
+}
+
+/* Dequeues a message according to the storage mode of the slot (configuration held). */
+static ssize_t mailslot_get( mailslot_t* slot, mailslot_sub_t* sub, char __user* buffer, size_t size, mailslot_hdr_t* hdr ) {
+    if ( slot->mode == MAILSLOT_MODE_LIST ) {
+        return mailslot_list_get( slot, buffer, size, hdr );
+    } else if ( slot->mode == MAILSLOT_MODE_SHARDED ) {
+        return mailslot_shard_get( slot, buffer, size, hdr );
+    } else if ( slot->mode == MAILSLOT_MODE_BROADCAST ) {
+        return sub != NULL ? mailslot_bcast_get( slot, sub, buffer, size, hdr ) : -EINVAL;
+    }
+    return mailslot_ring_get( slot, buffer, size, hdr );
+}
+
+ssize_t mailslot_dequeue( mailslot_t* slot, mailslot_sub_t* sub, char __user* buffer, size_t size, int non_blocking,
+                          mailslot_hdr_t* hdr ) {
+    ssize_t res = mailslot_enter( slot, non_blocking );
+    if ( res ) {
+        return res;
+    }
+
+    mailslot_node_claim( slot );
+    res = mailslot_get( slot, sub, buffer, size, hdr );
+    if ( res > 0 ) {
+        mailslot_account_dequeue( slot, res );
+        if ( trace_mailslot_dequeue_enabled() ) {
+            trace_mailslot_dequeue( slot->id, res, mailslot_count( slot ) );
+        }
+        mailslot_debug_printqueue( slot );
+    } else if ( res == 0 ) { /* not an error */
+        mailslot_debug( "mailslot (id %d): no msg to read, empty slot\n", slot->id );
+    }
+    mailslot_exit( slot );
+    return res;
+}
+
+int mailslot_dequeue_batch( mailslot_t* slot, mailslot_sub_t* sub, const struct iovec* bufs, int n, u32* sizes,
+                            int non_blocking ) {
+    int i, count = 0;
+    ssize_t res = mailslot_enter( slot, non_blocking );
+    if ( res ) {
+        return res;
+    }
+
+    mailslot_node_claim( slot );
+    if ( slot->mode == MAILSLOT_MODE_LIST ) { /* a single critical section for the whole batch */
+        res = mailslot_list_get_batch( slot, bufs, n, sizes );
+        count = max_t( int, res, 0 );
+    } else {
+        for ( count = 0; count < n; count++ ) {
+            res = mailslot_get( slot, sub, bufs[ count ].iov_base, bufs[ count ].iov_len, NULL );
+            if ( res <= 0 ) {
+                break;
+            }
+            sizes[ count ] = res;
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        mailslot_account_dequeue( slot, sizes[i] );
+        if ( trace_mailslot_dequeue_enabled() ) {
+            trace_mailslot_dequeue( slot->id, sizes[i], mailslot_count( slot ) );
+        }
+    }
+    if ( count > 0 ) { /* an error after the first message is left to the next call */
+        res = count;
+        mailslot_debug_printqueue( slot );
+    } else if ( res == 0 ) { /* not an error */
+        mailslot_debug( "mailslot (id %d): no msg to read, empty slot\n", slot->id );
+    }
+    mailslot_exit( slot );
+    return res;
+}
+
+ssize_t mailslot_dequeue_splice( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len, int non_blocking ) {
+    ssize_t res = mailslot_enter( slot, non_blocking );
+    if ( res ) {
+        return res;
+    }
+
+    mailslot_node_claim( slot );
+    if ( slot->mode == MAILSLOT_MODE_LIST ) {
+        res = mailslot_list_splice( slot, pipe, len );
+    } else if ( slot->mode == MAILSLOT_MODE_SHARDED ) {
+        res = mailslot_shard_splice( slot, pipe, len );
+    } else if ( slot->mode == MAILSLOT_MODE_BROADCAST ) { /* the pages of a message are shared by its readers */
+        res = -EINVAL;
+    } else {
+        res = mailslot_ring_splice( slot, pipe, len );
+    }
+
+    if ( res > 0 ) {
+        mailslot_account_dequeue( slot, res );
+        if ( trace_mailslot_dequeue_enabled() ) {
+            trace_mailslot_dequeue( slot->id, res, mailslot_count( slot ) );
+        }
+        mailslot_debug_printqueue( slot );
+    }
+    mailslot_exit( slot );
+    return res;
+}
+
+ssize_t mailslot_peek( mailslot_t* slot, char __user* buffer, size_t size, int non_blocking ) {
+    ssize_t res = mailslot_enter( slot, non_blocking );
+    if ( res ) {
+        return res;
+    }
+
+    if ( slot->mode == MAILSLOT_MODE_LIST ) {
+        res = mailslot_list_peek( slot, buffer, size );
+    } else if ( slot->mode == MAILSLOT_MODE_SHARDED ) {
+        res = mailslot_shard_peek( slot, buffer, size );
+    } else if ( slot->mode == MAILSLOT_MODE_BROADCAST ) {
+        res = -EINVAL;
+    } else {
+        res = mailslot_ring_peek_msg( slot, buffer, size );
+    }
+    mailslot_exit( slot );
+    return res;
+}
+
+size_t mailslot_next_size( mailslot_t* slot ) {
+    size_t size = 0;
+    u64 pos;
+    struct mailslot_cell* cell = NULL;
+    struct mailslot_ring_view* view = NULL;
+
+    mailslot_enter( slot, 0 );
+    if ( slot->mode == MAILSLOT_MODE_LIST ) {
+        size = mailslot_list_next_size( slot );
+    } else if ( slot->mode == MAILSLOT_MODE_SHARDED ) {
+        size = mailslot_shard_next_size( slot );
+    } else if ( slot->mode == MAILSLOT_MODE_BROADCAST ) { /* it depends on the subscriber */
+        size = 0;
+    } else {
+        view = &( mailslot_storage( slot )->view );
+        cell = mailslot_ring_peek( view, &pos );
+        if ( cell != NULL ) {
+            size = min( READ_ONCE( cell->size ), view->max_msg_size );
+        }
+    }
+    mailslot_exit( slot );
+    return size;
+}
+
+/* Returns the content bytes of the messages in the slot, without holding the configuration. */
+static size_t mailslot_queued_bytes( mailslot_t* slot ) {
+    size_t bytes;
+    mailslot_storage_t* storage = NULL;
+
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    bytes = storage != NULL ? mailslot_ring_bytes( &( storage->view ) ) : atomic_long_read( &( slot->used_bytes ) );
+    rcu_read_unlock();
+    return bytes;
+}
+
+int mailslot_depth( mailslot_t* slot ) {
+    return mailslot_count( slot );
+}
+
+size_t mailslot_bytes( mailslot_t* slot ) {
+    size_t bytes;
+
+    mailslot_enter( slot, 0 );
+    bytes = mailslot_queued_bytes( slot );
+    mailslot_exit( slot );
+    return bytes;
+}
+
+int mailslot_free_space( mailslot_t* slot ) {
+    return mailslot_capacity( slot ) - mailslot_count( slot );
+}
+
+size_t mailslot_max_msg_size( mailslot_t* slot ) {
+    return READ_ONCE( slot->max_msg_size );
+}
+
+int mailslot_max_msgs( mailslot_t* slot ) {
+    return READ_ONCE( slot->max_msgs );
+}
+
+size_t mailslot_max_bytes( mailslot_t* slot ) {
+    return READ_ONCE( slot->max_bytes );
+}
+
+int mailslot_mode( mailslot_t* slot ) {
+    return READ_ONCE( slot->mode );
+}
+
+/* Returns whether the read watermarks of the slot are reached (always, if they are not set or in broadcast mode). */
+static int mailslot_rd_watermark( mailslot_t* slot ) {
+    int msgs = READ_ONCE( slot->rd_lowat );
+    size_t bytes = READ_ONCE( slot->rd_lowat_bytes );
+
+    if ( ( msgs == 0 && bytes == 0 ) || READ_ONCE( slot->mode ) == MAILSLOT_MODE_BROADCAST ) {
+        return 1;
+    }
+    if ( atomic_read( &( slot->wr_blocked ) ) > 0 ) {
+        return 1;
+    }
+    if ( msgs > 0 && mailslot_count( slot ) >= min( msgs, READ_ONCE( slot->capacity ) ) ) {
+        return 1;
+    }
+    return bytes > 0 && mailslot_queued_bytes( slot ) >= bytes;
+}
+
+/* Returns whether a reader (the subscriber sub, if not NULL) should stop waiting, see mailslot_readable for sleeper. */
+static int mailslot_rd_ready( mailslot_t* slot, mailslot_sub_t* sub, int sleeper ) {
+    return mailslot_sub_readable( slot, sub, sleeper ) && ( sub != NULL || mailslot_rd_watermark( slot ) );
+}
+
+int mailslot_busy_poll( mailslot_t* slot, mailslot_sub_t* sub, unsigned int usecs ) {
+    u64 end = local_clock() + (u64)usecs * NSEC_PER_USEC;
+
+    do {
+        if ( mailslot_rd_ready( slot, sub, 0 ) ) { /* spinning readers don't ask for notifications */
+            mailslot_stats_inc( slot->stats, busy_polls );
+            return 1;
+        }
+        if ( need_resched() || signal_pending( current ) ) {
+            break;
+        }
+        cpu_relax();
+    } while ( local_clock() < end );
+    return 0;
+}
+
+/* As wait_event_interruptible(_exclusive), but sleeping at most *timeout jiffies overall (MAX_SCHEDULE_TIMEOUT: no limit):
+ * *timeout is updated with the time left, so that it is respected across the retries of the caller. */
+#define mailslot_wait_event( wq, condition, timeout, exclusive ) \
+({ \
+    int __res = 0; \
+    DEFINE_WAIT( __wait ); \
+    for ( ;; ) { \
+        if ( exclusive ) { \
+            prepare_to_wait_exclusive( &( wq ), &__wait, TASK_INTERRUPTIBLE ); \
+        } else { \
+            prepare_to_wait( &( wq ), &__wait, TASK_INTERRUPTIBLE ); \
+        } \
+        if ( condition ) { \
+            break; \
+        } \
+        if ( signal_pending( current ) ) { \
+            __res = -ERESTARTSYS; \
+            break; \
+        } \
+        if ( *( timeout ) == 0 ) { \
+            __res = -ETIMEDOUT; \
+            break; \
+        } \
+        *( timeout ) = schedule_timeout( *( timeout ) ); \
+    } \
+    finish_wait( &( wq ), &__wait ); \
+    __res; \
+})
+
+/* Subscribers wait non-exclusively: a message is for all of them. A reader waiting for the read watermarks sleeps
+ * rd_flush jiffies at a time, taking whatever is queued when they elapse. */
+int mailslot_wait_msg( mailslot_t* slot, mailslot_sub_t* sub, long* timeout ) {
+    int res;
+    long flush = sub == NULL ? READ_ONCE( slot->rd_flush ) : 0, slice, left;
+
+    if ( trace_mailslot_wait_enabled() ) {
+        trace_mailslot_wait( slot->id, 0, mailslot_count( slot ) );
+    }
+    mailslot_stats_inc( slot->stats, blocked_readers );
+    if ( flush == 0 ) {
+        return mailslot_wait_event( slot->rd_queue, mailslot_rd_ready( slot, sub, 1 ), timeout, sub == NULL );
+    }
+
+    for ( ;; ) {
+        slice = left = min( flush, *timeout );
+        res = mailslot_wait_event( slot->rd_queue, mailslot_rd_ready( slot, sub, 1 ), &left, 1 );
+        if ( *timeout != MAX_SCHEDULE_TIMEOUT ) {
+            *timeout -= slice - left;
+        }
+        if ( res != -ETIMEDOUT ) {
+            return res;
+        }
+        if ( mailslot_readable( slot, 1 ) ) { /* flush */
+            return 0;
+        }
+        if ( *timeout == 0 ) {
+            return -ETIMEDOUT;
+        }
+    }
+}
+
+int mailslot_wait_lowat( mailslot_t* slot, long* timeout ) {
+    if ( ( READ_ONCE( slot->rd_lowat ) <= 1 && READ_ONCE( slot->rd_lowat_bytes ) == 0 ) || mailslot_rd_watermark( slot ) ) {
+        return 0; /* a single message is enough */
+    }
+    return mailslot_wait_msg( slot, NULL, timeout );
+}
+
+ssize_t mailslot_wait_handoff( mailslot_t* slot, char __user* buffer, size_t size, mailslot_meta_t* meta, long* timeout ) {
+    ssize_t res = 0;
+    message_t* msg = NULL;
+    mailslot_waiter_t waiter = { .task = current, .size = size, .msg = NULL };
+    DEFINE_WAIT( wait );
+
+    if ( READ_ONCE( slot->mode ) != MAILSLOT_MODE_LIST || READ_ONCE( slot->rd_lowat ) > 1 ||
+         READ_ONCE( slot->rd_lowat_bytes ) > 0 ) { /* no handoff to readers waiting for more than a message */
+        return mailslot_wait_msg( slot, NULL, timeout );
+    }
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 );
+    if ( mailslot_list_front( slot ) >= 0 ) { /* a message was enqueued in the meantime */
+        spin_unlock( &( slot->cons_lock ) );
+        return 0;
+    }
+    list_add_tail( &( waiter.node ), &( slot->parked ) );
+    spin_unlock( &( slot->cons_lock ) );
+
+    if ( trace_mailslot_wait_enabled() ) {
+        trace_mailslot_wait( slot->id, 0, mailslot_count( slot ) );
+    }
+    mailslot_stats_inc( slot->stats, blocked_readers );
+    for ( ;; ) { /* messages enqueued by writers which couldn't hand them to us still wake us up */
+        prepare_to_wait_exclusive( &( slot->rd_queue ), &wait, TASK_INTERRUPTIBLE );
+        if ( READ_ONCE( waiter.msg ) != NULL || mailslot_readable( slot, 1 ) ) {
+            break;
+        }
+        if ( signal_pending( current ) ) {
+            res = -ERESTARTSYS;
+            break;
+        }
+        if ( *timeout == 0 ) {
+            res = -ETIMEDOUT;
+            break;
+        }
+        *timeout = schedule_timeout( *timeout );
+    }
+    finish_wait( &( slot->rd_queue ), &wait );
+
+    mailslot_spin_lock( slot, &( slot->cons_lock ), 1 ); /* also waits for the writer handing us a message to be done with the waiter */
+    msg = waiter.msg;
+    if ( msg == NULL ) {
+        list_del( &( waiter.node ) );
+    }
+    spin_unlock( &( slot->cons_lock ) );
+    if ( msg == NULL ) {
+        return res;
+    }
+
+    if ( mailslot_msg_copy_out( msg, buffer ) ) { /* even if a signal is pending, the message is ours */
+        mailslot_debug( "mailslot (id %d): failed to copy msg to user space\n", slot->id );
+        mailslot_list_giveback( slot, msg );
+        mailslot_notify_msg( slot );
+        return -EFAULT;
+    }
+    res = msg->size;
+    mailslot_account_dequeue( slot, res );
+    mailslot_stats_hist( slot->stats, residence, msg->tstamp );
+    if ( trace_mailslot_dequeue_enabled() ) {
+        trace_mailslot_dequeue( slot->id, res, mailslot_count( slot ) );
+    }
+    if ( meta != NULL ) {
+        meta->tstamp = msg->tstamp;
+        meta->pid = msg->pid;
+        meta->prio = msg->lane;
+    }
+    atomic_dec( &( slot->used ) );
+    atomic_long_sub( msg->size, &( slot->used_bytes ) );
+    mailslot_msg_free( msg );
+    return res;
+}
+
+/* Readers waiting for the read watermarks are woken up as well, since the slot won't get any fuller. */
+int mailslot_wait_space( mailslot_t* slot, int n, size_t bytes, long* timeout ) {
+    int res;
+
+    if ( trace_mailslot_wait_enabled() ) {
+        trace_mailslot_wait( slot->id, 1, mailslot_count( slot ) );
+    }
+    mailslot_stats_inc( slot->stats, blocked_writers );
+    atomic_inc( &( slot->wr_blocked ) );
+    smp_mb__after_atomic(); /* pairs with the barrier of the readers setting their state */
+    mailslot_notify_msg( slot );
+    res = mailslot_wait_event( slot->wr_queue, mailslot_has_room( slot, n, bytes, 1 ), timeout, 1 );
+    atomic_dec( &( slot->wr_blocked ) );
+    return res;
+}
+
+/* The wait queues are locked only if someone sleeps on them, not to serialize writers and readers which never wait
+ * (e.g. in sharded mode): the barrier of wq_has_sleeper pairs with the one of the sleepers setting their state. */
+void mailslot_notify_msg( mailslot_t* slot ) {
+    if ( mailslot_count( slot ) == 0 ) { /* e.g. the message was handed to a parked reader */
+        return;
+    }
+    if ( !wq_has_sleeper( &( slot->rd_queue ) ) || !mailslot_rd_watermark( slot ) ) {
+        return;
+    }
+    if ( trace_mailslot_wakeup_enabled() ) {
+        trace_mailslot_wakeup( slot->id, 0, mailslot_count( slot ) );
+    }
+    wake_up_interruptible_poll( &(slot->rd_queue), EPOLLIN | EPOLLRDNORM );
+}
+
+void mailslot_notify_space( mailslot_t* slot ) {
+    int lowat = READ_ONCE( slot->wr_lowat );
+
+    if ( !wq_has_sleeper( &( slot->wr_queue ) ) || ( lowat > 0 && mailslot_count( slot ) >= lowat ) ) {
+        return;
+    }
+    if ( trace_mailslot_wakeup_enabled() ) {
+        trace_mailslot_wakeup( slot->id, 1, mailslot_count( slot ) );
+    }
+    wake_up_interruptible_poll( &(slot->wr_queue), EPOLLOUT | EPOLLWRNORM );
+}
+
+__poll_t mailslot_poll( mailslot_t* slot, mailslot_sub_t* sub, struct file* filp, poll_table* wait ) {
+    __poll_t mask = 0;
+
+    poll_wait( filp, &(slot->rd_queue), wait );
+    poll_wait( filp, &(slot->wr_queue), wait );
+    smp_mb(); /* pairs with the barrier of wq_has_sleeper in the notifiers, as sock_poll_wait */
+
+    /* no need to lock: the wakeups follow every change (the flush timeout of the watermarks is up to the caller).
+     * In shared mode user space is asked for notifications only about the events not reported now. */
+    if ( mailslot_rd_ready( slot, sub, 0 ) || mailslot_rd_ready( slot, sub, 1 ) ) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if ( mailslot_has_room( slot, 1, 1, 0 ) || mailslot_has_room( slot, 1, 1, 1 ) ) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+int mailslot_set_watermarks( mailslot_t* slot, int rd_msgs, size_t rd_bytes, unsigned int flush_ms, int wr_msgs ) {
+    if ( rd_msgs < 0 || rd_msgs > LIMIT_SLOT_SIZE || wr_msgs < 0 || wr_msgs > LIMIT_SLOT_SIZE ) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE( slot->rd_lowat, rd_msgs );
+    WRITE_ONCE( slot->rd_lowat_bytes, rd_bytes );
+    WRITE_ONCE( slot->rd_flush, flush_ms ? (long)msecs_to_jiffies( flush_ms ) : 0 );
+    WRITE_ONCE( slot->wr_lowat, wr_msgs );
+    mailslot_debug( "mailslot (id %d): watermarks set to %d msgs, %zu bytes (flush after %u ms), %d msgs\n", slot->id,
+                    rd_msgs, rd_bytes, flush_ms, wr_msgs );
+
+    /* the sleepers check the new watermarks */
+    wake_up_interruptible_all( &(slot->rd_queue) );
+    wake_up_interruptible_all( &(slot->wr_queue) );
+    return 0;
+}
+
+mailslot_sub_t* mailslot_subscribe( mailslot_t* slot ) {
+    mailslot_sub_t* sub = kzalloc( sizeof( mailslot_sub_t ), GFP_KERNEL );
+    if ( sub == NULL ) {
+        return ERR_PTR( -ENOMEM );
+    }
+    mutex_init( &( sub->lock ) );
+
+    percpu_down_read( &( slot->config ) );
+    if ( slot->mode != MAILSLOT_MODE_BROADCAST ) {
+        percpu_up_read( &( slot->config ) );
+        kfree( sub );
+        return ERR_PTR( -EINVAL );
+    }
+    mailslot_spin_lock( slot, &( slot->prod_lock ), 0 );
+    sub->next = slot->bcast_tail;
+    slot->subscribers++;
+    spin_unlock( &( slot->prod_lock ) );
+    percpu_up_read( &( slot->config ) );
+    mailslot_debug( "mailslot (id %d): new subscriber\n", slot->id );
+    return sub;
+}
+
+/* The messages still in the ring from the cursor of the subscriber on were all counting on it. */
+void mailslot_unsubscribe( mailslot_t* slot, mailslot_sub_t* sub ) {
+    u64 seq;
+    message_t* msg = NULL;
+
+    percpu_down_read( &( slot->config ) );
+    mutex_lock( &( sub->lock ) );
+    mailslot_spin_lock( slot, &( slot->prod_lock ), 1 );
+    seq = max( sub->next, slot->bcast_tail - min_t( u64, slot->bcast_tail, slot->capacity ) );
+    for ( ; seq != slot->bcast_tail; seq++ ) {
+        msg = slot->bcast[ seq % slot->capacity ];
+        mailslot_bcast_consumed( slot, msg, 0 );
+    }
+    slot->subscribers--;
+    spin_unlock( &( slot->prod_lock ) );
+    mutex_unlock( &( sub->lock ) );
+    percpu_up_read( &( slot->config ) );
+
+    mutex_destroy( &( sub->lock ) );
+    kfree( sub );
+    mailslot_notify_space( slot ); /* writers may have been waiting for it */
+}
+
+u64 mailslot_sub_dropped( mailslot_sub_t* sub ) {
+    u64 dropped;
+    mutex_lock( &( sub->lock ) );
+    dropped = sub->dropped;
+    mutex_unlock( &( sub->lock ) );
+    return dropped;
+}
+
+int mailslot_set_bcast_policy( mailslot_t* slot, int policy ) {
+    if ( policy != MAILSLOT_BCAST_BLOCK && policy != MAILSLOT_BCAST_DROP ) {
+        return -EINVAL;
+    }
+    percpu_down_write( &( slot->config ) );
+    WRITE_ONCE( slot->bcast_policy, policy );
+    percpu_up_write( &( slot->config ) );
+    mailslot_notify_space( slot ); /* writers never wait with the drop policy */
+    return 0;
+}
+
+static void mailslot_vm_open( struct vm_area_struct* vma ) {
+    mailslot_t* slot = vma->vm_private_data;
+    atomic_inc( &( slot->mappings ) );
+}
+
+static void mailslot_vm_close( struct vm_area_struct* vma ) {
+    mailslot_t* slot = vma->vm_private_data;
+    atomic_dec( &( slot->mappings ) );
+}
+
+/* counting the mappings, since the ring cannot be freed while user space sees it */
+static const struct vm_operations_struct mailslot_vm_ops = {
+    .open  = mailslot_vm_open,
+    .close = mailslot_vm_close
+};
+
+/* Maps the pages of a shared ring one by one, since remap_vmalloc_range only maps the VM_USERMAP areas of
+ * vmalloc_user, which are not charged to the memory cgroup of the caller. */
+static int mailslot_ring_map( struct vm_area_struct* vma, void* ring, size_t size ) {
+    int error = 0;
+    unsigned long i, pages = vma_pages( vma ), ring_pages = size >> PAGE_SHIFT;
+
+    if ( vma->vm_pgoff > ring_pages || pages > ring_pages - vma->vm_pgoff ) {
+        return -EINVAL;
+    }
+    vm_flags_set( vma, VM_DONTEXPAND | VM_DONTDUMP ); /* as remap_vmalloc_range */
+    for ( i = 0; i < pages && error == 0; i++ ) {
+        error = vm_insert_page( vma, vma->vm_start + i * PAGE_SIZE,
+                                vmalloc_to_page( (char*)ring + ( vma->vm_pgoff + i ) * PAGE_SIZE ) );
+    }
+    return error;
+}
+
+/* It doesn't take the configuration lock, which is held while copying from/to user space (i.e. while faulting),
+ * whereas mmap is called with the mmap lock of the process held. */
+int mailslot_mmap( mailslot_t* slot, struct vm_area_struct* vma ) {
+    int error = -EINVAL;
+    mailslot_storage_t* storage = NULL;
+
+    mutex_lock( &( slot->storage_lock ) );
+    storage = rcu_dereference_protected( slot->storage, lockdep_is_held( &( slot->storage_lock ) ) );
+    if ( storage != NULL && storage->shared ) {
+        error = mailslot_ring_map( vma, storage->view.ring, storage->size );
+    }
+    if ( error == 0 ) {
+        vma->vm_ops = &mailslot_vm_ops;
+        vma->vm_private_data = slot;
+        mailslot_vm_open( vma );
+    }
+    mutex_unlock( &( slot->storage_lock ) );
+    return error;
+}
+
+size_t mailslot_shared_size( mailslot_t* slot ) {
+    size_t size;
+    mailslot_storage_t* storage = NULL;
+
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    size = storage != NULL && storage->shared ? storage->size : 0;
+    rcu_read_unlock();
+    return size;
+}
+
+/* All the sleepers are woken up, since their flag is cleared: the ones still unable to proceed raise it again. */
+void mailslot_shared_notify( mailslot_t* slot, unsigned int which ) {
+    mailslot_storage_t* storage = NULL;
+
+    rcu_read_lock();
+    storage = rcu_dereference( slot->storage );
+    if ( storage != NULL && storage->shared && ( which & MAILSLOT_RING_READERS ) ) {
+        WRITE_ONCE( storage->view.ring->readers_waiting, 0 );
+    }
+    if ( storage != NULL && storage->shared && ( which & MAILSLOT_RING_WRITERS ) ) {
+        WRITE_ONCE( storage->view.ring->writers_waiting, 0 );
+    }
+    rcu_read_unlock();
+
+    if ( which & MAILSLOT_RING_READERS ) {
+        if ( trace_mailslot_wakeup_enabled() ) {
+            trace_mailslot_wakeup( slot->id, 0, mailslot_count( slot ) );
+        }
+        wake_up_interruptible_all( &(slot->rd_queue) );
+    }
+    if ( which & MAILSLOT_RING_WRITERS ) {
+        if ( trace_mailslot_wakeup_enabled() ) {
+            trace_mailslot_wakeup( slot->id, 1, mailslot_count( slot ) );
+        }
+        wake_up_interruptible_all( &(slot->wr_queue) );
+    }
+}
+
+/* Changes the whole configuration of the slot, holding it for writing: the ring (if any) is allocated again,
+ * hence the slot must be empty. */
+static int mailslot_reconfigure( mailslot_t* slot, int mode, size_t max_msg_size, int max_msgs, size_t max_bytes, size_t budget ) {
+    int error;
+    mailslot_storage_t* storage = NULL;
+    message_t** bcast = NULL;
+    struct mailslot_shard __percpu* shards = NULL;
+
+    if ( mailslot_count( slot ) > 0 || atomic_read( &( slot->used ) ) > 0 ) { /* including msgs handed to readers */
+        mailslot_debug( "mailslot (id %d): cannot change the mode of a non-empty slot\n", slot->id );
+        return -EBUSY;
+    }
+
+    if ( atomic_read( &( slot->mappings ) ) > 0 ) { /* checked again when the storage is replaced */
+        mailslot_debug( "mailslot (id %d): cannot change the mode while the ring is mapped\n", slot->id );
+        return -EBUSY;
+    }
+
+    if ( slot->subscribers > 0 ) { /* their cursors refer to the ring */
+        mailslot_debug( "mailslot (id %d): cannot change the mode while the slot has subscribers\n", slot->id );
+        return -EBUSY;
+    }
+
+    if ( mode == MAILSLOT_MODE_BROADCAST ) {
+        bcast = kvzalloc_node( array_size( max_msgs, sizeof( message_t* ) ), GFP_KERNEL_ACCOUNT, mailslot_msg_node( slot ) );
+        if ( bcast == NULL ) {
+            return -ENOMEM;
+        }
+    } else if ( mode == MAILSLOT_MODE_SHARDED ) {
+        shards = slot->mode == MAILSLOT_MODE_SHARDED ? slot->shards : mailslot_shards_alloc();
+        if ( shards == NULL ) {
+            return -ENOMEM;
+        }
+    } else if ( mode != MAILSLOT_MODE_LIST ) { /* the byte limit of a ring is its size */
+        storage = mailslot_storage_alloc( slot, max_msg_size, max_msgs, min_not_zero( max_bytes, budget ),
+                                          mode == MAILSLOT_MODE_SHARED );
+        if ( IS_ERR( storage ) ) {
+            return PTR_ERR( storage );
+        }
+    }
+
+    error = mailslot_storage_replace( slot, storage );
+    if ( error ) {
+        mailslot_storage_destroy( storage );
+        kvfree( bcast );
+        if ( shards != slot->shards ) {
+            free_percpu( shards );
+        }
+        return error;
+    }
+    mailslot_bcast_destroy( slot ); /* the messages left in the ring have been read by every subscriber */
+    slot->bcast = bcast;
+    if ( shards != slot->shards ) { /* the slot is empty */
+        mailslot_shards_destroy( slot );
+        slot->shards = shards;
+    }
+    slot->bcast_tail = 0;
+    WRITE_ONCE( slot->mode, mode );
+    WRITE_ONCE( slot->max_msg_size, max_msg_size );
+    WRITE_ONCE( slot->max_msgs, max_msgs );
+    WRITE_ONCE( slot->max_bytes, max_bytes );
+    slot->ring_budget = budget;
+    WRITE_ONCE( slot->capacity, storage != NULL ? storage->view.mask + 1 : max_msgs );
+    return 0;
+}
+
+int mailslot_set_max_msg_size( mailslot_t* slot, size_t size ) {
+    int error = 0;
+    percpu_down_write( &( slot->config ) );
+    if ( slot->mode == MAILSLOT_MODE_LIST || slot->mode == MAILSLOT_MODE_SHARDED || slot->mode == MAILSLOT_MODE_BROADCAST ) {
+        WRITE_ONCE( slot->max_msg_size, size );
+    } else { /* the ring is resized */
+        error = mailslot_reconfigure( slot, slot->mode, size, slot->max_msgs, slot->max_bytes, slot->ring_budget );
+    }
+    percpu_up_write( &( slot->config ) );
+    return error;
+}
+
+int mailslot_set_mode( mailslot_t* slot, int mode, size_t budget ) {
+    int error;
+
+    if ( mode != MAILSLOT_MODE_LIST && mode != MAILSLOT_MODE_RING && mode != MAILSLOT_MODE_SHARED &&
+         mode != MAILSLOT_MODE_BROADCAST && mode != MAILSLOT_MODE_SHARDED ) {
+        return -EINVAL;
+    }
+
+    percpu_down_write( &( slot->config ) );
+    error = mailslot_reconfigure( slot, mode, slot->max_msg_size, slot->max_msgs, slot->max_bytes, budget );
+    percpu_up_write( &( slot->config ) );
+    return error;
+}
+
+int mailslot_set_capacity( mailslot_t* slot, int msgs, size_t bytes ) {
+    int error = 0;
+
+    if ( msgs <= 0 || msgs > LIMIT_SLOT_SIZE ) {
+        return -EINVAL;
+    }
+
+    percpu_down_write( &( slot->config ) );
+    if ( slot->mode == MAILSLOT_MODE_LIST || slot->mode == MAILSLOT_MODE_SHARDED ) {
+        /* shrinking a non-empty list just makes writers wait */
+        WRITE_ONCE( slot->max_msgs, msgs );
+        WRITE_ONCE( slot->max_bytes, bytes );
+        WRITE_ONCE( slot->capacity, msgs );
+    } else {
+        error = mailslot_reconfigure( slot, slot->mode, slot->max_msg_size, msgs, bytes, slot->ring_budget );
+    }
+    percpu_up_write( &( slot->config ) );
+
+    if ( error == 0 ) {
+        mailslot_notify_space( slot ); /* the slot may have grown */
+    }
+    return error;
+}
+
+int mailslot_set_node( mailslot_t* slot, int node ) {
+    int error = 0, old;
+
+    if ( node != MAILSLOT_NODE_LOCAL && node != MAILSLOT_NODE_READER &&
+         ( node < 0 || node >= nr_node_ids || !node_online( node ) ) ) {
+        return -EINVAL;
+    }
+
+    percpu_down_write( &( slot->config ) );
+    old = slot->node;
+    WRITE_ONCE( slot->node, node );
+    if ( slot->mode == MAILSLOT_MODE_RING ) { /* the ring moves to the node */
+        error = mailslot_reconfigure( slot, slot->mode, slot->max_msg_size, slot->max_msgs, slot->max_bytes, slot->ring_budget );
+        if ( error ) {
+            WRITE_ONCE( slot->node, old );
+        }
+    }
+    percpu_up_write( &( slot->config ) );
+    return error;
+}
+
+int mailslot_node( mailslot_t* slot ) {
+    return READ_ONCE( slot->node );
+}
+
+int mailslot_idle( mailslot_t* slot ) {
+    return mailslot_count( slot ) == 0 && atomic_read( &( slot->used ) ) == 0 && atomic_read( &( slot->mappings ) ) == 0;
+}
+
+void mailslot_free( mailslot_t* slot ) {
+    int lane;
+    message_t* msg = NULL;
+    for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+        while ( slot->head[ lane ] != NULL ) { /* the dummy node included */
+            msg = slot->head[ lane ]->next;
+            mailslot_msg_free( slot->head[ lane ] );
+            slot->head[ lane ] = msg;
+        }
+    }
+    mailslot_bcast_destroy( slot );
+    mailslot_shards_destroy( slot );
+    mailslot_storage_destroy( rcu_dereference_protected( slot->storage, 1 ) ); /* mappings hold a reference to the file */
+    mailslot_stats_unregister( slot->debugfs );
+    percpu_free_rwsem( &( slot->config ) );
+    free_percpu( slot->stats );
+    kfree( slot );
+}
+
+void mailslot_reset_stats( mailslot_t* slot ) {
+    mailslot_stats_reset( slot->stats );
+}
+
+void mailslot_account_error( mailslot_t* slot, int error ) {
+    switch ( error ) {
+        case -EAGAIN:
+            mailslot_stats_inc( slot->stats, eagain );
+            break;
+        case -ENOSPC:
+            mailslot_stats_inc( slot->stats, enospc );
+            break;
+        case -EMSGSIZE:
+            mailslot_stats_inc( slot->stats, emsgsize );
+            break;
+    }
+}
+
+/* It's called while an operation holds the configuration: messages cannot be freed while holding cons_lock,
+ * whereas the content of a ring can change under our feet (only positions are printed). */
+void mailslot_printqueue( mailslot_t* slot ) {
+    int lane;
+    message_t* msg = NULL;
+    struct mailslot_ring_view* view = NULL;
+
+    if ( slot->mode == MAILSLOT_MODE_BROADCAST ) {
+        printk( KERN_DEBUG "mailslot (id %d): (slot content) tail = %llu, subscribers = %d\n", slot->id,
+                READ_ONCE( slot->bcast_tail ), READ_ONCE( slot->subscribers ) );
+        return;
+    }
+    if ( slot->mode == MAILSLOT_MODE_SHARDED ) { /* the shards are not walked, not to take all their locks */
+        printk( KERN_DEBUG "mailslot (id %d): (slot content) %d msgs in the shards\n", slot->id,
+                atomic_read( &( slot->msg_count ) ) );
+        return;
+    }
+    if ( slot->mode != MAILSLOT_MODE_LIST ) {
+        view = &( mailslot_storage( slot )->view );
+        printk( KERN_DEBUG "mailslot (id %d): (slot content) head = %llu, tail = %llu\n", slot->id,
+                READ_ONCE( view->ring->head ), READ_ONCE( view->ring->tail ) );
+        return;
+    }
+    spin_lock( &( slot->cons_lock ) );
+    for ( lane = MAILSLOT_LANES - 1; lane >= 0; lane-- ) {
+        printk( KERN_DEBUG "mailslot (id %d): (slot content, lane %d) head = ", slot->id, lane );
+        for ( msg = smp_load_acquire( &( slot->head[ lane ]->next ) ); msg != NULL; msg = smp_load_acquire( &( msg->next ) ) ) {
+            if ( msg->pages != NULL ) {
+                printk( KERN_CONT "%s(%zu bytes)", msg == slot->head[ lane ]->next ? "" : ", ", msg->size );
+            } else {
+                printk( KERN_CONT "%s\"%.*s\"", msg == slot->head[ lane ]->next ? "" : ", ", (int)msg->size, msg->content );
+            }
+        }
+        printk( KERN_CONT " = tail\n" );
+    }
+    spin_unlock( &( slot->cons_lock ) );
+}
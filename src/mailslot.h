@@ -22,51 +22,227 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <linux/kernel.h>
 
 #define DEFAULT_MAX_MSG_SIZE 256 /* default max size of a message data-unit */
-#define LIMIT_MAX_MSG_SIZE   512 /* upper limit to the max size of a message data-unit */
-#define MAX_SLOT_SIZE        64  /* max number of messages storable in a mailslot */
+#define LIMIT_MAX_MSG_SIZE   ( 4 << 20 ) /* upper limit to the max size of a message data-unit (4 MiB) */
+#define MAX_SLOT_SIZE        64  /* default max number of messages storable in a mailslot */
+#define LIMIT_SLOT_SIZE      65536 /* upper limit to the max number of messages storable in a mailslot */
+#define MAILSLOT_LANES       4   /* priorities of the messages (0 to MAILSLOT_LANES - 1, the highest) */
+#define DEFAULT_RING_BUDGET  ( 16 << 20 ) /* default max size of a ring, whose cells all take max msg size bytes (16 MiB) */
+
+/* storage modes of a mailslot */
+#define MAILSLOT_MODE_LIST   0   /* one allocation per message, kept in a linked list (default) */
+#define MAILSLOT_MODE_RING   1   /* preallocated lock-free ring of fixed-size cells */
+#define MAILSLOT_MODE_SHARED 2   /* ring shared with user space via mmap (see mailslot_ring.h) */
+#define MAILSLOT_MODE_BROADCAST 3 /* each message is read once by every subscriber */
+#define MAILSLOT_MODE_SHARDED 4  /* per-CPU lists: FIFO order is kept only among the messages of a writer */
+
+/* policies of a slot in broadcast mode towards subscribers which fall behind by a whole capacity */
+#define MAILSLOT_BCAST_BLOCK 0   /* writers wait for the slowest subscriber (default) */
+#define MAILSLOT_BCAST_DROP  1   /* the oldest messages are overwritten, slow subscribers lose them */
+
+/* NUMA placement of the messages of a slot, besides the id of a node */
+#define MAILSLOT_NODE_LOCAL  -1  /* the node of each writer (default) */
+#define MAILSLOT_NODE_READER -2  /* the node of the first reader of the slot */
+
+/* the rest of the header is not part of the user space interface */
+#ifdef __KERNEL__
+#include <linux/jump_label.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+
+/* Enabled at runtime via the debug module parameter. */
+DECLARE_STATIC_KEY_FALSE( mailslot_debug_enabled );
+
+/* Debug logging: when disabled, it costs a patched-out branch. */
+#define mailslot_debug( fmt, ... ) \
+do { \
+    if ( static_branch_unlikely( &mailslot_debug_enabled ) ) { \
+        printk( KERN_DEBUG fmt, ##__VA_ARGS__ ); \
+    } \
+} while ( 0 )
 
 typedef struct mailslot mailslot_t;
+typedef struct mailslot_sub mailslot_sub_t;
 
-/* Allocates a mailslot struct. */
-mailslot_t* mailslot_alloc( void );
+/* metadata of a message */
+typedef struct mailslot_meta {
+    u64 tstamp; /* enqueue time (ktime_get_ns) */
+    pid_t pid;  /* thread group id of the writer */
+    int prio;   /* priority of the message (list mode, 0 otherwise) */
+} mailslot_meta_t;
+
+/* Writer of the header of a record holding a message (e.g. of a packed read), embedded by the caller of the dequeue:
+ * put is given the metadata and the size of the message, and returns 0 or -EFAULT. */
+typedef struct mailslot_hdr {
+    int ( *put )( struct mailslot_hdr* hdr, const mailslot_meta_t* meta, size_t size );
+} mailslot_hdr_t;
+
+/* Allocates a mailslot struct on a NUMA node (MAILSLOT_NODE_LOCAL or MAILSLOT_NODE_READER: the node of the caller),
+ * which is also where its messages are allocated. */
+mailslot_t* mailslot_alloc( int node );
 
 /* Initilizes the fields of a mailslot. */
 void mailslot_init( mailslot_t* slot, int id );
 
-/* Enqueues a message in a slot.
- * Note: it must be called in a critical section (e.g. after a mailslot_lock) */
-ssize_t mailslot_enqueue( mailslot_t* slot, const char* content, size_t size, int non_blocking );
+/* Enqueues a message with priority prio in a slot, returning its size or an error (-ENOSPC if the slot is full,
+ * -EMSGSIZE if the message can never fit in it). Priorities are honored in list mode only.
+ * In sharded mode the message goes to the list of the CPU shard: a writer always passing the same one (e.g. the CPU
+ * which opened its file) has its messages read in FIFO order.
+ * Readers and writers run concurrently: the content is copied from user space outside of any lock.
+ * A non-blocking caller gets -EAGAIN instead of waiting for a change of the slot configuration. */
+ssize_t mailslot_enqueue( mailslot_t* slot, const char __user* content, size_t size, int prio, int shard, int non_blocking );
+
+/* Enqueues n messages as a whole: they are all published at once after being copied, or none is.
+ * The content of each message is held by an iterator (over user memory, or kernel pages as in splice_write),
+ * which is left untouched so that the caller can retry. */
+int mailslot_enqueue_batch( mailslot_t* slot, const struct iov_iter* msgs, int n, int prio, int shard, int non_blocking );
+
+/* Dequeues the oldest message of the highest priority in the slot, writing its header via hdr (if not NULL) once the
+ * message is copied and before it is taken. In sharded mode it's the oldest message of the list of the current CPU or,
+ * if empty, of another one. In broadcast mode it reads the next message of the subscriber sub (-EINVAL if NULL),
+ * leaving it to the others. It returns 0 if the slot is empty; if the copy to user space (of the message or of its
+ * header) fails, the message is left in the slot. */
+ssize_t mailslot_dequeue( mailslot_t* slot, mailslot_sub_t* sub, char __user* buffer, size_t size, int non_blocking,
+                          mailslot_hdr_t* hdr );
+
+/* Dequeues up to n messages as mailslot_dequeue, the i-th into bufs[i] (which must fit it as a whole), storing their
+ * sizes in sizes. In list mode they are all unlinked within a single critical section.
+ * It returns the number of messages dequeued, stopping at the first one which doesn't fit its buffer, 0 if the slot is
+ * empty or the error of the first message (-EMSGSIZE if it doesn't fit, -EFAULT if it can't be copied). */
+int mailslot_dequeue_batch( mailslot_t* slot, mailslot_sub_t* sub, const struct iovec* bufs, int n, u32* sizes,
+                            int non_blocking );
+
+/* Dequeues the oldest message in the slot into a pipe (locked by the caller), if it fits as a whole in len bytes and
+ * in the free buffers of the pipe (-EAGAIN otherwise). In list mode the pages of a big message are moved to the pipe.
+ * It returns 0 if the slot is empty. */
+ssize_t mailslot_dequeue_splice( mailslot_t* slot, struct pipe_inode_info* pipe, size_t len, int non_blocking );
+
+/* Copies the oldest message of the highest priority in the slot to user space without dequeuing it (as MSG_PEEK),
+ * returning its size, 0 if the slot is empty, or -EMSGSIZE if the buffer is too small. */
+ssize_t mailslot_peek( mailslot_t* slot, char __user* buffer, size_t size, int non_blocking );
+
+/* Returns the size of the message the next dequeue would return (0 if the slot is empty). */
+size_t mailslot_next_size( mailslot_t* slot );
+
+/* Returns the number of messages in the slot. */
+int mailslot_depth( mailslot_t* slot );
+
+/* Returns the content bytes of the messages in the slot (approximate under concurrency). */
+size_t mailslot_bytes( mailslot_t* slot );
+
+/* Returns the max number of messages storable in the slot. */
+int mailslot_capacity( mailslot_t* slot );
+
+/* Returns the number of messages that can still be enqueued in the slot. */
+int mailslot_free_space( mailslot_t* slot );
+
+/* Returns the max message size allowed in the slot. */
+size_t mailslot_max_msg_size( mailslot_t* slot );
+
+/* Return the capacity limits set via mailslot_set_capacity and the storage mode of the slot. */
+int mailslot_max_msgs( mailslot_t* slot );
+size_t mailslot_max_bytes( mailslot_t* slot );
+int mailslot_mode( mailslot_t* slot );
+
+/* Makes the caller sleep and wait for a message to be written in the slot (for the subscriber sub, if not NULL),
+ * for at most *timeout jiffies (MAX_SCHEDULE_TIMEOUT: no limit), which are updated with the time left.
+ * It returns 0, -ERESTARTSYS if interrupted by a signal or -ETIMEDOUT. */
+int mailslot_wait_msg( mailslot_t* slot, mailslot_sub_t* sub, long* timeout );
+
+/* Makes a blocking reader (not a subscriber) wait until the read watermarks of the slot are reached, before its first
+ * dequeue: it returns 0 at once if they are (or if not set), otherwise as mailslot_wait_msg. */
+int mailslot_wait_lowat( mailslot_t* slot, long* timeout );
+
+/* Spins for up to usecs microseconds before a reader sleeps, as SO_BUSY_POLL, returning whether a message can be read
+ * (by the subscriber sub, if not NULL) or 0 once the budget runs out, the CPU is needed or a signal is pending.
+ * Meanwhile writers find nobody to wake up. */
+int mailslot_busy_poll( mailslot_t* slot, mailslot_sub_t* sub, unsigned int usecs );
+
+/* Makes a reader of an empty slot sleep, parked so that a writer can hand it its message directly (list mode only).
+ * It returns the size of the message copied in buffer, 0 if the caller must retry to dequeue (a message was enqueued)
+ * or an error (-ERESTARTSYS if interrupted by a signal, -ETIMEDOUT as mailslot_wait_msg). */
+ssize_t mailslot_wait_handoff( mailslot_t* slot, char __user* buffer, size_t size, mailslot_meta_t* meta, long* timeout );
+
+/* Returns whether n messages of bytes bytes overall fit in the slot right now. In shared mode a writer about to sleep
+ * (sleeper) raises writers_waiting first, so that user space consumers know they must issue a MAILSLOT_RING_NOTIFY. */
+int mailslot_has_room( mailslot_t* slot, int n, size_t bytes, int sleeper );
+
+/* Makes the caller sleep and wait for space availability in the slot (for n messages of bytes bytes overall),
+ * with a timeout as mailslot_wait_msg. */
+int mailslot_wait_space( mailslot_t* slot, int n, size_t bytes, long* timeout );
 
-/* Dequeues the oldest message in the slot.
- * Note: it must be called in a critical section (e.g. after a mailslot_lock) */
-ssize_t mailslot_dequeue( mailslot_t* slot, char* buffer, size_t size, int non_blocking );
+/* Wakes up all processes waiting for new messages in the slot. */
+void mailslot_notify_msg( mailslot_t* slot );
 
-/* Locks the access to the slot.
- * It returns 1 if lock was acquired, 0 otherwise. */
-int mailslot_lock( mailslot_t* slot, int non_blocking );
+/* Wakes up all processes waiting for space in the slot. */
+void mailslot_notify_space( mailslot_t* slot );
 
-/* Unlocks the access to the slot. */
-void mailslot_unlock( mailslot_t* slot );
+/* Returns the readiness of the slot for poll/select/epoll (EPOLLIN if it holds messages, EPOLLOUT if it has space).
+ * The wakeups of mailslot_notify_msg and mailslot_notify_space carry the matching poll keys,
+ * so it works with edge-triggered and EPOLLEXCLUSIVE epoll waiters. */
+__poll_t mailslot_poll( mailslot_t* slot, mailslot_sub_t* sub, struct file* filp, poll_table* wait );
 
-/* Makes the caller sleep and wait for a message to be written in the slot. */
-int mailslot_wait_msg( mailslot_t* slot );
+/* Subscribes to a slot in broadcast mode (-EINVAL in the other modes): the subscriber reads the messages enqueued
+ * from now on. It returns the subscriber or an ERR_PTR. */
+mailslot_sub_t* mailslot_subscribe( mailslot_t* slot );
 
-/* Makes the caller sleep and wait for space availability in the slot. */
-int mailslot_wait_space( mailslot_t* slot );
+/* Unsubscribes from a slot, marking the messages left unread by the subscriber as read. */
+void mailslot_unsubscribe( mailslot_t* slot, mailslot_sub_t* sub );
 
-/* Wakes up all processes waiting for new messages in the slot. */
-void mailslot_notify_msg( mailslot_t* slot );
+/* Returns the number of messages a subscriber lost because they were overwritten (MAILSLOT_BCAST_DROP). */
+u64 mailslot_sub_dropped( mailslot_sub_t* sub );
 
-/* Wakes up all processes waiting for space in the slot. */
-void mailslot_notify_space( mailslot_t* slot );
+/* Sets the policy of a slot in broadcast mode towards slow subscribers (MAILSLOT_BCAST_BLOCK, MAILSLOT_BCAST_DROP). */
+int mailslot_set_bcast_policy( mailslot_t* slot, int policy );
+
+/* Sets the watermarks of the slot (0: not set, up to LIMIT_SLOT_SIZE messages): readers waiting for messages are
+ * woken up once rd_msgs messages or rd_bytes bytes are queued, or after flush_ms milliseconds if any message is;
+ * writers waiting for room are woken up once fewer than wr_msgs messages are queued. */
+int mailslot_set_watermarks( mailslot_t* slot, int rd_msgs, size_t rd_bytes, unsigned int flush_ms, int wr_msgs );
 
-/* Sets the max message size allowed in the slot. */
-void mailslot_set_max_msg_size( mailslot_t* slot, size_t size );
+/* Maps the ring of a slot in shared mode in the address space of the caller. */
+int mailslot_mmap( mailslot_t* slot, struct vm_area_struct* vma );
+
+/* Returns the size in bytes of the mapping of a slot in shared mode, 0 in the other modes. */
+size_t mailslot_shared_size( mailslot_t* slot );
+
+/* Wakes up all the readers and/or writers (MAILSLOT_RING_READERS, MAILSLOT_RING_WRITERS) of a slot in shared mode,
+ * after user space produced or consumed messages through the mapping. */
+void mailslot_shared_notify( mailslot_t* slot, unsigned int which );
+
+/* Sets the max message size allowed in the slot.
+ * In ring and shared mode the ring is resized, hence the slot must be empty (and not mapped). */
+int mailslot_set_max_msg_size( mailslot_t* slot, size_t size );
+
+/* Sets the storage mode of the slot, which must be empty (and not mapped).
+ * The ring is sized to hold as many messages as allowed by the capacity of the slot and, if not 0, by budget bytes. */
+int mailslot_set_mode( mailslot_t* slot, int mode, size_t budget );
+
+/* Sets the max number of messages (up to LIMIT_SLOT_SIZE) and the max content bytes (0: no limit) of the slot.
+ * In list mode they are enforced on enqueue, in ring and shared mode the ring is resized (the slot must be empty). */
+int mailslot_set_capacity( mailslot_t* slot, int msgs, size_t bytes );
+
+/* Sets the NUMA node of the messages of the slot (an online node, MAILSLOT_NODE_LOCAL or MAILSLOT_NODE_READER):
+ * messages already queued stay where they are, a ring in ring mode is allocated again (the slot must be empty). */
+int mailslot_set_node( mailslot_t* slot, int node );
+
+/* Returns the NUMA node of the messages of the slot (MAILSLOT_NODE_READER until the slot is first read). */
+int mailslot_node( mailslot_t* slot );
+
+/* Returns whether the slot holds no messages and is not mapped, i.e. whether it can be freed once no file uses it. */
+int mailslot_idle( mailslot_t* slot );
 
 /* Frees the mailslot memory. */
 void mailslot_free( mailslot_t* slot );
 
-/* Prints the content of the slot fifo queue. */
+/* Clears the statistics of the slot. */
+void mailslot_reset_stats( mailslot_t* slot );
+
+/* Accounts an error returned to the user in the statistics of the slot (-EAGAIN, -ENOSPC, -EMSGSIZE). */
+void mailslot_account_error( mailslot_t* slot, int error );
+
+/* Prints the content of the slot fifo queue (it is called on each enqueue/dequeue only when debugging). */
 void mailslot_printqueue( mailslot_t* slot );
 
+#endif /* __KERNEL__ */
+
 #endif
\ No newline at end of file
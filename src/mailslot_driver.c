@@ -18,196 +18,1488 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "mailslot_driver.h"
 #include "mailslot.h"
+#include "mailslot_stats.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>      /* for char device functions */
 #include <linux/cdev.h>    /* for cdev handling functions */
 #include <linux/sched.h>   /* for current pointer */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>    /* for kzalloc */
+#include <linux/xarray.h>  /* for the table of the instances */
+#include <linux/miscdevice.h> /* for the control device */
+#include <asm/ioctls.h>    /* for FIONREAD */
+#include <linux/uio.h>     /* for iov_iter */
+#include <linux/pipe_fs_i.h> /* for pipe buffers */
+#include <linux/splice.h>  /* for splice_desc */
+#include <linux/nodemask.h> /* for node_online */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Riccardo Ostani");
 MODULE_DESCRIPTION("Mail slots for Linux");
 MODULE_VERSION("1.0");
 
-#define DEV_NAME     "mailslot" /* name of the device driver */
-#define BASE_MINOR   0          /* base minor number */
-#define INSTANCES    256        /* number of mailslot instances supported */
+#define DEV_NAME     "mailslot"     /* name of the device driver */
+#define CTL_NAME     "mailslot_ctl" /* name of the control device */
+
+static int base_minor = 0;
+module_param( base_minor, int, 0444 );
+MODULE_PARM_DESC( base_minor, "First minor number of the slots (default: 0)" );
+
+static int instances = 256;
+module_param( instances, int, 0444 );
+MODULE_PARM_DESC( instances, "Number of minor numbers reserved to the slots (default: 256)" );
 
 static int major; /* major number assigned to the mailslot device driver */
 static dev_t dev;
 static struct cdev* ms_cdev;
 
-static mailslot_t* mailslot[ INSTANCES ] = { NULL };
+/* a slot is allocated on the first open of its minor (or by MAILSLOT_CTL_CREATE), and freed once idle and empty */
+struct ms_instance {
+    mailslot_t* slot;
+    int minor;
+    int users;   /* open files */
+    bool pinned; /* created by MAILSLOT_CTL_CREATE: kept even if idle and empty, until MAILSLOT_CTL_DESTROY */
+};
 
-static ssize_t ms_write( struct file* filp, const char __user* buffer, size_t size, loff_t* ofst ) {
-    int result, has_lock;
-    int non_blocking = filp->f_flags & O_NONBLOCK;
-    int slot_id = iminor( filp->f_path.dentry->d_inode ) ;
-    mailslot_t* slot = mailslot[ slot_id - BASE_MINOR ];
+static DEFINE_XARRAY( ms_instances );     /* instances keyed by minor number */
+static DEFINE_MUTEX( ms_instances_lock ); /* serializes the creation and the release of the instances */
 
-    if ( size == 0 ) {
-        printk( KERN_INFO "mailslot (id %d): [write] pid %d tried to write a 0-size msg\n", slot_id, current->pid );
+/* per-file (i.e. per open) state */
+struct ms_session {
+    mailslot_t* slot;            /* the slot of the minor of the file */
+    struct mailslot_batch batch; /* sizes of the messages returned by the last readv */
+    unsigned int packed;         /* MAILSLOT_PACKED_* flags */
+    int prio;                    /* priority of the messages written (lane of the slot) */
+    unsigned int rd_timeout;     /* max wait of a blocking read, in milliseconds (0: no limit) */
+    unsigned int wr_timeout;     /* max wait of a blocking write, in milliseconds (0: no limit) */
+    mailslot_sub_t* sub;         /* subscription to the slot in broadcast mode (NULL: none) */
+    int shard;                   /* list of the messages written in sharded mode: the CPU which opened the file */
+    unsigned int busy_poll;      /* max spin of a blocking read before sleeping, in microseconds (0: never spins) */
+};
+
+/* boolean module parameters backed by a static key (kp->arg) */
+static int ms_set_key( const char* val, const struct kernel_param* kp ) {
+    bool enable;
+    int error = kstrtobool( val, &enable );
+    if ( error ) {
+        return error;
+    }
+    if ( enable ) {
+        static_branch_enable( (struct static_key_false*)kp->arg );
+    } else {
+        static_branch_disable( (struct static_key_false*)kp->arg );
+    }
+    return 0;
+}
+
+static int ms_get_key( char* buffer, const struct kernel_param* kp ) {
+    return sprintf( buffer, "%c\n", static_branch_unlikely( (struct static_key_false*)kp->arg ) ? 'Y' : 'N' );
+}
+
+static const struct kernel_param_ops ms_key_ops = {
+    .set = ms_set_key,
+    .get = ms_get_key
+};
+
+module_param_cb( debug, &ms_key_ops, &mailslot_debug_enabled, 0644 );
+MODULE_PARM_DESC( debug, "Log every operation on the slots (default: N, see also the mailslot tracepoints)" );
+
+module_param_cb( stats, &ms_key_ops, &mailslot_stats_enabled, 0644 );
+MODULE_PARM_DESC( stats, "Collect the statistics exported in /sys/kernel/debug/mailslot/ (default: N)" );
+
+static unsigned long ring_budget = DEFAULT_RING_BUDGET;
+module_param( ring_budget, ulong, 0644 );
+MODULE_PARM_DESC( ring_budget, "Max bytes of the ring of a slot in ring or shared mode (default: 16 MiB, 0: room for as many msgs of max size as its capacity)" );
+
+static int numa_node = MAILSLOT_NODE_LOCAL;
+
+/* the NUMA node of the slots created from then on: an online node, MAILSLOT_NODE_LOCAL or MAILSLOT_NODE_READER */
+static int ms_set_node( const char* val, const struct kernel_param* kp ) {
+    int node;
+    int error = kstrtoint( val, 0, &node );
+    if ( error ) {
+        return error;
+    }
+    if ( node != MAILSLOT_NODE_LOCAL && node != MAILSLOT_NODE_READER &&
+         ( node < 0 || node >= nr_node_ids || !node_online( node ) ) ) {
+        return -EINVAL;
+    }
+    WRITE_ONCE( *(int*)kp->arg, node );
+    return 0;
+}
+
+static const struct kernel_param_ops ms_node_ops = {
+    .set = ms_set_node,
+    .get = param_get_int
+};
+
+module_param_cb( numa_node, &ms_node_ops, &numa_node, 0644 );
+MODULE_PARM_DESC( numa_node, "NUMA node of the slots created from now on (-1: the node of the CPU creating them, "
+                             "-2: the one of their first reader)" );
+
+static inline mailslot_t* ms_slot( struct file* filp ) {
+    return ( (struct ms_session*)filp->private_data )->slot;
+}
+
+static inline mailslot_sub_t* ms_sub( struct file* filp ) {
+    return READ_ONCE( ( (struct ms_session*)filp->private_data )->sub );
+}
+
+static inline int ms_prio( struct file* filp ) {
+    return ( (struct ms_session*)filp->private_data )->prio;
+}
+
+static inline int ms_shard( struct file* filp ) {
+    return ( (struct ms_session*)filp->private_data )->shard;
+}
+
+/* Returns whether a blocking read of an empty slot can retry after spinning, without going to sleep. */
+static inline int ms_busy_poll( struct file* filp ) {
+    unsigned int usecs = ( (struct ms_session*)filp->private_data )->busy_poll;
+    return usecs > 0 && mailslot_busy_poll( ms_slot( filp ), ms_sub( filp ), usecs );
+}
+
+/* Returns the instance of a minor, creating it if needed (ms_instances_lock held). */
+static struct ms_instance* ms_instance_get( int minor ) {
+    int error;
+    struct ms_instance* inst = xa_load( &ms_instances, minor );
+    if ( inst != NULL ) {
+        return inst;
+    }
+
+    inst = kzalloc( sizeof( struct ms_instance ), GFP_KERNEL );
+    if ( inst == NULL ) {
+        return ERR_PTR( -ENOMEM );
+    }
+    inst->slot = mailslot_alloc( READ_ONCE( numa_node ) ); /* the first open of the minor creates the slot */
+    if ( inst->slot == NULL ) {
+        error = -ENOMEM;
+        goto fail_slot;
+    }
+    mailslot_init( inst->slot, minor ); /* the id of the slot is its minor number */
+    inst->minor = minor;
+    error = xa_err( xa_store( &ms_instances, minor, inst, GFP_KERNEL ) );
+    if ( error ) {
+        goto fail_store;
+    }
+    mailslot_debug( "mailslot (id %d): slot created\n", minor );
+    return inst;
+
+fail_store: mailslot_free( inst->slot );
+fail_slot: kfree( inst );
+    return ERR_PTR( error );
+}
+
+/* Frees an instance if it is idle and empty, unless it was pinned (ms_instances_lock held). */
+static void ms_instance_put( struct ms_instance* inst ) {
+    if ( inst->users > 0 || inst->pinned || !mailslot_idle( inst->slot ) ) {
+        return;
+    }
+    xa_erase( &ms_instances, inst->minor );
+    mailslot_debug( "mailslot (id %d): slot released\n", inst->minor );
+    mailslot_free( inst->slot );
+    kfree( inst );
+}
+
+/* Returns the time a blocking read (or write) on the file may wait, in jiffies: retries of the operation after
+ * a wakeup consume the same budget. */
+static inline long ms_timeout( struct file* filp, int write ) {
+    struct ms_session* session = filp->private_data;
+    unsigned int ms = write ? session->wr_timeout : session->rd_timeout;
+    return ms == 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies( ms );
+}
+
+/* Returns the error of a wait which ended without the awaited event (-ETIMEDOUT, or -EINTR if interrupted). */
+static inline int ms_wait_error( int error ) {
+    return error == -ETIMEDOUT ? error : -EINTR;
+}
+
+/* Accounts and returns the error of an operation that would block but must not. */
+static int ms_eagain( mailslot_t* slot ) {
+    mailslot_account_error( slot, -EAGAIN );
+    return -EAGAIN;
+}
+
+/* Makes a blocking read wait for the read watermarks of the slot before its first dequeue, which then takes whatever is
+ * queued (the subscribers of a slot in broadcast mode read every message as soon as it's enqueued). */
+static int ms_wait_lowat( struct file* filp, mailslot_t* slot, int non_blocking, long* timeout ) {
+    int error;
+    if ( non_blocking || ms_sub( filp ) != NULL ) {
         return 0;
     }
+    error = mailslot_wait_lowat( slot, timeout );
+    return error ? ms_wait_error( error ) : 0;
+}
 
-    if ( buffer == NULL ) {
-        printk( KERN_INFO "mailslot (id %d): [write] pid %d tried to write a NULL msg\n", slot_id, current->pid );
-        return -EFAULT;
+/* Packed write: enqueues all the framed messages in the buffer (as separate messages), or none of them.
+ * The framing is read once: the messages are then handed to the slot as a batch, which publishes them at once. */
+static ssize_t ms_write_packed( struct file* filp, mailslot_t* slot, const char __user* buffer, size_t size,
+                                int non_blocking ) {
+    int n, max_n;
+    ssize_t result = 0;
+    size_t offset, bytes = 0;
+    __u32 msg_size;
+    struct iov_iter* msgs = NULL;
+    struct ms_session* session = filp->private_data;
+    long timeout = ms_timeout( filp, 1 );
+    size_t hdr_size = MAILSLOT_REC_HDR_SIZE( session->packed );
+
+    max_n = min_t( size_t, mailslot_capacity( slot ), size / ( hdr_size + 1 ) + 1 );
+    msgs = kvmalloc_array( max_n, sizeof( struct iov_iter ), GFP_KERNEL );
+    if ( msgs == NULL ) {
+        return -ENOMEM;
+    }
+
+    /* validating the framing of the whole buffer first */
+    n = 0;
+    for ( offset = 0; offset < size; offset += MAILSLOT_REC_SIZE( session->packed, msg_size ) ) {
+        if ( offset + hdr_size > size ) {
+            result = -EINVAL;
+            break;
+        }
+        if ( get_user( msg_size, (const __u32 __user*)( buffer + offset ) ) ) {
+            result = -EFAULT;
+            break;
+        }
+        if ( msg_size == 0 || offset + hdr_size + msg_size > size ) {
+            result = -EINVAL;
+            break;
+        }
+        if ( msg_size > mailslot_max_msg_size( slot ) ) {
+            result = -EPERM;
+            break;
+        }
+        if ( n == max_n ) {
+            result = -EMSGSIZE; /* the batch can never fit in the slot */
+            break;
+        }
+        result = import_ubuf( ITER_SOURCE, (void __user*)( buffer + offset + hdr_size ), msg_size, &msgs[n] );
+        if ( result ) {
+            break;
+        }
+        bytes += msg_size;
+        n++;
     }
 
 write:
-    has_lock = mailslot_lock( slot, non_blocking );
-    if ( !has_lock ) {
-        printk( KERN_ERR "mailslot (id %d): [write] pid %d couldn't acquire lock\n", slot_id, current->pid );
-        return non_blocking ? -EAGAIN : -EINTR;
+    if ( result == 0 && n > 0 ) {
+        result = mailslot_enqueue_batch( slot, msgs, n, ms_prio( filp ), ms_shard( filp ), non_blocking );
+    }
+
+    if ( result == -ENOSPC ) {
+        if ( non_blocking ) {
+            result = ms_eagain( slot );
+        } else {
+            result = mailslot_wait_space( slot, n, bytes, &timeout );
+            if ( result == 0 ) {
+                goto write;
+            }
+            result = ms_wait_error( result );
+        }
+    }
+    kvfree( msgs );
+
+    if ( result == 0 ) {
+        if ( n > 0 ) {
+            mailslot_notify_msg( slot );
+        }
+        return size;
+    }
+    return result;
+}
+
+/* The header of a record of a packed read, written before its message is taken from the slot. */
+struct ms_rec_hdr {
+    mailslot_hdr_t hdr;
+    char __user* buffer;
+    size_t size; /* the meta fields are written only with MAILSLOT_PACKED_META */
+};
+
+static int ms_rec_put( mailslot_hdr_t* hdr, const mailslot_meta_t* meta, size_t size ) {
+    struct ms_rec_hdr* rec_hdr = container_of( hdr, struct ms_rec_hdr, hdr );
+    struct mailslot_rec rec;
+
+    rec.size = size;
+    rec.pid = meta->pid;
+    rec.tstamp = meta->tstamp;
+    return copy_to_user( rec_hdr->buffer, &rec, rec_hdr->size ) ? -EFAULT : 0;
+}
+
+/* Packed (drain) read: fills the buffer with as many whole messages as fit, each preceded by its header.
+ * A message whose header can't be written is left in the slot. */
+static ssize_t ms_read_packed( struct file* filp, mailslot_t* slot, char __user* buffer, size_t size, int non_blocking ) {
+    ssize_t result;
+    size_t offset;
+    struct ms_session* session = filp->private_data;
+    long timeout = ms_timeout( filp, 0 );
+    size_t hdr_size = MAILSLOT_REC_HDR_SIZE( session->packed );
+    struct ms_rec_hdr rec_hdr = { .hdr.put = ms_rec_put, .size = hdr_size };
+
+    if ( size <= hdr_size ) { /* not even a 1-byte message would fit */
+        return -EINVAL;
+    }
+    result = ms_wait_lowat( filp, slot, non_blocking, &timeout );
+    if ( result ) {
+        return result;
     }
-    printk( KERN_INFO "mailslot (id %d): [write] lock acquired (pid %d)\n", slot_id, current->pid );
 
-    result = mailslot_enqueue( slot, buffer, size, non_blocking );
+read:
+    result = 0;
+    offset = 0;
+    while ( offset + hdr_size < size ) {
+        rec_hdr.buffer = buffer + offset;
+        result = mailslot_dequeue( slot, ms_sub( filp ), buffer + offset + hdr_size, size - offset - hdr_size, non_blocking,
+                                   &( rec_hdr.hdr ) );
+        if ( result <= 0 ) {
+            break;
+        }
+        offset += MAILSLOT_REC_SIZE( session->packed, result );
+    }
 
-    mailslot_unlock( slot );
-    printk( KERN_INFO "mailslot (id %d): [write] slot unlocked (pid %d)\n", slot_id, current->pid );
+    if ( offset > 0 ) { /* the padding of the last message may not fit in the buffer */
+        mailslot_notify_space( slot );
+        return min( offset, size );
+    }
+    if ( result == 0 ) {
+        if ( non_blocking ) {
+            result = ms_eagain( slot );
+        } else if ( ms_busy_poll( filp ) ) {
+            goto read;
+        } else {
+            result = mailslot_wait_msg( slot, ms_sub( filp ), &timeout );
+            if ( result == 0 ) {
+                goto read;
+            }
+            result = ms_wait_error( result );
+        }
+    }
+    return result;
+}
+
+/* Writes a single buffer as write does, also for write_iter when it's given one (e.g. by io_uring). */
+static ssize_t ms_write_buf( struct file* filp, const char __user* buffer, size_t size, int non_blocking ) {
+    int result;
+    long timeout = ms_timeout( filp, 1 );
+    mailslot_t* slot = ms_slot( filp );
+    struct ms_session* session = filp->private_data;
+
+    if ( session->packed & MAILSLOT_PACKED_WRITE ) {
+        return ms_write_packed( filp, slot, buffer, size, non_blocking );
+    }
+
+write:
+    result = mailslot_enqueue( slot, buffer, size, ms_prio( filp ), ms_shard( filp ), non_blocking );
 
     if ( result > 0 ) { /* the message was correctly enqueued! */
         mailslot_notify_msg( slot );
     } else if ( result == -ENOSPC ) { /* slot is full! */
         if ( non_blocking ) { /* the write would block but we must not! */
-            result = -EAGAIN;
+            result = ms_eagain( slot );
         } else {
-            result = mailslot_wait_space( slot );
+            result = mailslot_wait_space( slot, 1, size, &timeout );
             if ( result == 0 ) { /* now there's space for the message */
                 goto write; /* try again to write the message */
             } else { /* sleep was interrupted by a signal! */
+                result = ms_wait_error( result );
+            }
+        }
+    }
+    return result;
+}
+
+static ssize_t ms_write( struct file* filp, const char __user* buffer, size_t size, loff_t* ofst ) {
+    int slot_id = iminor( filp->f_path.dentry->d_inode ) ;
+
+    if ( size == 0 ) {
+        mailslot_debug( "mailslot (id %d): [write] pid %d tried to write a 0-size msg\n", slot_id, current->pid );
+        return 0;
+    }
+
+    if ( buffer == NULL ) {
+        mailslot_debug( "mailslot (id %d): [write] pid %d tried to write a NULL msg\n", slot_id, current->pid );
+        return -EFAULT;
+    }
+    return ms_write_buf( filp, buffer, size, filp->f_flags & O_NONBLOCK );
+}
+
+/* Reads to a single buffer as read does, also for read_iter when it's given one (e.g. by io_uring): packed mode and
+ * the handoff of messages to parked readers apply to both. */
+static ssize_t ms_read_buf( struct file* filp, char __user* buffer, size_t size, int non_blocking ) {
+    int result;
+    long timeout = ms_timeout( filp, 0 );
+    mailslot_t* slot = ms_slot( filp );
+    struct ms_session* session = filp->private_data;
+
+    if ( session->packed & MAILSLOT_PACKED_READ ) {
+        return ms_read_packed( filp, slot, buffer, size, non_blocking );
+    }
+    result = ms_wait_lowat( filp, slot, non_blocking, &timeout );
+    if ( result ) {
+        return result;
+    }
+
+read:
+    result = mailslot_dequeue( slot, ms_sub( filp ), buffer, size, non_blocking, NULL );
+
+    if ( result > 0 ) { /* a message was correctly dequeued! */
+        mailslot_notify_space( slot );
+    } else if ( result == 0 ) { /* slot is empty! */
+        if ( non_blocking ) { /* the read would block but we must not! */
+            result = ms_eagain( slot );
+        } else if ( ms_busy_poll( filp ) ) { /* a message arrived while spinning */
+            goto read;
+        } else if ( ms_sub( filp ) != NULL ) { /* messages are not handed to subscribers */
+            result = mailslot_wait_msg( slot, ms_sub( filp ), &timeout );
+            if ( result == 0 ) {
+                goto read;
+            } else if ( result == -ERESTARTSYS ) {
                 result = -EINTR;
             }
+        } else {
+            result = mailslot_wait_handoff( slot, buffer, size, NULL, &timeout );
+            if ( result == 0 ) { /* now there's a message to read! */
+                goto read; /* try again to read a message */
+            } else if ( result > 0 ) { /* a writer handed us its message, whose room is now free */
+                mailslot_notify_space( slot );
+            } else if ( result == -ERESTARTSYS ) {
+                result = -EINTR;
+            } /* else the handed message couldn't be copied, or the timeout expired */
         }
     }
     return result;
 }
 
 static ssize_t ms_read( struct file* filp, char __user* buffer, size_t size, loff_t* ofst ) {
-    int result, has_lock;
-    int non_blocking = filp->f_flags & O_NONBLOCK;
     int slot_id = iminor( filp->f_path.dentry->d_inode );
-    mailslot_t* slot = mailslot[ slot_id - BASE_MINOR ];
 
     if ( size == 0 ) {
-        printk( KERN_INFO "mailslot (id %d): [read] pid %d tried to read to 0-size buffer\n", slot_id, current->pid );
+        mailslot_debug( "mailslot (id %d): [read] pid %d tried to read to 0-size buffer\n", slot_id, current->pid );
         return 0;
     }
 
     if ( buffer == NULL ) {
-        printk( KERN_INFO "mailslot (id %d): [read] pid %d tried to read to a NULL buffer\n", slot_id, current->pid );
+        mailslot_debug( "mailslot (id %d): [read] pid %d tried to read to a NULL buffer\n", slot_id, current->pid );
         return 0;
     }
+    return ms_read_buf( filp, buffer, size, filp->f_flags & O_NONBLOCK );
+}
+
+static __poll_t ms_poll( struct file* filp, poll_table* wait ) {
+    return mailslot_poll( ms_slot( filp ), ms_sub( filp ), filp, wait );
+}
+
+/* Returns the current segment of a user-backed iterator. */
+static struct iovec ms_iter_segment( const struct iov_iter* iter ) {
+    struct iovec seg;
+    if ( iter_is_ubuf( iter ) ) {
+        seg.iov_base = iter->ubuf + iter->iov_offset;
+        seg.iov_len = iov_iter_count( iter );
+        return seg;
+    }
+    return iov_iter_iovec( iter );
+}
+
+/* writev: each non-empty segment is an independent message, and they are all enqueued at once as a batch, or none is.
+ * A single buffer (e.g. an io_uring write) is written as by write, and a packed write takes a single buffer only.
+ * With IOCB_NOWAIT (e.g. io_uring) a full slot returns -EAGAIN, and the caller retries when poll reports space. */
+static ssize_t ms_write_iter( struct kiocb* iocb, struct iov_iter* from ) {
+    int n = 0, max_n;
+    ssize_t result = 0;
+    size_t bytes = 0;
+    struct file* filp = iocb->ki_filp;
+    struct ms_session* session = filp->private_data;
+    int non_blocking = ( filp->f_flags & O_NONBLOCK ) || ( iocb->ki_flags & IOCB_NOWAIT );
+    long timeout = ms_timeout( filp, 1 );
+    mailslot_t* slot = ms_slot( filp );
+    struct iov_iter* msgs = NULL;
+    struct iovec seg;
+
+    if ( !user_backed_iter( from ) ) {
+        return -EINVAL;
+    }
+    if ( iter_is_ubuf( from ) ) {
+        seg = ms_iter_segment( from );
+        result = seg.iov_len > 0 ? ms_write_buf( filp, seg.iov_base, seg.iov_len, non_blocking ) : 0;
+        if ( result > 0 ) {
+            iov_iter_advance( from, result );
+        }
+        return result;
+    }
+    if ( session->packed & MAILSLOT_PACKED_WRITE ) { /* records can't span segments */
+        return -EINVAL;
+    }
+
+    max_n = min_t( unsigned long, mailslot_capacity( slot ), from->nr_segs );
+    msgs = kvmalloc_array( max_n, sizeof( struct iov_iter ), GFP_KERNEL );
+    if ( msgs == NULL ) {
+        return -ENOMEM;
+    }
+    while ( iov_iter_count( from ) > 0 ) {
+        seg = ms_iter_segment( from );
+        if ( seg.iov_len > 0 ) { /* 0-size segments are skipped, as 0-size writes */
+            if ( n == max_n ) {
+                result = -EMSGSIZE; /* the batch can never fit in the slot */
+                break;
+            }
+            result = import_ubuf( ITER_SOURCE, seg.iov_base, seg.iov_len, &msgs[n] );
+            if ( result ) {
+                break;
+            }
+            bytes += seg.iov_len;
+            n++;
+        }
+        iov_iter_advance( from, seg.iov_len );
+    }
+
+write:
+    if ( result == 0 && n > 0 ) {
+        result = mailslot_enqueue_batch( slot, msgs, n, ms_prio( filp ), ms_shard( filp ), non_blocking );
+    }
+
+    if ( result == -ENOSPC ) { /* slot is full! */
+        if ( non_blocking ) {
+            result = ms_eagain( slot );
+        } else {
+            result = mailslot_wait_space( slot, n, bytes, &timeout );
+            if ( result == 0 ) {
+                goto write;
+            }
+            result = ms_wait_error( result );
+        }
+    }
+    kvfree( msgs );
+
+    if ( result == 0 ) {
+        if ( n > 0 ) {
+            mailslot_notify_msg( slot );
+        }
+        return bytes;
+    }
+    return result;
+}
+
+/* readv: each non-empty segment receives a whole message, until the slot is empty or the next message doesn't fit its
+ * segment. The messages are dequeued as a batch, and their sizes can be retrieved via the MAILSLOT_GET_BATCH ioctl.
+ * A single buffer (e.g. an io_uring read) is read as by read, and a packed read takes a single buffer only. */
+static ssize_t ms_read_iter( struct kiocb* iocb, struct iov_iter* to ) {
+    int i, n = 0;
+    ssize_t result = 0, total = 0;
+    struct file* filp = iocb->ki_filp;
+    struct ms_session* session = filp->private_data;
+    int non_blocking = ( filp->f_flags & O_NONBLOCK ) || ( iocb->ki_flags & IOCB_NOWAIT );
+    long timeout = ms_timeout( filp, 0 );
+    mailslot_t* slot = ms_slot( filp );
+    struct iovec bufs[ MAILSLOT_MAX_BATCH ];
+
+    if ( !user_backed_iter( to ) ) {
+        return -EINVAL;
+    }
+    if ( iter_is_ubuf( to ) ) {
+        bufs[0] = ms_iter_segment( to );
+        result = bufs[0].iov_len > 0 ? ms_read_buf( filp, bufs[0].iov_base, bufs[0].iov_len, non_blocking ) : 0;
+        if ( result > 0 ) {
+            iov_iter_advance( to, result );
+        }
+        return result;
+    }
+    if ( session->packed & MAILSLOT_PACKED_READ ) { /* records can't span segments */
+        return -EINVAL;
+    }
+
+    while ( iov_iter_count( to ) > 0 && n < MAILSLOT_MAX_BATCH ) {
+        bufs[n] = ms_iter_segment( to );
+        iov_iter_advance( to, bufs[n].iov_len );
+        if ( bufs[n].iov_len > 0 ) {
+            n++;
+        }
+    }
+    if ( n == 0 ) {
+        return 0;
+    }
+    result = ms_wait_lowat( filp, slot, non_blocking, &timeout );
+    if ( result ) {
+        return result;
+    }
 
 read:
-    has_lock = mailslot_lock( slot, non_blocking );
-    if ( !has_lock ) {
-        printk( KERN_ERR "mailslot (id %d): [read] pid %d couldn't acquire lock\n", slot_id, current->pid );
-        return non_blocking ? -EAGAIN : -EINTR;
+    result = mailslot_dequeue_batch( slot, ms_sub( filp ), bufs, n, session->batch.size, non_blocking );
+    session->batch.count = max_t( ssize_t, result, 0 );
+
+    if ( result > 0 ) {
+        mailslot_notify_space( slot );
+        for ( i = 0; i < result; i++ ) {
+            total += session->batch.size[i];
+        }
+        return total;
+    }
+    if ( result == 0 ) { /* slot is empty! */
+        if ( non_blocking ) {
+            result = ms_eagain( slot );
+        } else if ( ms_busy_poll( filp ) ) {
+            goto read;
+        } else {
+            result = mailslot_wait_msg( slot, ms_sub( filp ), &timeout );
+            if ( result == 0 ) {
+                goto read;
+            }
+            result = ms_wait_error( result );
+        }
     }
-    printk( KERN_INFO "mailslot (id %d): [read] lock acquired (pid %d)\n", slot_id, current->pid );
+    return result;
+}
 
-    result = mailslot_dequeue( slot, buffer, size, non_blocking );
+/* splice from the slot to a pipe: exactly one message per call, as long as it fits as a whole in the pipe. */
+static ssize_t ms_splice_read( struct file* filp, loff_t* ppos, struct pipe_inode_info* pipe, size_t len, unsigned int flags ) {
+    ssize_t result;
+    int non_blocking = ( filp->f_flags & O_NONBLOCK ) || ( flags & SPLICE_F_NONBLOCK );
+    long timeout = ms_timeout( filp, 0 );
+    mailslot_t* slot = ms_slot( filp );
 
-    mailslot_unlock( slot );
-    printk( KERN_INFO "mailslot (id %d): [read] slot unlocked (pid %d)\n", slot_id, current->pid );
+    if ( len == 0 ) {
+        return 0;
+    }
+    result = ms_wait_lowat( filp, slot, non_blocking, &timeout );
+    if ( result ) {
+        return result;
+    }
 
-    if ( result > 0 ) { /* a message was correctly dequeued! */
+read:
+    result = mailslot_dequeue_splice( slot, pipe, len, non_blocking );
+
+    if ( result > 0 ) {
         mailslot_notify_space( slot );
     } else if ( result == 0 ) { /* slot is empty! */
-        if ( non_blocking ) { /* the read would block but we must not! */
-            result = -EAGAIN;
+        if ( non_blocking ) {
+            result = ms_eagain( slot );
+        } else if ( ms_busy_poll( filp ) ) {
+            goto read;
         } else {
-            result = mailslot_wait_msg( slot );
-            if ( result == 0 ) { /* now there's a message to read! */
-                goto read; /* try again to read a message */
-            } else {
-                result = -EINTR;
+            result = mailslot_wait_msg( slot, ms_sub( filp ), &timeout );
+            if ( result == 0 ) {
+                goto read;
             }
+            result = ms_wait_error( result );
         }
     }
     return result;
 }
 
+/* Actor of ms_splice_write: gathers the content of a pipe buffer in the staging buffer. */
+static int ms_splice_gather( struct pipe_inode_info* pipe, struct pipe_buffer* buf, struct splice_desc* sd ) {
+    char* src = kmap_local_page( buf->page );
+    memcpy( (char*)sd->u.data + sd->num_spliced, src + buf->offset, sd->len );
+    kunmap_local( src );
+    return sd->len;
+}
+
+/* splice from a pipe to the slot: the content of the pipe (up to the max message size and the max content bytes of the
+ * slot) becomes one message.
+ * It is gathered in a staging buffer, since the pipe must be released before the writer may sleep on a full slot. */
+static ssize_t ms_splice_write( struct pipe_inode_info* pipe, struct file* filp, loff_t* ppos, size_t len, unsigned int flags ) {
+    ssize_t result;
+    size_t total;
+    char* staging = NULL;
+    struct kvec vec;
+    struct iov_iter msg;
+    int non_blocking = ( filp->f_flags & O_NONBLOCK ) || ( flags & SPLICE_F_NONBLOCK );
+    long timeout = ms_timeout( filp, 1 );
+    mailslot_t* slot = ms_slot( filp );
+    struct splice_desc sd = {
+        .total_len = min( len, mailslot_max_msg_size( slot ) ),
+        .flags = flags,
+        .pos = *ppos
+    };
+
+    if ( mailslot_max_bytes( slot ) > 0 ) { /* a bigger message could never fit */
+        sd.total_len = min( sd.total_len, mailslot_max_bytes( slot ) );
+    }
+    if ( sd.total_len == 0 ) {
+        return 0;
+    }
+
+    /* wait for room for the whole content before draining the pipe, so that a failure leaves the data in it */
+    while ( !mailslot_has_room( slot, 1, sd.total_len, 0 ) ) {
+        if ( non_blocking ) {
+            return ms_eagain( slot );
+        }
+        result = mailslot_wait_space( slot, 1, sd.total_len, &timeout );
+        if ( result ) {
+            return ms_wait_error( result );
+        }
+    }
+
+    staging = kvmalloc( sd.total_len, GFP_KERNEL );
+    if ( staging == NULL ) {
+        return -ENOMEM;
+    }
+    sd.u.data = staging;
+
+    pipe_lock( pipe );
+    result = __splice_from_pipe( pipe, &sd, ms_splice_gather );
+    pipe_unlock( pipe );
+    if ( result <= 0 ) {
+        goto out;
+    }
+    total = result;
+
+    kvec_set( &vec, staging, total );
+    timeout = MAX_SCHEDULE_TIMEOUT; /* the data left the pipe: from now on, only a signal makes us give up */
+write:
+    iov_iter_kvec( &msg, ITER_SOURCE, &vec, 1, total );
+    result = mailslot_enqueue_batch( slot, &msg, 1, ms_prio( filp ), ms_shard( filp ), 0 );
+    if ( result == -ENOSPC ) { /* another writer took the room in the meantime */
+        result = mailslot_wait_space( slot, 1, total, &timeout );
+        if ( result == 0 ) {
+            goto write;
+        }
+        result = -EINTR;
+    }
+    if ( result == 0 ) {
+        mailslot_notify_msg( slot );
+        result = total;
+    }
+
+out:
+    kvfree( staging );
+    return result;
+}
+
 static long ms_unlocked_ioctl( struct file* filp, unsigned cmd, unsigned long arg ) {
+    int error;
+    __u64 size;
+    ssize_t result;
+    struct mailslot_capacity capacity;
+    struct mailslot_watermarks marks;
+    struct mailslot_peek peek;
+    mailslot_sub_t* sub = NULL;
     int slot_id = iminor( filp->f_path.dentry->d_inode );
     mailslot_t* slot = NULL;
+    struct ms_session* session = filp->private_data;
 
     switch ( cmd ) {
         case MAILSLOT_SET_NONBLOCKING: /* per session setting */
-            printk( KERN_INFO "mailslot (id %d): [ioctl] IO is now ", slot_id );
             if ( arg ) {
                 filp->f_flags |= O_NONBLOCK;
-                printk( KERN_CONT "non-" );
             } else {
                 filp->f_flags &= ~O_NONBLOCK;
             }
-            printk( KERN_CONT "blocking for pid %d\n", current->pid );
+            mailslot_debug( "mailslot (id %d): [ioctl] IO is now %sblocking for pid %d\n", slot_id, arg ? "non-" : "", current->pid );
             break;
 
         case MAILSLOT_SET_MAX_MSG_SIZE: /* per slot setting */
             if ( arg == 0 || arg > LIMIT_MAX_MSG_SIZE ) {
-                printk( KERN_ERR "mailslot (id %d): [ioctl] invalid max message size\n", slot_id );
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid max message size\n", slot_id );
                 return -EINVAL;
             } else {
-                slot = mailslot[ slot_id - BASE_MINOR ];
-                mailslot_lock( slot, filp->f_flags & O_NONBLOCK );
-                mailslot_set_max_msg_size( slot, arg );
-                mailslot_unlock( slot );
-                printk( KERN_INFO "mailslot (id %d): [ioctl] max msg size set to %lu chars\n", slot_id, arg );
+                slot = ms_slot( filp );
+                error = mailslot_set_max_msg_size( slot, arg ); /* it waits for the operations in progress */
+                if ( error ) {
+                    mailslot_debug( "mailslot (id %d): [ioctl] failed to set max msg size (error %d)\n", slot_id, error );
+                    return error;
+                }
+                mailslot_debug( "mailslot (id %d): [ioctl] max msg size set to %lu chars\n", slot_id, arg );
+            }
+            break;
+
+        case MAILSLOT_SET_MODE: /* per slot setting */
+            slot = ms_slot( filp );
+            error = mailslot_set_mode( slot, arg, ring_budget );
+            if ( error ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] failed to set mode %lu (error %d)\n", slot_id, arg, error );
+                return error;
+            }
+            mailslot_debug( "mailslot (id %d): [ioctl] mode set to %lu\n", slot_id, arg );
+            break;
+
+        case MAILSLOT_SET_CAPACITY: /* per slot setting */
+            if ( copy_from_user( &capacity, (const void __user*)arg, sizeof( struct mailslot_capacity ) ) ) {
+                return -EFAULT;
+            }
+            if ( capacity.msgs == 0 || capacity.msgs > LIMIT_SLOT_SIZE ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid capacity\n", slot_id );
+                return -EINVAL;
+            }
+            error = mailslot_set_capacity( ms_slot( filp ), capacity.msgs, capacity.bytes );
+            if ( error ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] failed to set capacity (error %d)\n", slot_id, error );
+                return error;
+            }
+            mailslot_debug( "mailslot (id %d): [ioctl] capacity set to %u msgs, %llu bytes\n", slot_id, capacity.msgs, capacity.bytes );
+            break;
+
+        case MAILSLOT_SET_WATERMARKS: /* per slot setting */
+            if ( copy_from_user( &marks, (const void __user*)arg, sizeof( struct mailslot_watermarks ) ) ) {
+                return -EFAULT;
+            }
+            error = mailslot_set_watermarks( ms_slot( filp ), marks.rd_msgs, marks.rd_bytes, marks.rd_flush_ms, marks.wr_msgs );
+            if ( error ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid watermarks\n", slot_id );
+                return error;
+            }
+            break;
+
+        case MAILSLOT_RESET_STATS: /* per slot setting */
+            mailslot_reset_stats( ms_slot( filp ) );
+            mailslot_debug( "mailslot (id %d): [ioctl] statistics cleared\n", slot_id );
+            break;
+
+        case MAILSLOT_SET_PACKED: /* per session setting */
+            if ( arg & ~( MAILSLOT_PACKED_READ | MAILSLOT_PACKED_WRITE | MAILSLOT_PACKED_META ) ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid packed mode flags %lu\n", slot_id, arg );
+                return -EINVAL;
+            }
+            session->packed = arg;
+            mailslot_debug( "mailslot (id %d): [ioctl] packed mode flags set to %lu for pid %d\n", slot_id, arg, current->pid );
+            break;
+
+        case MAILSLOT_SET_PRIORITY: /* per session setting */
+            if ( arg >= MAILSLOT_LANES ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid priority %lu\n", slot_id, arg );
+                return -EINVAL;
+            }
+            session->prio = arg;
+            mailslot_debug( "mailslot (id %d): [ioctl] priority set to %lu for pid %d\n", slot_id, arg, current->pid );
+            break;
+
+        case MAILSLOT_SET_READ_TIMEOUT: /* per session setting */
+            if ( arg > UINT_MAX ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid read timeout\n", slot_id );
+                return -EINVAL;
+            }
+            session->rd_timeout = arg;
+            mailslot_debug( "mailslot (id %d): [ioctl] read timeout set to %lu ms for pid %d\n", slot_id, arg, current->pid );
+            break;
+
+        case MAILSLOT_SET_BUSY_POLL: /* per session setting */
+            if ( arg > MAILSLOT_BUSY_POLL_MAX ) { /* spinning any longer isn't cheaper than sleeping */
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid busy poll\n", slot_id );
+                return -EINVAL;
+            }
+            session->busy_poll = arg;
+            mailslot_debug( "mailslot (id %d): [ioctl] busy poll set to %lu us for pid %d\n", slot_id, arg, current->pid );
+            break;
+
+        case MAILSLOT_SET_WRITE_TIMEOUT: /* per session setting */
+            if ( arg > UINT_MAX ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid write timeout\n", slot_id );
+                return -EINVAL;
+            }
+            session->wr_timeout = arg;
+            mailslot_debug( "mailslot (id %d): [ioctl] write timeout set to %lu ms for pid %d\n", slot_id, arg, current->pid );
+            break;
+
+        case MAILSLOT_RING_SIZE: /* per slot value */
+            size = mailslot_shared_size( ms_slot( filp ) );
+            if ( size == 0 ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] the slot is not in shared mode\n", slot_id );
+                return -EINVAL;
+            }
+            if ( put_user( size, (__u64 __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_RING_NOTIFY: /* after producing/consuming messages through the shared ring */
+            if ( arg & ~( MAILSLOT_RING_READERS | MAILSLOT_RING_WRITERS ) ) {
+                return -EINVAL;
+            }
+            mailslot_shared_notify( ms_slot( filp ), arg );
+            break;
+
+        case FIONREAD: /* per slot value: size of the next message */
+            if ( put_user( (int)mailslot_next_size( ms_slot( filp ) ), (int __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_GET_DEPTH: /* per slot value */
+            if ( put_user( (__u32)mailslot_depth( ms_slot( filp ) ), (__u32 __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_GET_BYTES: /* per slot value */
+            if ( put_user( (__u64)mailslot_bytes( ms_slot( filp ) ), (__u64 __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_PEEK: /* returns the size of the message copied (0: empty slot) */
+            if ( copy_from_user( &peek, (const void __user*)arg, sizeof( struct mailslot_peek ) ) ) {
+                return -EFAULT;
+            }
+            result = mailslot_peek( ms_slot( filp ), u64_to_user_ptr( peek.buffer ), peek.size, filp->f_flags & O_NONBLOCK );
+            if ( result < 0 ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] pid %d failed to peek (error %zd)\n", slot_id, current->pid, result );
+            }
+            return result;
+
+        case MAILSLOT_SUBSCRIBE: /* per session setting, until the file is closed */
+            sub = mailslot_subscribe( ms_slot( filp ) );
+            if ( IS_ERR( sub ) ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] pid %d failed to subscribe (error %ld)\n", slot_id, current->pid, PTR_ERR( sub ) );
+                return PTR_ERR( sub );
+            }
+            if ( cmpxchg( &( session->sub ), NULL, sub ) != NULL ) {
+                mailslot_unsubscribe( ms_slot( filp ), sub );
+                return -EEXIST;
+            }
+            mailslot_debug( "mailslot (id %d): [ioctl] pid %d subscribed\n", slot_id, current->pid );
+            break;
+
+        case MAILSLOT_SET_BCAST_POLICY: /* per slot setting */
+            error = mailslot_set_bcast_policy( ms_slot( filp ), arg );
+            if ( error ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] invalid broadcast policy %lu\n", slot_id, arg );
+                return error;
+            }
+            mailslot_debug( "mailslot (id %d): [ioctl] broadcast policy set to %lu\n", slot_id, arg );
+            break;
+
+        case MAILSLOT_SET_NUMA_NODE: /* per slot setting */
+            error = mailslot_set_node( ms_slot( filp ), (int)arg ); /* a ring is allocated again on the node */
+            if ( error ) {
+                mailslot_debug( "mailslot (id %d): [ioctl] failed to set NUMA node %d (error %d)\n", slot_id, (int)arg, error );
+                return error;
+            }
+            mailslot_debug( "mailslot (id %d): [ioctl] NUMA node set to %d\n", slot_id, (int)arg );
+            break;
+
+        case MAILSLOT_GET_NUMA_NODE: /* per slot value */
+            if ( put_user( mailslot_node( ms_slot( filp ) ), (int __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_GET_DROPPED: /* per session value */
+            sub = ms_sub( filp );
+            if ( sub == NULL ) {
+                return -EINVAL;
+            }
+            if ( put_user( (__u64)mailslot_sub_dropped( sub ), (__u64 __user*)arg ) ) {
+                return -EFAULT;
+            }
+            break;
+
+        case MAILSLOT_GET_BATCH: /* per session value */
+            if ( copy_to_user( (void __user*)arg, &( session->batch ), sizeof( struct mailslot_batch ) ) ) {
+                return -EFAULT;
             }
             break;
 
         default:
-            printk( KERN_INFO "mailslot (id %d): [ioctl] invalid command code %u\n", slot_id, cmd );
+            mailslot_debug( "mailslot (id %d): [ioctl] invalid command code %u\n", slot_id, cmd );
             return -ENOTTY;
     }
     return 0;
 }
 
-static int ms_open( struct inode* inode, struct file* filp ) { return 0; }
+/* Maps the ring of a slot in shared mode (see mailslot_ring.h); its size is given by the MAILSLOT_RING_SIZE ioctl. */
+static int ms_mmap( struct file* filp, struct vm_area_struct* vma ) {
+    int slot_id = iminor( filp->f_path.dentry->d_inode );
+    int error = mailslot_mmap( ms_slot( filp ), vma );
+    if ( error ) {
+        mailslot_debug( "mailslot (id %d): [mmap] pid %d failed to map the ring (error %d)\n", slot_id, current->pid, error );
+    }
+    return error;
+}
+
+static int ms_open( struct inode* inode, struct file* filp ) {
+    struct ms_instance* inst;
+    struct ms_session* session = kzalloc( sizeof( struct ms_session ), GFP_KERNEL );
+    if ( session == NULL ) {
+        return -ENOMEM;
+    }
 
-static int ms_release( struct inode* inode, struct file* filp ) { return 0; }
+    mutex_lock( &ms_instances_lock );
+    inst = ms_instance_get( iminor( inode ) );
+    if ( !IS_ERR( inst ) ) {
+        inst->users++;
+    }
+    mutex_unlock( &ms_instances_lock );
+
+    if ( IS_ERR( inst ) ) {
+        kfree( session );
+        return PTR_ERR( inst );
+    }
+    session->slot = inst->slot;
+    session->shard = raw_smp_processor_id(); /* just a hint of locality: it keeps the messages of the file in order */
+    filp->private_data = session;
+    filp->f_mode |= FMODE_NOWAIT; /* read_iter/write_iter honor IOCB_NOWAIT: io_uring can poll instead of punting to io-wq */
+    return 0;
+}
+
+static int ms_release( struct inode* inode, struct file* filp ) {
+    struct ms_instance* inst;
+
+    if ( ms_sub( filp ) != NULL ) { /* before the slot can be freed */
+        mailslot_unsubscribe( ms_slot( filp ), ms_sub( filp ) );
+    }
+
+    mutex_lock( &ms_instances_lock );
+    inst = xa_load( &ms_instances, iminor( inode ) );
+    inst->users--;
+    ms_instance_put( inst ); /* the messages left in the slot keep it alive */
+    mutex_unlock( &ms_instances_lock );
+
+    kfree( filp->private_data );
+    return 0;
+}
 
 static struct file_operations ms_fops = {
     .read           = ms_read,
     .write          = ms_write,
+    .read_iter      = ms_read_iter,
+    .write_iter     = ms_write_iter,
+    .splice_read    = ms_splice_read,
+    .splice_write   = ms_splice_write,
+    .poll           = ms_poll,
+    .mmap           = ms_mmap,
     .unlocked_ioctl = ms_unlocked_ioctl,
     .open           = ms_open,
     .release        = ms_release,
     .owner          = THIS_MODULE
 };
 
-void delete_slots( void ) {
-    int i;
-    for ( i = 0; i < INSTANCES; i++ ) {
-        if ( mailslot[i] == NULL ) {
-            return;
+/* Creates (MAILSLOT_CTL_CREATE) or destroys (MAILSLOT_CTL_DESTROY) the slot of the minor number in arg. */
+static long ms_ctl_ioctl( struct file* filp, unsigned cmd, unsigned long arg ) {
+    int error = 0;
+    struct ms_instance* inst;
+
+    if ( arg < base_minor || arg >= base_minor + instances ) {
+        return -EINVAL;
+    }
+
+    mutex_lock( &ms_instances_lock );
+    switch ( cmd ) {
+        case MAILSLOT_CTL_CREATE:
+            inst = ms_instance_get( arg );
+            if ( IS_ERR( inst ) ) {
+                error = PTR_ERR( inst );
+            } else if ( inst->pinned ) {
+                error = -EEXIST;
+            } else {
+                inst->pinned = true;
+            }
+            break;
+
+        case MAILSLOT_CTL_DESTROY: /* the slot is actually freed once idle and empty */
+            inst = xa_load( &ms_instances, arg );
+            if ( inst == NULL || !inst->pinned ) {
+                error = -ENOENT;
+            } else {
+                inst->pinned = false;
+                ms_instance_put( inst );
+            }
+            break;
+
+        default:
+            error = -ENOTTY;
+    }
+    mutex_unlock( &ms_instances_lock );
+
+    mailslot_debug( "mailslot (id %lu): [ctl] pid %d issued command %u (error %d)\n", arg, current->pid, cmd, error );
+    return error;
+}
+
+/* per-file state of the control device: the slot being drained (snapshot) or refilled (restore) */
+struct ms_ctl_session {
+    struct ms_instance* inst; /* a user of the slot while set, so that it isn't freed */
+    unsigned long next;       /* snapshot: minor number from which to look for the next slot */
+    struct iov_iter* batch;   /* restore: messages of the same priority enqueued at once */
+    char* carry;              /* restore: the record split between the last write and the next one */
+    size_t carry_len;
+};
+
+#define MS_SNAP_MAX_REC MAILSLOT_SNAP_MSG_SIZE( LIMIT_MAX_MSG_SIZE )
+
+/* Stops using the current slot of the file, which is freed if idle and empty (e.g. once drained). */
+static void ms_ctl_drop( struct ms_ctl_session* ctl ) {
+    if ( ctl->inst == NULL ) {
+        return;
+    }
+    mailslot_notify_space( ctl->inst->slot ); /* drained, or refilled: wakes up the writers or the readers */
+    mailslot_notify_msg( ctl->inst->slot );
+    mutex_lock( &ms_instances_lock );
+    ctl->inst->users--;
+    ms_instance_put( ctl->inst );
+    mutex_unlock( &ms_instances_lock );
+    ctl->inst = NULL;
+}
+
+/* Moves on to the next slot to snapshot, filling its record: it returns false when there are no more slots. */
+static bool ms_ctl_next( struct ms_ctl_session* ctl, struct mailslot_snap_slot* rec ) {
+    struct ms_instance* inst;
+
+    mutex_lock( &ms_instances_lock );
+    inst = xa_find( &ms_instances, &( ctl->next ), ULONG_MAX, XA_PRESENT );
+    if ( inst != NULL ) {
+        inst->users++;
+        ctl->next = inst->minor + 1;
+        memset( rec, 0, sizeof( struct mailslot_snap_slot ) );
+        rec->type = MAILSLOT_SNAP_SLOT;
+        rec->minor = inst->minor;
+        rec->mode = mailslot_mode( inst->slot );
+        rec->max_msgs = mailslot_max_msgs( inst->slot );
+        rec->max_bytes = mailslot_max_bytes( inst->slot );
+        rec->max_msg_size = mailslot_max_msg_size( inst->slot );
+        rec->pinned = inst->pinned;
+    }
+    mutex_unlock( &ms_instances_lock );
+    ctl->inst = inst;
+    return inst != NULL;
+}
+
+/* The header of a message record of a snapshot, written before the message is taken from its slot. */
+struct ms_snap_hdr {
+    mailslot_hdr_t hdr;
+    char __user* buffer;
+};
+
+static int ms_snap_put( mailslot_hdr_t* hdr, const mailslot_meta_t* meta, size_t size ) {
+    struct mailslot_snap_msg rec;
+
+    rec.type = MAILSLOT_SNAP_MSG;
+    rec.size = size;
+    rec.prio = meta->prio;
+    rec.pid = meta->pid;
+    rec.tstamp = meta->tstamp;
+    return copy_to_user( container_of( hdr, struct ms_snap_hdr, hdr )->buffer, &rec, sizeof( rec ) ) ? -EFAULT : 0;
+}
+
+/* Snapshot: fills the buffer with as many whole records as fit, slot after slot in order of minor number, draining
+ * the slots (a message never gets to a reader and to the snapshot). A message is read only in a buffer which has room
+ * for it (-EMSGSIZE otherwise): a buffer of MS_SNAP_MAX_REC bytes always does. A message whose record can't be copied
+ * stays in its slot, to be dumped by the next read. It returns 0 past the last slot. */
+static ssize_t ms_ctl_read( struct file* filp, char __user* buffer, size_t size, loff_t* ofst ) {
+    ssize_t result = 0;
+    size_t offset = 0, room;
+    struct mailslot_snap_slot slot_rec;
+    struct ms_snap_hdr msg_hdr = { .hdr.put = ms_snap_put };
+    struct ms_ctl_session* ctl = filp->private_data;
+
+    while ( offset < size ) {
+        room = ( size - offset ) & ~( (size_t)MAILSLOT_REC_ALIGN - 1 ); /* whole records only, padding included */
+        if ( ctl->inst == NULL ) {
+            if ( room < sizeof( slot_rec ) ) {
+                result = -EMSGSIZE;
+                break;
+            }
+            if ( !ms_ctl_next( ctl, &slot_rec ) ) { /* end of the snapshot */
+                break;
+            }
+            if ( copy_to_user( buffer + offset, &slot_rec, sizeof( slot_rec ) ) ) {
+                result = -EFAULT; /* the slot is dumped again by the next read */
+                ctl->next = slot_rec.minor;
+                ms_ctl_drop( ctl );
+                break;
+            }
+            offset += sizeof( slot_rec );
+            if ( slot_rec.mode == MAILSLOT_MODE_BROADCAST ) { /* its messages belong to the subscribers */
+                ms_ctl_drop( ctl );
+            }
+            continue;
         }
-        mailslot_free( mailslot[i] );
+
+        msg_hdr.buffer = buffer + offset;
+        result = room > sizeof( struct mailslot_snap_msg ) ?
+                 mailslot_dequeue( ctl->inst->slot, NULL, buffer + offset + sizeof( struct mailslot_snap_msg ),
+                                   room - sizeof( struct mailslot_snap_msg ), 1, &( msg_hdr.hdr ) ) : -EMSGSIZE;
+        if ( result == 0 ) { /* drained */
+            ms_ctl_drop( ctl );
+            continue;
+        }
+        if ( result < 0 ) {
+            break;
+        }
+        offset += MAILSLOT_SNAP_MSG_SIZE( result );
+        result = 0;
     }
+    mailslot_debug( "mailslot: [ctl] pid %d read %zu bytes of snapshot (error %zd)\n", current->pid, offset, offset > 0 ? 0 : result );
+    return offset > 0 ? offset : result;
 }
 
-int init_module( void ) {
-    int i, error;
+/* Makes the slot of a record the current one of the file, creating it if needed, and configures it as recorded. */
+static int ms_ctl_restore_slot( struct ms_ctl_session* ctl, const struct mailslot_snap_slot* rec ) {
+    int error = 0;
+    mailslot_t* slot;
+    struct ms_instance* inst;
+
+    if ( rec->minor < base_minor || rec->minor >= base_minor + instances || rec->max_msg_size == 0 ||
+         rec->max_msg_size > LIMIT_MAX_MSG_SIZE || rec->max_msgs == 0 || rec->max_msgs > LIMIT_SLOT_SIZE ) {
+        return -EINVAL;
+    }
 
-    /* allocating and initializing mailslots */
-    for ( i = 0; i < INSTANCES; ++i ) {
-        mailslot[i] = mailslot_alloc();
-        if ( mailslot[i] == NULL ) {
-            printk( KERN_ERR "mailslot: failed to allocate memory for slot %d\n", i + BASE_MINOR );
-            error = -ENOMEM;
-            goto fail_alloc;
+    ms_ctl_drop( ctl );
+    mutex_lock( &ms_instances_lock );
+    inst = ms_instance_get( rec->minor );
+    if ( !IS_ERR( inst ) ) {
+        inst->users++;
+        inst->pinned = inst->pinned || rec->pinned;
+    }
+    mutex_unlock( &ms_instances_lock );
+    if ( IS_ERR( inst ) ) {
+        return PTR_ERR( inst );
+    }
+    ctl->inst = inst;
+
+    slot = inst->slot; /* in the order which allocates a ring at most once */
+    if ( mailslot_max_msg_size( slot ) != rec->max_msg_size ) {
+        error = mailslot_set_max_msg_size( slot, rec->max_msg_size );
+    }
+    if ( error == 0 && ( mailslot_max_msgs( slot ) != rec->max_msgs || mailslot_max_bytes( slot ) != rec->max_bytes ) ) {
+        error = mailslot_set_capacity( slot, rec->max_msgs, rec->max_bytes );
+    }
+    if ( error == 0 && mailslot_mode( slot ) != rec->mode ) {
+        error = mailslot_set_mode( slot, rec->mode, ring_budget );
+    }
+    mailslot_debug( "mailslot (id %u): [ctl] pid %d restored the slot (error %d)\n", rec->minor, current->pid, error );
+    return error;
+}
+
+/* Returns the size of the record starting with the len bytes at rec, as far as they tell (0: not a record). */
+static size_t ms_ctl_rec_size( const char* rec, size_t len ) {
+    if ( len < sizeof( __u32 ) ) {
+        return sizeof( __u32 );
+    }
+    if ( *(const __u32*)rec == MAILSLOT_SNAP_SLOT ) {
+        return sizeof( struct mailslot_snap_slot );
+    }
+    if ( *(const __u32*)rec != MAILSLOT_SNAP_MSG ) {
+        return 0;
+    }
+    if ( len < sizeof( struct mailslot_snap_msg ) ) {
+        return sizeof( struct mailslot_snap_msg );
+    }
+    return MAILSLOT_SNAP_MSG_SIZE( ( (const struct mailslot_snap_msg*)rec )->size );
+}
+
+/* Returns whether a batch of n messages being restored must be enqueued before growing to bytes content bytes, since
+ * a batch must fit in the slot as a whole. */
+static bool ms_ctl_batch_full( mailslot_t* slot, int n, size_t bytes ) {
+    size_t max_bytes = mailslot_max_bytes( slot );
+    return n >= min( MAILSLOT_MAX_BATCH, mailslot_capacity( slot ) ) || ( max_bytes > 0 && bytes > max_bytes );
+}
+
+/* Restores the whole records at the start of the iterator: the messages go to the slot as batches of up to
+ * MAILSLOT_MAX_BATCH messages of the same priority (fewer if the slot is smaller), as a packed write, rather than one
+ * at a time. It returns the
+ * bytes of the records restored, *error being set if it stopped at a record which couldn't be (rather than at an
+ * incomplete one, or at the end). */
+static size_t ms_ctl_restore( struct ms_ctl_session* ctl, struct iov_iter* from, int* error ) {
+    int n = 0, prio = 0, res;
+    size_t done = 0, pending = 0, bytes = 0, len;
+    __u32 type;
+    struct iov_iter peek;
+    struct mailslot_snap_slot slot_rec;
+    struct mailslot_snap_msg msg_rec;
+
+    *error = 0;
+    while ( iov_iter_count( from ) >= sizeof( type ) ) {
+        peek = *from;
+        if ( copy_from_iter( &type, sizeof( type ), &peek ) != sizeof( type ) ) {
+            *error = -EFAULT;
+            break;
+        }
+        if ( type == MAILSLOT_SNAP_MSG ) {
+            if ( iov_iter_count( from ) < sizeof( msg_rec ) ) {
+                break;
+            }
+            peek = *from;
+            if ( copy_from_iter( &msg_rec, sizeof( msg_rec ), &peek ) != sizeof( msg_rec ) ) {
+                *error = -EFAULT;
+                break;
+            }
+            if ( ctl->inst == NULL || msg_rec.size == 0 || msg_rec.size > mailslot_max_msg_size( ctl->inst->slot ) ||
+                 msg_rec.prio >= MAILSLOT_LANES ) {
+                *error = -EINVAL;
+                break;
+            }
+            len = MAILSLOT_SNAP_MSG_SIZE( msg_rec.size );
+        } else if ( type == MAILSLOT_SNAP_SLOT ) {
+            len = sizeof( slot_rec );
+        } else {
+            *error = -EINVAL;
+            break;
         }
-        /* the id of the slot is the minor number, not the index in the array of the instances! */
-        mailslot_init( mailslot[i], i + BASE_MINOR );
+        if ( iov_iter_count( from ) < len ) { /* incomplete */
+            break;
+        }
+
+        if ( n > 0 && ( type != MAILSLOT_SNAP_MSG || msg_rec.prio != prio ||
+                        ms_ctl_batch_full( ctl->inst->slot, n, bytes + msg_rec.size ) ) ) {
+            *error = mailslot_enqueue_batch( ctl->inst->slot, ctl->batch, n, prio, raw_smp_processor_id(), 1 );
+            if ( *error ) {
+                return done;
+            }
+            done += pending;
+            pending = 0;
+            bytes = 0;
+            n = 0;
+        }
+
+        if ( type == MAILSLOT_SNAP_MSG ) { /* the content is copied straight from the iterator by the batch */
+            ctl->batch[n] = *from;
+            iov_iter_advance( &( ctl->batch[n] ), sizeof( msg_rec ) );
+            iov_iter_truncate( &( ctl->batch[n] ), msg_rec.size );
+            prio = msg_rec.prio;
+            pending += len;
+            bytes += msg_rec.size;
+            n++;
+            iov_iter_advance( from, len );
+            continue;
+        }
+        if ( copy_from_iter( &slot_rec, len, from ) != len ) {
+            *error = -EFAULT;
+            break;
+        }
+        *error = ms_ctl_restore_slot( ctl, &slot_rec );
+        if ( *error ) {
+            break;
+        }
+        done += len;
     }
 
-    /* allocating char device minor numbers in range [BASE_MINOR, BASE_MINOR + INSTANCES - 1] */
-    error = alloc_chrdev_region( &dev, BASE_MINOR, INSTANCES, DEV_NAME );
+    if ( n > 0 ) { /* the messages before the record which stopped the loop, if any */
+        res = mailslot_enqueue_batch( ctl->inst->slot, ctl->batch, n, prio, raw_smp_processor_id(), 1 );
+        if ( res == 0 ) {
+            done += pending;
+        } else if ( *error == 0 ) {
+            *error = res;
+        }
+    }
+    return done;
+}
+
+/* Restore: writes take any piece of a snapshot, a record split between two writes being kept until complete (so that
+ * e.g. cat can load a snapshot). The messages fill the slots without waiting (-ENOSPC if a slot cannot hold them).
+ * A write stops at a record which cannot be restored, returning the bytes before it (or the error). */
+static ssize_t ms_ctl_write( struct file* filp, const char __user* buffer, size_t size, loff_t* ofst ) {
+    int error;
+    size_t offset = 0, need, done;
+    struct iov_iter from;
+    struct kvec carried;
+    struct ms_ctl_session* ctl = filp->private_data;
+
+    if ( ctl->batch == NULL ) {
+        ctl->batch = kvmalloc_array( MAILSLOT_MAX_BATCH, sizeof( struct iov_iter ), GFP_KERNEL );
+        ctl->carry = kvmalloc( MS_SNAP_MAX_REC, GFP_KERNEL );
+        if ( ctl->batch == NULL || ctl->carry == NULL ) {
+            kvfree( ctl->batch );
+            kvfree( ctl->carry );
+            ctl->batch = NULL;
+            ctl->carry = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    while ( ctl->carry_len > 0 ) { /* completing the split record, its header first */
+        need = ms_ctl_rec_size( ctl->carry, ctl->carry_len );
+        if ( need == 0 || need > MS_SNAP_MAX_REC ) {
+            ctl->carry_len = 0;
+            return -EINVAL;
+        }
+        if ( ctl->carry_len < need ) {
+            if ( offset == size ) {
+                return size;
+            }
+            need = min( need - ctl->carry_len, size - offset );
+            if ( copy_from_user( ctl->carry + ctl->carry_len, buffer + offset, need ) ) {
+                return -EFAULT;
+            }
+            ctl->carry_len += need;
+            offset += need;
+            continue;
+        }
+        carried.iov_base = ctl->carry;
+        carried.iov_len = ctl->carry_len;
+        iov_iter_kvec( &from, ITER_SOURCE, &carried, 1, ctl->carry_len );
+        ms_ctl_restore( ctl, &from, &error );
+        if ( error ) { /* the record is kept: a retry fails again */
+            return offset > 0 ? offset : error;
+        }
+        ctl->carry_len = 0;
+    }
+
+    error = import_ubuf( ITER_SOURCE, (void __user*)( buffer + offset ), size - offset, &from );
+    if ( error ) {
+        return error;
+    }
+    done = ms_ctl_restore( ctl, &from, &error );
+    offset += done;
+    if ( error ) {
+        return offset > 0 ? offset : error;
+    }
+    if ( copy_from_user( ctl->carry, buffer + offset, size - offset ) ) { /* an incomplete record, if any */
+        return offset > 0 ? offset : -EFAULT;
+    }
+    ctl->carry_len = size - offset;
+    return size;
+}
+
+static int ms_ctl_open( struct inode* inode, struct file* filp ) {
+    struct ms_ctl_session* ctl = kzalloc( sizeof( struct ms_ctl_session ), GFP_KERNEL );
+    if ( ctl == NULL ) {
+        return -ENOMEM;
+    }
+    ctl->next = base_minor;
+    filp->private_data = ctl;
+    return 0;
+}
+
+static int ms_ctl_release( struct inode* inode, struct file* filp ) {
+    struct ms_ctl_session* ctl = filp->private_data;
+
+    if ( ctl->carry_len > 0 ) {
+        mailslot_debug( "mailslot: [ctl] pid %d left an incomplete record of %zu bytes\n", current->pid, ctl->carry_len );
+    }
+    ms_ctl_drop( ctl );
+    kvfree( ctl->batch );
+    kvfree( ctl->carry );
+    kfree( ctl );
+    return 0;
+}
+
+static const struct file_operations ms_ctl_fops = {
+    .read           = ms_ctl_read,
+    .write          = ms_ctl_write,
+    .unlocked_ioctl = ms_ctl_ioctl,
+    .open           = ms_ctl_open,
+    .release        = ms_ctl_release,
+    .owner          = THIS_MODULE
+};
+
+static struct miscdevice ms_ctl = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = CTL_NAME,
+    .fops  = &ms_ctl_fops,
+    .mode  = 0600
+};
+
+void delete_slots( void ) {
+    unsigned long minor;
+    struct ms_instance* inst;
+    xa_for_each( &ms_instances, minor, inst ) {
+        mailslot_free( inst->slot );
+        kfree( inst );
+    }
+    xa_destroy( &ms_instances );
+}
+
+int init_module( void ) {
+    int error;
+
+    if ( base_minor < 0 || instances <= 0 || base_minor + instances > MINORMASK + 1 ) {
+        printk( KERN_ERR "mailslot: invalid range of minor numbers\n" );
+        return -EINVAL;
+    }
+
+    mailslot_stats_debugfs_init();
+
+    /* allocating char device minor numbers in range [base_minor, base_minor + instances - 1]: slots are allocated on open */
+    error = alloc_chrdev_region( &dev, base_minor, instances, DEV_NAME );
     if ( error ) {
         printk( KERN_ERR "mailslot: failed to register char device numbers\n" );
         goto fail_alloc;
@@ -223,24 +1515,32 @@ int init_module( void ) {
         goto fail_cdev_alloc;
     }
     cdev_init( ms_cdev, &ms_fops );
-    error = cdev_add( ms_cdev, dev, INSTANCES );
+    error = cdev_add( ms_cdev, dev, instances );
     if ( error ) {
         printk( KERN_ERR "mailslot: failed to add cdev to the system\n" );
         goto fail_cdev_add;
     }
 
+    error = misc_register( &ms_ctl );
+    if ( error ) {
+        printk( KERN_ERR "mailslot: failed to register the control device\n" );
+        goto fail_cdev_add;
+    }
+
     printk( KERN_INFO "mailslot: device registered successfully (major number: %d)\n", major );
     return 0;
 
 fail_cdev_add: cdev_del( ms_cdev );
-fail_cdev_alloc: unregister_chrdev_region( dev, INSTANCES );
-fail_alloc: delete_slots();
+fail_cdev_alloc: unregister_chrdev_region( dev, instances );
+fail_alloc: mailslot_stats_debugfs_exit();
     return error;
 }
 
 void cleanup_module( void ) {
+    misc_deregister( &ms_ctl );
     cdev_del( ms_cdev );
-    unregister_chrdev_region( dev, INSTANCES );
+    unregister_chrdev_region( dev, instances );
     delete_slots();
+    mailslot_stats_debugfs_exit();
     printk( KERN_INFO "mailslot: device unregistered successfully (major number: %d)\n", major );
 }
\ No newline at end of file
@@ -20,10 +20,123 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MAILSLOT_DRIVER_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+
+#include "mailslot_ring.h"
 
 #define MAILSLOT_IOCTL_MAGIC 'x' /* unused 8-bit number in ioctl-number.txt */
 
 #define MAILSLOT_SET_NONBLOCKING  _IOW( MAILSLOT_IOCTL_MAGIC, 0, unsigned int )
 #define MAILSLOT_SET_MAX_MSG_SIZE _IOW( MAILSLOT_IOCTL_MAGIC, 1, unsigned int )
+#define MAILSLOT_SET_MODE         _IOW( MAILSLOT_IOCTL_MAGIC, 2, unsigned int )
+#define MAILSLOT_RESET_STATS      _IO( MAILSLOT_IOCTL_MAGIC, 3 )
+#define MAILSLOT_GET_BATCH        _IOR( MAILSLOT_IOCTL_MAGIC, 4, struct mailslot_batch )
+#define MAILSLOT_SET_PACKED       _IOW( MAILSLOT_IOCTL_MAGIC, 5, unsigned int )
+#define MAILSLOT_RING_SIZE        _IOR( MAILSLOT_IOCTL_MAGIC, 6, __u64 )
+#define MAILSLOT_RING_NOTIFY      _IOW( MAILSLOT_IOCTL_MAGIC, 7, unsigned int )
+#define MAILSLOT_SET_CAPACITY     _IOW( MAILSLOT_IOCTL_MAGIC, 8, struct mailslot_capacity )
+#define MAILSLOT_SET_PRIORITY     _IOW( MAILSLOT_IOCTL_MAGIC, 11, unsigned int )
+#define MAILSLOT_GET_DEPTH        _IOR( MAILSLOT_IOCTL_MAGIC, 12, __u32 )
+#define MAILSLOT_GET_BYTES        _IOR( MAILSLOT_IOCTL_MAGIC, 13, __u64 )
+#define MAILSLOT_PEEK             _IOW( MAILSLOT_IOCTL_MAGIC, 14, struct mailslot_peek )
+#define MAILSLOT_SET_READ_TIMEOUT  _IOW( MAILSLOT_IOCTL_MAGIC, 15, unsigned int ) /* milliseconds, 0: no limit */
+#define MAILSLOT_SET_WRITE_TIMEOUT _IOW( MAILSLOT_IOCTL_MAGIC, 16, unsigned int ) /* milliseconds, 0: no limit */
+#define MAILSLOT_SUBSCRIBE        _IO( MAILSLOT_IOCTL_MAGIC, 17 ) /* broadcast mode: the file reads every message from now on */
+#define MAILSLOT_SET_BCAST_POLICY _IOW( MAILSLOT_IOCTL_MAGIC, 18, unsigned int ) /* MAILSLOT_BCAST_BLOCK or MAILSLOT_BCAST_DROP */
+#define MAILSLOT_GET_DROPPED      _IOR( MAILSLOT_IOCTL_MAGIC, 19, __u64 ) /* messages lost by the subscriber of the file */
+#define MAILSLOT_SET_WATERMARKS   _IOW( MAILSLOT_IOCTL_MAGIC, 20, struct mailslot_watermarks )
+#define MAILSLOT_SET_BUSY_POLL    _IOW( MAILSLOT_IOCTL_MAGIC, 21, unsigned int ) /* microseconds, 0: never spins */
+#define MAILSLOT_SET_NUMA_NODE    _IOW( MAILSLOT_IOCTL_MAGIC, 22, int ) /* a node id, MAILSLOT_NODE_LOCAL or MAILSLOT_NODE_READER */
+#define MAILSLOT_GET_NUMA_NODE    _IOR( MAILSLOT_IOCTL_MAGIC, 23, int ) /* the node of the messages (once known) */
+
+/* commands of the control device (/dev/mailslot_ctl): the argument is the minor number of a slot */
+#define MAILSLOT_CTL_CREATE       _IOW( MAILSLOT_IOCTL_MAGIC, 9, unsigned int )  /* keeps the slot even if idle and empty */
+#define MAILSLOT_CTL_DESTROY      _IOW( MAILSLOT_IOCTL_MAGIC, 10, unsigned int ) /* frees the slot once idle and empty */
+
+#define MAILSLOT_MAX_BATCH 64 /* max number of messages returned by a single readv */
+#define MAILSLOT_BUSY_POLL_MAX 10000 /* max spin of MAILSLOT_SET_BUSY_POLL, in microseconds */
+
+/* sizes of the messages returned by the last readv on a file */
+struct mailslot_batch {
+    __u32 count;
+    __u32 size[ MAILSLOT_MAX_BATCH ];
+};
+
+/* argument of MAILSLOT_SET_CAPACITY (per slot setting) */
+struct mailslot_capacity {
+    __u32 msgs;  /* max number of messages in the slot (1 to LIMIT_SLOT_SIZE) */
+    __u32 pad;
+    __u64 bytes; /* max bytes of message content in the slot (0: no limit, besides msgs * max msg size) */
+};
+
+/* argument of MAILSLOT_SET_WATERMARKS (per slot setting, 0: not set), as SO_RCVLOWAT and SO_SNDLOWAT.
+ * Before dequeuing, blocking reads wait until rd_msgs messages or rd_bytes bytes are queued, or rd_flush_ms milliseconds
+ * if any is (or a writer blocks), then take whatever is queued; poll reports EPOLLIN accordingly. Non-blocking reads
+ * return any message. They don't apply to subscribers.
+ * Writers waiting for room are woken up only once fewer than wr_msgs messages are queued. */
+struct mailslot_watermarks {
+    __u32 rd_msgs;     /* up to LIMIT_SLOT_SIZE (the capacity of the slot, if smaller, is enough) */
+    __u32 rd_flush_ms;
+    __u64 rd_bytes;
+    __u32 wr_msgs;     /* up to LIMIT_SLOT_SIZE */
+    __u32 pad;
+};
+
+/* argument of MAILSLOT_PEEK: the next message is copied in buffer, without being dequeued (see also FIONREAD) */
+struct mailslot_peek {
+    __u64 buffer; /* address of the buffer in user space */
+    __u64 size;   /* size of the buffer */
+};
+
+/* flags of MAILSLOT_SET_PACKED (per session setting) */
+#define MAILSLOT_PACKED_READ  1 /* a read returns as many whole messages as fit in the buffer, each preceded by a header */
+#define MAILSLOT_PACKED_WRITE 2 /* a write enqueues all the framed messages in the buffer, or none */
+#define MAILSLOT_PACKED_META  4 /* headers carry also the pid of the writer and the enqueue time */
+
+/* header of a message in packed mode: without MAILSLOT_PACKED_META it's just the size field */
+struct mailslot_rec {
+    __u32 size;   /* size of the message following the header */
+    __s32 pid;    /* thread group id of the writer (ignored on write) */
+    __u64 tstamp; /* enqueue time in CLOCK_MONOTONIC nanoseconds (ignored on write) */
+};
+
+#define MAILSLOT_REC_ALIGN 8 /* each header starts at a multiple of MAILSLOT_REC_ALIGN bytes from the buffer start */
+
+#define MAILSLOT_REC_HDR_SIZE( flags ) \
+    ( ( ( flags ) & MAILSLOT_PACKED_META ) ? sizeof( struct mailslot_rec ) : sizeof( __u32 ) )
+
+/* space taken in the buffer by a message of the given size, including its header and padding */
+#define MAILSLOT_REC_SIZE( flags, size ) \
+    ( ( MAILSLOT_REC_HDR_SIZE( flags ) + ( size ) + MAILSLOT_REC_ALIGN - 1 ) & ~( (size_t)MAILSLOT_REC_ALIGN - 1 ) )
+
+/* Snapshot of the slots, read from the control device (which drains them) and written back to it to restore them,
+ * e.g. across a reload of the module: each slot is a struct mailslot_snap_slot followed by its messages, each a
+ * struct mailslot_snap_msg and its content. Records start at multiples of MAILSLOT_REC_ALIGN bytes from the start
+ * of the stream. The messages of a slot in broadcast mode are not part of it (they belong to its subscribers). */
+#define MAILSLOT_SNAP_SLOT 0x544f4c53 /* "SLOT" */
+#define MAILSLOT_SNAP_MSG  0x2047534d /* "MSG " */
+
+struct mailslot_snap_slot {
+    __u32 type;         /* MAILSLOT_SNAP_SLOT */
+    __u32 minor;
+    __u32 mode;         /* MAILSLOT_MODE_* */
+    __u32 max_msgs;     /* capacity, as set by MAILSLOT_SET_CAPACITY */
+    __u64 max_bytes;
+    __u64 max_msg_size;
+    __u32 pinned;       /* created by MAILSLOT_CTL_CREATE */
+    __u32 pad;
+};
+
+struct mailslot_snap_msg {
+    __u32 type;   /* MAILSLOT_SNAP_MSG */
+    __u32 size;   /* size of the message following the header */
+    __u32 prio;   /* priority of the message (list mode) */
+    __s32 pid;    /* thread group id of the writer (not restored) */
+    __u64 tstamp; /* enqueue time in CLOCK_MONOTONIC nanoseconds (not restored) */
+};
+
+/* space taken in the stream by a message of the given size, including its header and padding */
+#define MAILSLOT_SNAP_MSG_SIZE( size ) \
+    ( ( sizeof( struct mailslot_snap_msg ) + ( size ) + MAILSLOT_REC_ALIGN - 1 ) & ~( (size_t)MAILSLOT_REC_ALIGN - 1 ) )
 
 #endif
\ No newline at end of file
@@ -0,0 +1,214 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Shared ring of the slots in MAILSLOT_MODE_SHARED, mapped in user space via mmap on the device file.
+ * It is a bounded multi-producer/multi-consumer queue: each cell carries a sequence number telling whether it is
+ * free for the producer reserving position pos (seq == pos) or ready for the consumer at position pos (seq == pos + 1).
+ * Producers and consumers reserve positions by atomically advancing tail and head, hence the same functions below
+ * are used both by the kernel (read/write on the device file) and by user space processes. */
+
+#ifndef MAILSLOT_RING_H
+#define MAILSLOT_RING_H
+
+#include <linux/types.h>
+
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#define MS_RING_LOAD( p )              READ_ONCE( *( p ) )
+#define MS_RING_LOAD_ACQUIRE( p )      smp_load_acquire( p )
+#define MS_RING_STORE_RELEASE( p, v )  smp_store_release( p, v )
+#define MS_RING_CAS( p, old, new )     ( cmpxchg( p, old, new ) == ( old ) )
+#define MS_RING_BARRIER()              smp_mb()
+#else
+#define MS_RING_LOAD( p )              __atomic_load_n( p, __ATOMIC_RELAXED )
+#define MS_RING_LOAD_ACQUIRE( p )      __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define MS_RING_STORE_RELEASE( p, v )  __atomic_store_n( p, v, __ATOMIC_RELEASE )
+#define MS_RING_CAS( p, old, new )     __sync_bool_compare_and_swap( p, old, new )
+#define MS_RING_BARRIER()              __sync_synchronize()
+#endif
+
+/* argument of the MAILSLOT_RING_NOTIFY ioctl: which sleepers to wake up */
+#define MAILSLOT_RING_READERS 1 /* the ones waiting for messages */
+#define MAILSLOT_RING_WRITERS 2 /* the ones waiting for free cells */
+
+#define MAILSLOT_RING_MAX_TRIES 1024 /* bound to the retries of a contended reservation */
+
+/* header at offset 0 of the mapping: head and tail are on different cache lines */
+struct mailslot_ring {
+    __u64 head;          /* position of the next message to consume */
+    __u8 pad0[ 56 ];
+    __u64 tail;          /* position of the next cell to reserve */
+    __u8 pad1[ 56 ];
+    __u32 readers_waiting; /* set by the kernel before a reader sleeps, cleared by MAILSLOT_RING_NOTIFY */
+    __u32 writers_waiting; /* set by the kernel before a writer sleeps, cleared by MAILSLOT_RING_NOTIFY */
+    __u32 cells;         /* number of cells (a power of 2) */
+    __u32 cell_size;     /* distance in bytes between two consecutive cells */
+    __u32 max_msg_size;  /* max size of the content of a cell */
+    __u32 data_offset;   /* offset of the first cell from the start of the mapping */
+    __u8 pad2[ 40 ];
+};
+
+/* a cell: a message of size 0 is a hole left by a failed write, and it is skipped by consumers */
+struct mailslot_cell {
+    __u64 seq;
+    __u64 tstamp; /* enqueue time in CLOCK_MONOTONIC nanoseconds (0 if written by user space) */
+    __u32 size;
+    __s32 pid;    /* thread group id of the writer (0 if written by user space) */
+    char content[];
+};
+
+/* geometry of a ring: the kernel keeps its own copy, since the header is writable by user space */
+struct mailslot_ring_view {
+    struct mailslot_ring* ring;
+    char* cells;
+    __u32 mask;
+    __u32 cell_size;
+    __u32 max_msg_size;
+};
+
+/* Fills the view of a mapped ring (user space only: the kernel never trusts the header). */
+static inline void mailslot_ring_view_init( struct mailslot_ring_view* view, void* mapping ) {
+    view->ring = (struct mailslot_ring*)mapping;
+    view->cells = (char*)mapping + view->ring->data_offset;
+    view->mask = view->ring->cells - 1;
+    view->cell_size = view->ring->cell_size;
+    view->max_msg_size = view->ring->max_msg_size;
+}
+
+static inline struct mailslot_cell* mailslot_ring_cell( const struct mailslot_ring_view* view, __u64 pos ) {
+    return (struct mailslot_cell*)( view->cells + ( pos & view->mask ) * view->cell_size );
+}
+
+/* Reserves the cell for a new message, returning NULL if the ring is full.
+ * The message must be written in the cell and then published via mailslot_ring_publish. */
+static inline struct mailslot_cell* mailslot_ring_reserve( const struct mailslot_ring_view* view, __u64* ppos ) {
+    int tries;
+    __u64 seq, pos = MS_RING_LOAD( &( view->ring->tail ) );
+    struct mailslot_cell* cell;
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        cell = mailslot_ring_cell( view, pos );
+        seq = MS_RING_LOAD_ACQUIRE( &( cell->seq ) );
+        if ( seq == pos ) {
+            if ( MS_RING_CAS( &( view->ring->tail ), pos, pos + 1 ) ) {
+                *ppos = pos;
+                return cell;
+            }
+        } else if ( (__s64)( seq - pos ) < 0 ) {
+            return NULL; /* the cell still holds the message of the previous lap */
+        }
+        pos = MS_RING_LOAD( &( view->ring->tail ) );
+    }
+    return NULL;
+}
+
+/* Reserves n consecutive cells (e.g. for a batch of messages to be published all together), returning 0 if the ring
+ * lacks n free cells. Once tail is advanced, nobody else can reserve them, so checking them all first is enough. */
+static inline int mailslot_ring_reserve_n( const struct mailslot_ring_view* view, __u32 n, __u64* ppos ) {
+    int tries;
+    __u32 i;
+    __u64 seq = 0, pos;
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        pos = MS_RING_LOAD( &( view->ring->tail ) );
+        for ( i = 0; i < n; i++ ) {
+            seq = MS_RING_LOAD_ACQUIRE( &( mailslot_ring_cell( view, pos + i )->seq ) );
+            if ( seq != pos + i ) {
+                break;
+            }
+        }
+        if ( i == n ) {
+            if ( MS_RING_CAS( &( view->ring->tail ), pos, pos + n ) ) {
+                *ppos = pos;
+                return 1;
+            }
+        } else if ( (__s64)( seq - ( pos + i ) ) < 0 ) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static inline void mailslot_ring_publish( struct mailslot_cell* cell, __u64 pos ) {
+    MS_RING_STORE_RELEASE( &( cell->seq ), pos + 1 );
+}
+
+/* Returns the oldest published message without consuming it, or NULL if there is none. */
+static inline struct mailslot_cell* mailslot_ring_peek( const struct mailslot_ring_view* view, __u64* ppos ) {
+    int tries;
+    __u64 seq, pos = MS_RING_LOAD( &( view->ring->head ) );
+    struct mailslot_cell* cell;
+
+    for ( tries = 0; tries < MAILSLOT_RING_MAX_TRIES; tries++ ) {
+        cell = mailslot_ring_cell( view, pos );
+        seq = MS_RING_LOAD_ACQUIRE( &( cell->seq ) );
+        if ( seq == pos + 1 ) {
+            *ppos = pos;
+            return cell;
+        } else if ( (__s64)( seq - ( pos + 1 ) ) < 0 ) {
+            return NULL; /* not yet published */
+        }
+        pos = MS_RING_LOAD( &( view->ring->head ) );
+    }
+    return NULL;
+}
+
+/* Consumes the message at pos returned by mailslot_ring_peek: it fails (returning 0) if another consumer took it.
+ * Since producers cannot reuse a cell before it is released, a copy made between peek and take is valid if take succeeds. */
+static inline int mailslot_ring_take( const struct mailslot_ring_view* view, __u64 pos ) {
+    return MS_RING_CAS( &( view->ring->head ), pos, pos + 1 );
+}
+
+/* Gives back to producers the cell of a consumed message. */
+static inline void mailslot_ring_release( const struct mailslot_ring_view* view, struct mailslot_cell* cell, __u64 pos ) {
+    MS_RING_STORE_RELEASE( &( cell->seq ), pos + view->mask + 1 );
+}
+
+/* Returns whether a producer would find a free cell. */
+static inline int mailslot_ring_writable( const struct mailslot_ring_view* view ) {
+    __u64 pos = MS_RING_LOAD( &( view->ring->tail ) );
+    return (__s64)( MS_RING_LOAD_ACQUIRE( &( mailslot_ring_cell( view, pos )->seq ) ) - pos ) >= 0;
+}
+
+/* Returns whether a consumer would find a published message. */
+static inline int mailslot_ring_readable( const struct mailslot_ring_view* view ) {
+    __u64 pos = MS_RING_LOAD( &( view->ring->head ) );
+    return (__s64)( MS_RING_LOAD_ACQUIRE( &( mailslot_ring_cell( view, pos )->seq ) ) - ( pos + 1 ) ) >= 0;
+}
+
+/* Returns the number of reserved and not yet released cells (approximate under concurrency). */
+static inline __u32 mailslot_ring_count( const struct mailslot_ring_view* view ) {
+    __u64 used = MS_RING_LOAD( &( view->ring->tail ) ) - MS_RING_LOAD( &( view->ring->head ) );
+    return used > (__u64)view->mask + 1 ? view->mask + 1 : (__u32)used;
+}
+
+/* Returns the argument of the MAILSLOT_RING_NOTIFY ioctl a user space process must issue after publishing
+ * (MAILSLOT_RING_READERS) or releasing (MAILSLOT_RING_WRITERS) cells, or 0 if nobody sleeps in the kernel. */
+static inline __u32 mailslot_ring_need_notify( const struct mailslot_ring_view* view, __u32 which ) {
+    __u32 res = 0;
+    MS_RING_BARRIER(); /* pairs with the barrier of the kernel between raising a flag and checking the ring */
+    if ( ( which & MAILSLOT_RING_READERS ) && MS_RING_LOAD( &( view->ring->readers_waiting ) ) ) {
+        res |= MAILSLOT_RING_READERS;
+    }
+    if ( ( which & MAILSLOT_RING_WRITERS ) && MS_RING_LOAD( &( view->ring->writers_waiting ) ) ) {
+        res |= MAILSLOT_RING_WRITERS;
+    }
+    return res;
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "mailslot_stats.h"
+
+#include <linux/slab.h>     /* for kzalloc */
+#include <linux/fs.h>
+#include <linux/debugfs.h>  /* for debugfs_create_* functions */
+#include <linux/seq_file.h> /* for seq_printf */
+
+DEFINE_STATIC_KEY_FALSE( mailslot_stats_enabled );
+
+static struct dentry* debugfs_root = NULL;
+
+static struct mailslot_stats* mailslot_stats_sum( struct mailslot_stats __percpu* stats ) {
+    int cpu, i;
+    struct mailslot_stats* pcpu = NULL;
+    struct mailslot_stats* sum = kzalloc( sizeof( struct mailslot_stats ), GFP_KERNEL );
+    if ( sum == NULL ) {
+        return NULL;
+    }
+    for_each_possible_cpu( cpu ) {
+        pcpu = per_cpu_ptr( stats, cpu );
+        sum->enqueued += pcpu->enqueued;
+        sum->dequeued += pcpu->dequeued;
+        sum->bytes_in += pcpu->bytes_in;
+        sum->bytes_out += pcpu->bytes_out;
+        sum->eagain += pcpu->eagain;
+        sum->enospc += pcpu->enospc;
+        sum->emsgsize += pcpu->emsgsize;
+        sum->blocked_readers += pcpu->blocked_readers;
+        sum->blocked_writers += pcpu->blocked_writers;
+        sum->handoffs += pcpu->handoffs;
+        sum->busy_polls += pcpu->busy_polls;
+        sum->max_occupancy = max( sum->max_occupancy, pcpu->max_occupancy );
+        for ( i = 0; i < MAILSLOT_HIST_BUCKETS; i++ ) {
+            sum->residence[i] += pcpu->residence[i];
+            sum->lock_wait[i] += pcpu->lock_wait[i];
+        }
+    }
+    return sum;
+}
+
+static int ms_stats_show( struct seq_file* m, void* v ) {
+    struct mailslot_stats* sum = mailslot_stats_sum( m->private );
+    if ( sum == NULL ) {
+        return -ENOMEM;
+    }
+    seq_printf( m, "enqueued %llu\n", sum->enqueued );
+    seq_printf( m, "dequeued %llu\n", sum->dequeued );
+    seq_printf( m, "bytes_in %llu\n", sum->bytes_in );
+    seq_printf( m, "bytes_out %llu\n", sum->bytes_out );
+    seq_printf( m, "eagain %llu\n", sum->eagain );
+    seq_printf( m, "enospc %llu\n", sum->enospc );
+    seq_printf( m, "emsgsize %llu\n", sum->emsgsize );
+    seq_printf( m, "blocked_readers %llu\n", sum->blocked_readers );
+    seq_printf( m, "blocked_writers %llu\n", sum->blocked_writers );
+    seq_printf( m, "handoffs %llu\n", sum->handoffs );
+    seq_printf( m, "busy_polls %llu\n", sum->busy_polls );
+    seq_printf( m, "max_occupancy %llu\n", sum->max_occupancy );
+    kfree( sum );
+    return 0;
+}
+
+/* Prints a histogram as "<lower bound in ns> <count>" lines. */
+static void ms_hist_show( struct seq_file* m, const u64* hist ) {
+    int i;
+    for ( i = 0; i < MAILSLOT_HIST_BUCKETS; i++ ) {
+        seq_printf( m, "%llu %llu\n", i == 0 ? 0ULL : 1ULL << i, hist[i] );
+    }
+}
+
+static int ms_residence_show( struct seq_file* m, void* v ) {
+    struct mailslot_stats* sum = mailslot_stats_sum( m->private );
+    if ( sum == NULL ) {
+        return -ENOMEM;
+    }
+    ms_hist_show( m, sum->residence );
+    kfree( sum );
+    return 0;
+}
+
+static int ms_lock_wait_show( struct seq_file* m, void* v ) {
+    struct mailslot_stats* sum = mailslot_stats_sum( m->private );
+    if ( sum == NULL ) {
+        return -ENOMEM;
+    }
+    ms_hist_show( m, sum->lock_wait );
+    kfree( sum );
+    return 0;
+}
+
+static int ms_stats_open( struct inode* inode, struct file* filp ) {
+    return single_open( filp, ms_stats_show, inode->i_private );
+}
+
+/* Writing anything to the stats file clears the statistics of the slot. */
+static ssize_t ms_stats_write( struct file* filp, const char __user* buffer, size_t size, loff_t* ofst ) {
+    struct seq_file* m = filp->private_data;
+    mailslot_stats_reset( m->private );
+    return size;
+}
+
+static const struct file_operations ms_stats_fops = {
+    .open    = ms_stats_open,
+    .read    = seq_read,
+    .write   = ms_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+    .owner   = THIS_MODULE
+};
+
+DEFINE_SHOW_ATTRIBUTE( ms_residence );
+DEFINE_SHOW_ATTRIBUTE( ms_lock_wait );
+
+void mailslot_stats_debugfs_init( void ) {
+    debugfs_root = debugfs_create_dir( "mailslot", NULL );
+}
+
+void mailslot_stats_debugfs_exit( void ) {
+    debugfs_remove_recursive( debugfs_root );
+}
+
+struct dentry* mailslot_stats_register( int id, struct mailslot_stats __percpu* stats ) {
+    char name[ 16 ];
+    struct dentry* dir = NULL;
+
+    snprintf( name, sizeof( name ), "%d", id );
+    dir = debugfs_create_dir( name, debugfs_root );
+    debugfs_create_file( "stats", 0644, dir, stats, &ms_stats_fops );
+    debugfs_create_file( "residence_hist", 0444, dir, stats, &ms_residence_fops );
+    debugfs_create_file( "lock_wait_hist", 0444, dir, stats, &ms_lock_wait_fops );
+    return dir;
+}
+
+void mailslot_stats_unregister( struct dentry* dir ) {
+    debugfs_remove_recursive( dir );
+}
+
+void mailslot_stats_reset( struct mailslot_stats __percpu* stats ) {
+    int cpu;
+    for_each_possible_cpu( cpu ) {
+        memset( per_cpu_ptr( stats, cpu ), 0, sizeof( struct mailslot_stats ) );
+    }
+}
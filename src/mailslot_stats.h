@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MAILSLOT_STATS_H
+#define MAILSLOT_STATS_H
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#define MAILSLOT_HIST_BUCKETS 32 /* log2 buckets of nanoseconds, the last one collects any time >= 2^31 ns */
+
+/* Per-cpu statistics of a slot: each cpu updates its own copy, readers sum them up. */
+struct mailslot_stats {
+    u64 enqueued, dequeued;
+    u64 bytes_in, bytes_out;
+    u64 eagain, enospc, emsgsize;
+    u64 blocked_readers, blocked_writers;
+    u64 handoffs; /* messages passed straight from a writer to a parked reader */
+    u64 busy_polls; /* readers which found a message spinning, instead of sleeping */
+    u64 max_occupancy;
+    u64 residence[ MAILSLOT_HIST_BUCKETS ]; /* time spent by messages in the slot */
+    u64 lock_wait[ MAILSLOT_HIST_BUCKETS ]; /* time spent waiting for the producers/consumers lock (list mode) */
+};
+
+/* Enabled at runtime via the stats module parameter. */
+DECLARE_STATIC_KEY_FALSE( mailslot_stats_enabled );
+
+#define mailslot_stats_add( stats, field, n ) \
+do { \
+    if ( static_branch_unlikely( &mailslot_stats_enabled ) ) { \
+        this_cpu_add( (stats)->field, n ); \
+    } \
+} while ( 0 )
+
+#define mailslot_stats_inc( stats, field ) mailslot_stats_add( stats, field, 1 )
+
+/* Returns a timestamp for the histograms, or 0 if statistics are disabled. */
+static inline u64 mailslot_stats_clock( void ) {
+    return static_branch_unlikely( &mailslot_stats_enabled ) ? ktime_get_ns() : 0;
+}
+
+static inline int mailslot_stats_bucket( u64 ns ) {
+    return min_t( int, ilog2( ns | 1 ), MAILSLOT_HIST_BUCKETS - 1 );
+}
+
+/* Accounts the time elapsed since start (a timestamp given by mailslot_stats_clock) in a histogram. */
+#define mailslot_stats_hist( stats, hist, start ) \
+do { \
+    u64 __start = ( start ); \
+    if ( static_branch_unlikely( &mailslot_stats_enabled ) && __start != 0 ) { \
+        this_cpu_inc( (stats)->hist[ mailslot_stats_bucket( ktime_get_ns() - __start ) ] ); \
+    } \
+} while ( 0 )
+
+/* count is only evaluated while statistics are enabled (counting the messages is not free) */
+#define mailslot_stats_occupancy( stats, count ) \
+do { \
+    if ( static_branch_unlikely( &mailslot_stats_enabled ) ) { \
+        u64 __count = (u64)( count ); \
+        if ( __count > this_cpu_read( (stats)->max_occupancy ) ) { \
+            this_cpu_write( (stats)->max_occupancy, __count ); \
+        } \
+    } \
+} while ( 0 )
+
+/* Creates/removes the debugfs root directory (mailslot/). */
+void mailslot_stats_debugfs_init( void );
+void mailslot_stats_debugfs_exit( void );
+
+/* Exports the statistics of slot id in mailslot/<id>/ (returns the created directory). */
+struct dentry* mailslot_stats_register( int id, struct mailslot_stats __percpu* stats );
+
+/* Removes the directory created by mailslot_stats_register. */
+void mailslot_stats_unregister( struct dentry* dir );
+
+/* Clears all the counters and histograms. */
+void mailslot_stats_reset( struct mailslot_stats __percpu* stats );
+
+#endif
@@ -0,0 +1,104 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mailslot
+
+#if !defined( MAILSLOT_TRACE_H ) || defined( TRACE_HEADER_MULTI_READ )
+#define MAILSLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* the producers (consumer == 0) or the consumers (consumer == 1) lock of a slot in list mode was taken */
+TRACE_EVENT( mailslot_lock,
+    TP_PROTO( int id, int consumer ),
+    TP_ARGS( id, consumer ),
+    TP_STRUCT__entry(
+        __field( int, id )
+        __field( int, consumer )
+    ),
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->consumer = consumer;
+    ),
+    TP_printk( "id=%d consumer=%d", __entry->id, __entry->consumer )
+);
+
+/* a message entered or left the slot, count is the number of messages left in the slot
+   (callers check trace_*_enabled() first, since counting the messages is not free) */
+DECLARE_EVENT_CLASS( mailslot_msg,
+    TP_PROTO( int id, size_t size, int count ),
+    TP_ARGS( id, size, count ),
+    TP_STRUCT__entry(
+        __field( int, id )
+        __field( size_t, size )
+        __field( int, count )
+    ),
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->size = size;
+        __entry->count = count;
+    ),
+    TP_printk( "id=%d size=%zu count=%d", __entry->id, __entry->size, __entry->count )
+);
+
+DEFINE_EVENT( mailslot_msg, mailslot_enqueue,
+    TP_PROTO( int id, size_t size, int count ),
+    TP_ARGS( id, size, count )
+);
+
+DEFINE_EVENT( mailslot_msg, mailslot_dequeue,
+    TP_PROTO( int id, size_t size, int count ),
+    TP_ARGS( id, size, count )
+);
+
+/* a reader (writer == 0) or a writer (writer == 1) goes to sleep or is woken up */
+DECLARE_EVENT_CLASS( mailslot_queue,
+    TP_PROTO( int id, int writer, int count ),
+    TP_ARGS( id, writer, count ),
+    TP_STRUCT__entry(
+        __field( int, id )
+        __field( int, writer )
+        __field( int, count )
+    ),
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->writer = writer;
+        __entry->count = count;
+    ),
+    TP_printk( "id=%d queue=%s count=%d", __entry->id, __entry->writer ? "wr" : "rd", __entry->count )
+);
+
+DEFINE_EVENT( mailslot_queue, mailslot_wait,
+    TP_PROTO( int id, int writer, int count ),
+    TP_ARGS( id, writer, count )
+);
+
+DEFINE_EVENT( mailslot_queue, mailslot_wakeup,
+    TP_PROTO( int id, int writer, int count ),
+    TP_ARGS( id, writer, count )
+);
+
+#endif
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mailslot_trace
+#include <trace/define_trace.h>
@@ -1,13 +1,24 @@
+#define _GNU_SOURCE /* for splice */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "../src/mailslot.h"
 #include "../src/mailslot_driver.h"
 
 #define DEVICE_FILE "/dev/test_mailslot"
+#define CTL_FILE    "/dev/mailslot_ctl"
 #define NEW_MAX_MSG_SIZE (DEFAULT_MAX_MSG_SIZE / 2)
 
 /* terminal colors */
@@ -64,6 +75,9 @@ void test_mailslot( int fd ) {
         cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
         REQUIRE( cres == 0, "failed to reset max data unit size to default value!" );
 
+        cres = ioctl( fd, MAILSLOT_RESET_STATS );
+        REQUIRE( cres == 0, "failed to reset the statistics!" );
+
         cres = ioctl( fd, 42 );
         REQUIRE( cres == -1, "succeeded in sending a non valid ioctl command!" );
 
@@ -247,6 +261,955 @@ void test_mailslot( int fd ) {
         printf( GREEN_STR( "[OK]\n" ) );
     }
 
+    {/* vectored read/write test */
+        struct mailslot_batch batch;
+        struct mailslot_capacity capacity = { 0, 0, 0 };
+        char small[ 2 ][ 4 ];
+        struct iovec wr_iov[ 3 ] = { { "abc", 4 }, { "12345", 6 }, { "xy", 3 } };
+        struct iovec rd_iov[ 4 ] = { { buffer, 4 }, { buffer + 4, 8 }, { small[0], 4 }, { small[1], 4 } };
+        printf("Testing readv/writev...      "); /* expecting empty slot and blocking io! */
+
+        cres = writev( fd, wr_iov, 3 );
+        REQUIRE( cres == 13, "failed in writing 3 messages at once!" );
+
+        cres = readv( fd, rd_iov, 4 );
+        REQUIRE( cres == 13, "failed in reading 3 messages at once!" );
+        REQUIRE( strcmp( buffer, "abc" ) == 0 && strcmp( buffer + 4, "12345" ) == 0 && strcmp( small[0], "xy" ) == 0,
+                 "retrieved wrong messages" );
+
+        cres = ioctl( fd, MAILSLOT_GET_BATCH, &batch );
+        REQUIRE( cres == 0, "failed to get the sizes of the messages!" );
+        REQUIRE( batch.count == 3 && batch.size[0] == 4 && batch.size[1] == 6 && batch.size[2] == 3, "wrong sizes of the messages" );
+
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == 12, "failed in writing a message!" );
+
+        cres = readv( fd, rd_iov + 2, 2 );
+        REQUIRE( cres == -1, "succeeded in reading a msg with size greater than the segment size!" );
+
+        cleanup_device( fd );
+
+        capacity.msgs = 2;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to set the capacity!" );
+
+        cres = writev( fd, wr_iov, 3 );
+        REQUIRE( cres == -1 && errno == EMSGSIZE, "succeeded in writing more messages than the capacity at once!" );
+
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == 12, "failed in writing a message!" );
+
+        set_nonblocking( fd, 1 );
+        cres = writev( fd, wr_iov, 2 );
+        REQUIRE( cres == -1 && errno == EAGAIN, "succeeded in writing 2 messages in a slot with room for 1!" );
+
+        cres = read( fd, buffer, sizeof( buffer ) );
+        REQUIRE( cres == 12 && strcmp( buffer, "ciao mondo!" ) == 0, "retrieved wrong message" );
+        cres = read( fd, buffer, sizeof( buffer ) );
+        REQUIRE( cres == -1 && errno == EAGAIN, "a failed writev left some messages in the slot!" );
+        set_nonblocking( fd, 0 );
+
+        capacity.msgs = MAX_SLOT_SIZE;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to restore the capacity!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* packed mode test */
+        struct mailslot_rec rec;
+        size_t offset = 0;
+        const char* msgs[ 3 ] = { "abc", "12345", "xy" };
+        int i;
+        printf("Testing packed mode...       "); /* expecting empty slot and blocking io! */
+
+        for ( i = 0; i < 3; ++i ) { /* framing 3 messages (without metadata) */
+            rec.size = strlen( msgs[i] ) + 1;
+            memcpy( buffer + offset, &rec.size, sizeof( rec.size ) );
+            memcpy( buffer + offset + MAILSLOT_REC_HDR_SIZE( 0 ), msgs[i], rec.size );
+            offset += MAILSLOT_REC_SIZE( 0, rec.size );
+        }
+
+        cres = ioctl( fd, MAILSLOT_SET_PACKED, MAILSLOT_PACKED_WRITE );
+        REQUIRE( cres == 0, "failed to set packed write mode!" );
+
+        cres = write( fd, buffer, offset );
+        REQUIRE( cres == (int)offset, "failed in writing 3 packed messages!" );
+
+        cres = write( fd, buffer, offset - 1 ); /* truncated last message */
+        REQUIRE( cres == -1, "succeeded in writing a malformed packed buffer!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_PACKED, MAILSLOT_PACKED_READ | MAILSLOT_PACKED_META );
+        REQUIRE( cres == 0, "failed to set packed read mode!" );
+
+        memset( buffer, 0, 4096 );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres > 0, "failed in reading packed messages!" );
+        for ( i = 0, offset = 0; i < 3; ++i ) {
+            memcpy( &rec, buffer + offset, sizeof( rec ) );
+            REQUIRE( rec.size == strlen( msgs[i] ) + 1 && rec.pid == getpid() && rec.tstamp > 0, "wrong header of a packed message" );
+            REQUIRE( strcmp( buffer + offset + sizeof( rec ), msgs[i] ) == 0, "retrieved wrong packed message" );
+            offset += MAILSLOT_REC_SIZE( MAILSLOT_PACKED_META, rec.size );
+        }
+        REQUIRE( cres == (int)offset, "read more than 3 packed messages!" );
+
+        { /* a header which can't be written leaves its message in the slot */
+            long page_size = sysconf( _SC_PAGESIZE );
+            char* pages = mmap( NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            REQUIRE( pages != MAP_FAILED, "failed to map the buffer!" );
+            cres = mprotect( pages, page_size, PROT_READ );
+            REQUIRE( cres == 0, "failed to protect the buffer!" );
+
+            cres = ioctl( fd, MAILSLOT_SET_PACKED, MAILSLOT_PACKED_READ );
+            REQUIRE( cres == 0, "failed to set packed read mode!" );
+            cres = write( fd, msgs[0], strlen( msgs[0] ) + 1 );
+            REQUIRE( cres == (int)strlen( msgs[0] ) + 1, "failed in writing a message!" );
+
+            /* the header falls in the read-only page, the content in the writable one */
+            cres = read( fd, pages + page_size - MAILSLOT_REC_HDR_SIZE( 0 ), page_size );
+            REQUIRE( cres == -1 && errno == EFAULT, "succeeded in reading to a read-only header!" );
+            munmap( pages, 2 * page_size );
+
+            memset( buffer, 0, 4096 );
+            cres = read( fd, buffer, 4096 );
+            REQUIRE( cres == (int)MAILSLOT_REC_SIZE( 0, strlen( msgs[0] ) + 1 ), "the message was lost with its header!" );
+            REQUIRE( strcmp( buffer + MAILSLOT_REC_HDR_SIZE( 0 ), msgs[0] ) == 0, "retrieved wrong packed message" );
+        }
+
+        { /* records can't span the segments of a vectored read */
+            struct iovec iov[ 2 ] = { { buffer, 64 }, { buffer + 64, 64 } };
+            cres = readv( fd, iov, 2 );
+            REQUIRE( cres == -1 && errno == EINVAL, "succeeded in a vectored read in packed mode!" );
+        }
+
+        cres = ioctl( fd, MAILSLOT_SET_PACKED, 0 );
+        REQUIRE( cres == 0, "failed to reset packed mode!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* poll test */
+        struct pollfd pfd = { fd, POLLIN | POLLOUT, 0 };
+        printf("Testing poll...              "); /* expecting empty slot and blocking io! */
+
+        cres = poll( &pfd, 1, 0 );
+        REQUIRE( cres == 1 && pfd.revents == POLLOUT, "empty slot not reported as writable only!" );
+
+        cres = write( fd, "abc", 4 );
+        REQUIRE( cres == 4, "failed in writing a message!" );
+
+        cres = poll( &pfd, 1, 0 );
+        REQUIRE( cres == 1 && pfd.revents == ( POLLIN | POLLOUT ), "slot not reported as readable and writable!" );
+
+        cleanup_device( fd );
+
+        cres = fill_device( fd, "hello world!", 12 );
+        REQUIRE( cres == 1, "failed to fill device!" );
+
+        cres = poll( &pfd, 1, 0 );
+        REQUIRE( cres == 1 && pfd.revents == POLLIN, "full slot not reported as readable only!" );
+
+        cleanup_device( fd );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* ring mode test */
+        printf("Testing ring mode...         "); /* expecting empty slot and blocking io! */
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, 42 );
+        REQUIRE( cres == -1, "succeeded in setting an invalid mode!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_RING );
+        REQUIRE( cres == 0, "failed to set ring mode!" );
+
+        cres = write( fd, "abc", 4 );
+        REQUIRE( cres == 4, "failed in writing a message!" );
+
+        cres = write( fd, "12345", 6 );
+        REQUIRE( cres == 6, "failed in writing a message!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, NEW_MAX_MSG_SIZE );
+        REQUIRE( cres == -1, "succeeded in resizing the ring of a non-empty slot!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == -1, "succeeded in changing the mode of a non-empty slot!" );
+
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 4 && strncmp( buffer, "abc", 3 ) == 0, "retrieved wrong message" );
+
+        cres = read( fd, buffer, 5 );
+        REQUIRE( cres == -1, "succeeded in reading a msg with size greater than the buffer size!" );
+
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 6 && strncmp( buffer, "12345", 5 ) == 0, "retrieved wrong message" );
+
+        cres = fill_device( fd, "hello world!", 12 );
+        REQUIRE( cres == 1, "failed to fill device!" );
+
+        set_nonblocking( fd, 1 );
+        cres = write( fd, "ciao mondo!", 12 ); /* WRITING TO FULL FILLED RING! */
+        REQUIRE( cres == -1, "succeeded in writing to a full filled ring!" );
+        set_nonblocking( fd, 0 );
+
+        cleanup_device( fd );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == 0, "failed to set list mode!" );
+
+        { /* cells of the biggest messages are limited by the ring budget (assuming the default one) */
+            __u64 ring_size = 0;
+            cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE );
+            REQUIRE( cres == 0, "failed to set the max message size!" );
+            cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_SHARED );
+            REQUIRE( cres == 0, "failed to set shared mode!" );
+            cres = ioctl( fd, MAILSLOT_RING_SIZE, &ring_size );
+            REQUIRE( cres == 0 && ring_size > 2 * (__u64)LIMIT_MAX_MSG_SIZE && ring_size <= DEFAULT_RING_BUDGET + 4096,
+                     "the ring exceeds its budget!" );
+            cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+            REQUIRE( cres == 0, "failed to set list mode!" );
+            cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
+            REQUIRE( cres == 0, "failed to restore the max message size!" );
+        }
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* shared mode test */
+        __u64 ring_size, pos;
+        void* mapping;
+        struct mailslot_ring_view view;
+        struct mailslot_cell* cell;
+
+        printf("Testing shared mode...       "); /* expecting empty slot and blocking io! */
+
+        cres = ioctl( fd, MAILSLOT_RING_SIZE, &ring_size );
+        REQUIRE( cres == -1, "got the ring size of a slot not in shared mode!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_SHARED );
+        REQUIRE( cres == 0, "failed to set shared mode!" );
+
+        cres = ioctl( fd, MAILSLOT_RING_SIZE, &ring_size );
+        REQUIRE( cres == 0 && ring_size > 0, "failed to get the ring size!" );
+
+        mapping = mmap( NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        REQUIRE( mapping != MAP_FAILED, "failed to map the ring!" );
+        mailslot_ring_view_init( &view, mapping );
+
+        cell = mailslot_ring_reserve( &view, &pos ); /* user space producer, kernel consumer */
+        REQUIRE( cell != NULL, "failed to reserve a cell!" );
+        memcpy( cell->content, "abc", 4 );
+        cell->size = 4;
+        mailslot_ring_publish( cell, pos );
+
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 4 && strncmp( buffer, "abc", 3 ) == 0, "retrieved wrong message" );
+
+        cres = write( fd, "12345", 6 ); /* kernel producer, user space consumer */
+        REQUIRE( cres == 6, "failed in writing a message!" );
+
+        cell = mailslot_ring_peek( &view, &pos );
+        REQUIRE( cell != NULL && cell->size == 6 && strncmp( cell->content, "12345", 5 ) == 0, "retrieved wrong message" );
+        REQUIRE( mailslot_ring_take( &view, pos ), "failed to consume a message!" );
+        mailslot_ring_release( &view, cell, pos );
+
+        REQUIRE( mailslot_ring_peek( &view, &pos ) == NULL, "the ring is not empty!" );
+
+        cres = ioctl( fd, MAILSLOT_RING_NOTIFY, MAILSLOT_RING_READERS | MAILSLOT_RING_WRITERS );
+        REQUIRE( cres == 0, "failed to notify the sleepers!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == -1, "succeeded in changing the mode of a mapped slot!" );
+
+        munmap( mapping, ring_size );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == 0, "failed to set list mode!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* concurrent writers test */
+        int mode, w, seq, last[ 4 ];
+
+        printf("Testing concurrent writers..."); /* expecting empty slot and blocking io! */
+
+        for ( mode = MAILSLOT_MODE_LIST; mode <= MAILSLOT_MODE_RING; ++mode ) {
+            cres = ioctl( fd, MAILSLOT_SET_MODE, mode );
+            REQUIRE( cres == 0, "failed to set the mode!" );
+
+            for ( w = 0; w < 4; ++w ) {
+                pid = fork();
+                REQUIRE( pid >= 0, "failed to fork!" );
+                if ( pid == 0 ) { /* child: the messages of a writer must be read in order */
+                    for ( seq = 0; seq < 100; ++seq ) {
+                        cres = sprintf( buffer, "%d %d", w, seq );
+                        cres = write( fd, buffer, cres + 1 );
+                        REQUIRE( cres > 0, "failed in writing a message from child!" );
+                    }
+                    return;
+                }
+                last[ w ] = -1;
+            }
+
+            for ( cres = 0; cres < 4 * 100; ++cres ) {
+                REQUIRE( read( fd, buffer, 4096 ) > 0, "failed in reading a message!" );
+                REQUIRE( sscanf( buffer, "%d %d", &w, &seq ) == 2 && w >= 0 && w < 4, "retrieved wrong message" );
+                REQUIRE( seq == last[ w ] + 1, "the messages of a writer were reordered!" );
+                last[ w ] = seq;
+            }
+
+            cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+            REQUIRE( cres == 0, "failed to set list mode!" );
+        }
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* handoff test */
+        printf("Testing handoff...           "); /* expecting empty slot and blocking io! */
+
+        pid = fork();
+        REQUIRE( pid >= 0, "failed to fork!" );
+
+        if ( pid == 0 ) { /* child */
+            sleep(1);
+            cres = write( fd, "ciao mondo!", 12 ); /* handed to the parked parent */
+            REQUIRE( cres == 12, "failed in writing a message from child!" );
+            sleep(1);
+            cres = write( fd, "hello world!", 13 ); /* too big for the parked parent: enqueued */
+            REQUIRE( cres == 13, "failed in writing a message from child!" );
+            return;
+        } else { /* parent */
+            cres = read( fd, buffer, 4096 );
+            REQUIRE( cres == 12 && strcmp( buffer, "ciao mondo!" ) == 0, "retrieved wrong message" );
+
+            cres = read( fd, buffer, 12 );
+            REQUIRE( cres == -1, "succeeded in reading a msg with size greater than the buffer size!" );
+
+            cres = read( fd, buffer, 4096 );
+            REQUIRE( cres == 13 && strcmp( buffer, "hello world!" ) == 0, "retrieved wrong message" );
+        }
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* capacity test */
+        int i;
+        struct mailslot_capacity capacity = { 0, 0, 0 };
+
+        printf("Testing capacity...          "); /* expecting empty slot and blocking io! */
+
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == -1, "succeeded in setting a 0 msgs capacity!" );
+
+        capacity.msgs = 4;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to set the capacity!" );
+
+        set_nonblocking( fd, 1 );
+        for ( i = 0; i < 4; ++i ) {
+            cres = write( fd, "ciao mondo!", 12 );
+            REQUIRE( cres == 12, "failed in writing a message!" );
+        }
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == -1, "succeeded in writing beyond the msgs capacity!" );
+        cleanup_device( fd );
+
+        capacity.msgs = MAX_SLOT_SIZE;
+        capacity.bytes = 20;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to set the capacity!" );
+
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == 12, "failed in writing a message!" );
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == -1, "succeeded in writing beyond the bytes capacity!" );
+        cleanup_device( fd );
+        cres = write( fd, buffer, 21 );
+        REQUIRE( cres == -1, "succeeded in writing a msg bigger than the bytes capacity!" );
+
+        capacity.msgs = 8;
+        capacity.bytes = 0;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to set the capacity!" );
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_RING ); /* a ring of 8 cells */
+        REQUIRE( cres == 0, "failed to set ring mode!" );
+        for ( i = 0; i < 8; ++i ) {
+            cres = write( fd, "ciao mondo!", 12 );
+            REQUIRE( cres == 12, "failed in writing a message!" );
+        }
+        cres = write( fd, "ciao mondo!", 12 );
+        REQUIRE( cres == -1, "succeeded in writing beyond the ring capacity!" );
+        cleanup_device( fd );
+        set_nonblocking( fd, 0 );
+
+        capacity.msgs = MAX_SLOT_SIZE;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to restore the capacity!" );
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == 0, "failed to set list mode!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* large message test */
+        int i;
+        char* large = malloc( 2 * LIMIT_MAX_MSG_SIZE );
+
+        printf("Testing large messages...    "); /* expecting empty slot and blocking io! */
+        REQUIRE( large != NULL, "failed to allocate the buffer!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE );
+        REQUIRE( cres == 0, "failed to set max data unit size to upper limit!" );
+
+        for ( i = 0; i < LIMIT_MAX_MSG_SIZE; ++i ) {
+            large[i] = 'a' + i % 26;
+        }
+        cres = write( fd, large, LIMIT_MAX_MSG_SIZE );
+        REQUIRE( cres == LIMIT_MAX_MSG_SIZE, "failed in writing a message of max size!" );
+
+        cres = write( fd, large, 3 * 4096 + 1 ); /* not a multiple of the page size */
+        REQUIRE( cres == 3 * 4096 + 1, "failed in writing a multi-page message!" );
+
+        cres = read( fd, large + LIMIT_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE - 1 );
+        REQUIRE( cres == -1, "succeeded in reading a msg with size greater than the buffer size!" );
+
+        cres = read( fd, large + LIMIT_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE );
+        REQUIRE( cres == LIMIT_MAX_MSG_SIZE, "failed in reading a message of max size!" );
+        REQUIRE( memcmp( large, large + LIMIT_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE ) == 0, "retrieved wrong message" );
+
+        cres = read( fd, large + LIMIT_MAX_MSG_SIZE, LIMIT_MAX_MSG_SIZE );
+        REQUIRE( cres == 3 * 4096 + 1, "failed in reading a multi-page message!" );
+        REQUIRE( memcmp( large, large + LIMIT_MAX_MSG_SIZE, cres ) == 0, "retrieved wrong message" );
+
+        free( large );
+
+        cres = ioctl( fd, MAILSLOT_SET_MAX_MSG_SIZE, DEFAULT_MAX_MSG_SIZE );
+        REQUIRE( cres == 0, "failed to reset max data unit size to default value!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* splice test */
+        int pfd[2];
+        char spliced[ DEFAULT_MAX_MSG_SIZE ];
+
+        printf("Testing splice...            "); /* expecting empty slot and blocking io! */
+        REQUIRE( pipe( pfd ) == 0, "failed to create a pipe!" );
+
+        cres = write( fd, "first", 5 );
+        REQUIRE( cres == 5, "failed in writing the first message!" );
+        cres = write( fd, "second", 6 );
+        REQUIRE( cres == 6, "failed in writing the second message!" );
+
+        cres = splice( fd, NULL, pfd[1], NULL, 4, 0 );
+        REQUIRE( cres == -1, "succeeded in splicing a msg with size greater than the requested length!" );
+
+        cres = splice( fd, NULL, pfd[1], NULL, DEFAULT_MAX_MSG_SIZE, 0 );
+        REQUIRE( cres == 5, "failed in splicing the first message to the pipe!" );
+        cres = splice( fd, NULL, pfd[1], NULL, DEFAULT_MAX_MSG_SIZE, 0 );
+        REQUIRE( cres == 6, "failed in splicing the second message to the pipe!" );
+        cres = read( pfd[0], spliced, sizeof( spliced ) );
+        REQUIRE( cres == 11 && memcmp( spliced, "firstsecond", 11 ) == 0, "retrieved wrong messages from the pipe" );
+
+        cres = write( pfd[1], "third", 5 );
+        REQUIRE( cres == 5, "failed in writing to the pipe!" );
+        cres = splice( pfd[0], NULL, fd, NULL, DEFAULT_MAX_MSG_SIZE, 0 );
+        REQUIRE( cres == 5, "failed in splicing the pipe to the slot!" );
+        cres = read( fd, spliced, sizeof( spliced ) );
+        REQUIRE( cres == 5 && memcmp( spliced, "third", 5 ) == 0, "retrieved wrong spliced message" );
+
+        close( pfd[0] );
+        close( pfd[1] );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* control device test */
+        int ctl;
+        struct stat st;
+
+        printf("Testing control device...    "); /* expecting empty slot and blocking io! */
+        ctl = open( CTL_FILE, O_RDWR );
+        REQUIRE( ctl >= 0, "failed to open the control device!" );
+        REQUIRE( fstat( fd, &st ) == 0, "failed to get the minor number of the slot!" );
+
+        cres = ioctl( ctl, MAILSLOT_CTL_DESTROY, minor( st.st_rdev ) );
+        REQUIRE( cres == -1, "succeeded in destroying a slot not created via the control device!" );
+        cres = ioctl( ctl, MAILSLOT_CTL_CREATE, minor( st.st_rdev ) );
+        REQUIRE( cres == 0, "failed to create the slot!" );
+        cres = ioctl( ctl, MAILSLOT_CTL_CREATE, minor( st.st_rdev ) );
+        REQUIRE( cres == -1, "succeeded in creating the slot twice!" );
+        cres = ioctl( ctl, MAILSLOT_CTL_CREATE, ( 1 << 20 ) );
+        REQUIRE( cres == -1, "succeeded in creating a slot out of the range of minors!" );
+        cres = ioctl( ctl, MAILSLOT_CTL_DESTROY, minor( st.st_rdev ) );
+        REQUIRE( cres == 0, "failed to destroy the slot!" );
+
+        close( ctl );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* priority test */
+        char msg[ DEFAULT_MAX_MSG_SIZE ];
+
+        printf("Testing priorities...        "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, MAILSLOT_SET_PRIORITY, MAILSLOT_LANES );
+        REQUIRE( cres == -1, "succeeded in setting an invalid priority!" );
+
+        cres = write( fd, "bulk1", 5 );
+        REQUIRE( cres == 5, "failed in writing a low priority message!" );
+        cres = write( fd, "bulk2", 5 );
+        REQUIRE( cres == 5, "failed in writing a low priority message!" );
+        cres = ioctl( fd, MAILSLOT_SET_PRIORITY, MAILSLOT_LANES - 1 );
+        REQUIRE( cres == 0, "failed to set the highest priority!" );
+        cres = write( fd, "ctrl", 4 );
+        REQUIRE( cres == 4, "failed in writing a high priority message!" );
+        cres = ioctl( fd, MAILSLOT_SET_PRIORITY, 0 );
+        REQUIRE( cres == 0, "failed to reset the priority!" );
+
+        cres = read( fd, msg, sizeof( msg ) );
+        REQUIRE( cres == 4 && memcmp( msg, "ctrl", 4 ) == 0, "the high priority message was not read first!" );
+        cres = read( fd, msg, sizeof( msg ) );
+        REQUIRE( cres == 5 && memcmp( msg, "bulk1", 5 ) == 0, "low priority messages were reordered!" );
+        cres = read( fd, msg, sizeof( msg ) );
+        REQUIRE( cres == 5 && memcmp( msg, "bulk2", 5 ) == 0, "low priority messages were reordered!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* peek test */
+        int next_size = -1;
+        __u32 depth = 0;
+        __u64 bytes = 0;
+        char msg[ 8 ];
+        struct mailslot_peek peek = { .buffer = (__u64)(uintptr_t)msg, .size = 4 };
+
+        printf("Testing peek...              "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, FIONREAD, &next_size );
+        REQUIRE( cres == 0 && next_size == 0, "the next message size of an empty slot is not 0!" );
+        cres = ioctl( fd, MAILSLOT_PEEK, &peek );
+        REQUIRE( cres == 0, "succeeded in peeking a message from an empty slot!" );
+
+        cres = write( fd, "peeked", 6 );
+        REQUIRE( cres == 6, "failed in writing a message!" );
+        cres = write( fd, "next", 4 );
+        REQUIRE( cres == 4, "failed in writing a message!" );
+
+        cres = ioctl( fd, FIONREAD, &next_size );
+        REQUIRE( cres == 0 && next_size == 6, "wrong size of the next message!" );
+        cres = ioctl( fd, MAILSLOT_GET_DEPTH, &depth );
+        REQUIRE( cres == 0 && depth == 2, "wrong number of messages in the slot!" );
+        cres = ioctl( fd, MAILSLOT_GET_BYTES, &bytes );
+        REQUIRE( cres == 0 && bytes == 10, "wrong number of bytes in the slot!" );
+
+        cres = ioctl( fd, MAILSLOT_PEEK, &peek );
+        REQUIRE( cres == -1, "succeeded in peeking a msg with size greater than the buffer size!" );
+        peek.size = next_size;
+        cres = ioctl( fd, MAILSLOT_PEEK, &peek );
+        REQUIRE( cres == 6 && memcmp( msg, "peeked", 6 ) == 0, "failed in peeking the next message!" );
+
+        cres = read( fd, msg, next_size );
+        REQUIRE( cres == 6 && memcmp( msg, "peeked", 6 ) == 0, "the peeked message was dequeued!" );
+        cres = read( fd, msg, 4 );
+        REQUIRE( cres == 4 && memcmp( msg, "next", 4 ) == 0, "retrieved wrong message" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* timeout test */
+        struct timespec start, end;
+        long elapsed_ms;
+
+        printf("Testing timeouts...          "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, (unsigned long)-1 );
+        REQUIRE( cres == -1 || sizeof( long ) == sizeof( int ), "succeeded in setting a read timeout out of range!" );
+        cres = ioctl( fd, MAILSLOT_SET_WRITE_TIMEOUT, (unsigned long)-1 );
+        REQUIRE( cres == -1 || sizeof( long ) == sizeof( int ), "succeeded in setting a write timeout out of range!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 100 );
+        REQUIRE( cres == 0, "failed to set the read timeout!" );
+
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        cres = read( fd, buffer, 4096 );
+        clock_gettime( CLOCK_MONOTONIC, &end );
+        elapsed_ms = ( end.tv_sec - start.tv_sec ) * 1000 + ( end.tv_nsec - start.tv_nsec ) / 1000000;
+        REQUIRE( cres == -1 && errno == ETIMEDOUT, "the read on an empty slot didn't time out!" );
+        REQUIRE( elapsed_ms >= 90, "the read timed out too early!" );
+
+        cres = write( fd, "in time", 7 );
+        REQUIRE( cres == 7, "failed in writing a message!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 7, "failed in reading a message with a timeout set!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 0 );
+        REQUIRE( cres == 0, "failed to reset the read timeout!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* broadcast test */
+        __u64 dropped = 1;
+        int sub1 = open( DEVICE_FILE, O_RDONLY );
+        int sub2 = open( DEVICE_FILE, O_RDONLY );
+        REQUIRE( sub1 >= 0 && sub2 >= 0, "failed to open the slot again!" );
+
+        printf("Testing broadcast...         "); /* expecting empty slot and blocking io! */
+        cres = ioctl( sub1, MAILSLOT_SUBSCRIBE );
+        REQUIRE( cres == -1 && errno == EINVAL, "succeeded in subscribing to a slot in list mode!" );
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_BROADCAST );
+        REQUIRE( cres == 0, "failed to set broadcast mode!" );
+        cres = ioctl( sub1, MAILSLOT_SUBSCRIBE );
+        REQUIRE( cres == 0, "failed to subscribe!" );
+        cres = ioctl( sub2, MAILSLOT_SUBSCRIBE );
+        REQUIRE( cres == 0, "failed to subscribe from another file!" );
+        cres = ioctl( sub1, MAILSLOT_SUBSCRIBE );
+        REQUIRE( cres == -1 && errno == EEXIST, "succeeded in subscribing twice!" );
+
+        cres = write( fd, "to all", 6 );
+        REQUIRE( cres == 6, "failed in writing a message!" );
+        cres = read( sub1, buffer, 4096 );
+        REQUIRE( cres == 6 && memcmp( buffer, "to all", 6 ) == 0, "the first subscriber didn't get the message!" );
+        cres = read( sub2, buffer, 4096 );
+        REQUIRE( cres == 6 && memcmp( buffer, "to all", 6 ) == 0, "the second subscriber didn't get the message!" );
+        cres = ioctl( sub1, MAILSLOT_GET_DROPPED, &dropped );
+        REQUIRE( cres == 0 && dropped == 0, "a subscriber lost messages!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == -1 && errno == EINVAL, "succeeded in reading without subscribing!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == -1 && errno == EBUSY, "succeeded in changing the mode of a slot with subscribers!" );
+        close( sub1 );
+        close( sub2 );
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == 0, "failed to restore list mode!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* sharded test */
+        int next_size = 0;
+        char msg[ 8 ];
+
+        printf("Testing sharded mode...      "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_SHARDED );
+        REQUIRE( cres == 0, "failed to set sharded mode!" );
+
+        cres = write( fd, "first", 5 );
+        REQUIRE( cres == 5, "failed in writing a message!" );
+        cres = write( fd, "second", 6 );
+        REQUIRE( cres == 6, "failed in writing a message!" );
+        cres = ioctl( fd, FIONREAD, &next_size );
+        REQUIRE( cres == 0 && next_size == 5, "wrong size of the next message!" );
+
+        cres = read( fd, msg, 4 );
+        REQUIRE( cres == -1, "succeeded in reading a msg with size greater than the buffer size!" );
+        cres = read( fd, msg, sizeof( msg ) );
+        REQUIRE( cres == 5 && memcmp( msg, "first", 5 ) == 0, "the messages of a writer were reordered!" );
+        cres = read( fd, msg, sizeof( msg ) );
+        REQUIRE( cres == 6 && memcmp( msg, "second", 6 ) == 0, "the messages of a writer were reordered!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_MODE, MAILSLOT_MODE_LIST );
+        REQUIRE( cres == 0, "failed to restore list mode!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* watermarks test */
+        struct mailslot_watermarks marks = { .rd_msgs = 3, .rd_flush_ms = 0, .rd_bytes = 0, .wr_msgs = 0 };
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        printf("Testing watermarks...        "); /* expecting empty slot and blocking io! */
+        marks.rd_msgs = LIMIT_SLOT_SIZE + 1;
+        cres = ioctl( fd, MAILSLOT_SET_WATERMARKS, &marks );
+        REQUIRE( cres == -1 && errno == EINVAL, "succeeded in setting an invalid watermark!" );
+        marks.rd_msgs = 3;
+        cres = ioctl( fd, MAILSLOT_SET_WATERMARKS, &marks );
+        REQUIRE( cres == 0, "failed to set the watermarks!" );
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 100 );
+        REQUIRE( cres == 0, "failed to set the read timeout!" );
+
+        cres = write( fd, "one", 3 );
+        REQUIRE( cres == 3, "failed in writing a message!" );
+        cres = read( fd, buffer, 4096 ); /* a message is queued, but the watermark is 3 */
+        REQUIRE( cres == -1 && errno == ETIMEDOUT, "a read below the read watermark took a queued message!" );
+        cres = write( fd, "two", 3 );
+        REQUIRE( cres == 3, "failed in writing a message!" );
+        cres = poll( &pfd, 1, 0 );
+        REQUIRE( cres == 0, "poll reported a slot below the read watermark as readable!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == -1 && errno == ETIMEDOUT, "a read below the read watermark didn't wait!" );
+        cres = write( fd, "three", 5 );
+        REQUIRE( cres == 5, "failed in writing a message!" );
+        cres = poll( &pfd, 1, 0 );
+        REQUIRE( cres == 1 && ( pfd.revents & POLLIN ), "poll didn't report the read watermark as reached!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 3 && memcmp( buffer, "one", 3 ) == 0, "failed in reading at the read watermark!" );
+
+        marks.rd_flush_ms = 10; /* two messages left: the next read waits 10 ms at most */
+        cres = ioctl( fd, MAILSLOT_SET_WATERMARKS, &marks );
+        REQUIRE( cres == 0, "failed to set the flush timeout!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 3 && memcmp( buffer, "two", 3 ) == 0, "the flush timeout didn't end the read!" );
+        set_nonblocking( fd, 1 ); /* reads which wouldn't block ignore the watermarks */
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 5 && memcmp( buffer, "three", 5 ) == 0, "a non-blocking read waited for the read watermark!" );
+        set_nonblocking( fd, 0 );
+
+        memset( &marks, 0, sizeof( marks ) );
+        cres = ioctl( fd, MAILSLOT_SET_WATERMARKS, &marks );
+        REQUIRE( cres == 0, "failed to reset the watermarks!" );
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 0 );
+        REQUIRE( cres == 0, "failed to reset the read timeout!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* busy poll test */
+        printf("Testing busy poll...         "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, MAILSLOT_SET_BUSY_POLL, MAILSLOT_BUSY_POLL_MAX + 1 );
+        REQUIRE( cres == -1 && errno == EINVAL, "succeeded in setting a busy poll beyond the limit!" );
+        cres = ioctl( fd, MAILSLOT_SET_BUSY_POLL, 1000 );
+        REQUIRE( cres == 0, "failed to set the busy poll!" );
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 20 );
+        REQUIRE( cres == 0, "failed to set the read timeout!" );
+
+        cres = read( fd, buffer, 4096 ); /* spins for 1 ms, then sleeps until the timeout */
+        REQUIRE( cres == -1 && errno == ETIMEDOUT, "a read of an empty slot didn't wait after spinning!" );
+        cres = write( fd, "spin", 4 );
+        REQUIRE( cres == 4, "failed in writing a message!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 4 && memcmp( buffer, "spin", 4 ) == 0, "failed in reading a message with busy poll!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_BUSY_POLL, 0 );
+        REQUIRE( cres == 0, "failed to reset the busy poll!" );
+        cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 0 );
+        REQUIRE( cres == 0, "failed to reset the read timeout!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* numa node test */
+        int node = 0;
+
+        printf("Testing NUMA node...         "); /* expecting empty slot and blocking io! */
+        cres = ioctl( fd, MAILSLOT_GET_NUMA_NODE, &node );
+        REQUIRE( cres == 0 && node == MAILSLOT_NODE_LOCAL, "the slot isn't placed on the node of its writers!" );
+        cres = ioctl( fd, MAILSLOT_SET_NUMA_NODE, -3 );
+        REQUIRE( cres == -1 && errno == EINVAL, "succeeded in setting an invalid NUMA node!" );
+        cres = ioctl( fd, MAILSLOT_SET_NUMA_NODE, 0 ); /* node 0 is always online */
+        REQUIRE( cres == 0, "failed to set the NUMA node!" );
+        cres = write( fd, "node", 4 );
+        REQUIRE( cres == 4, "failed in writing a message!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 4 && memcmp( buffer, "node", 4 ) == 0, "failed in reading a message on a NUMA node!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_NUMA_NODE, MAILSLOT_NODE_READER );
+        REQUIRE( cres == 0, "failed to place the slot on the node of its reader!" );
+        set_nonblocking( fd, 1 );
+        cres = read( fd, buffer, 4096 ); /* even a read of an empty slot claims it */
+        REQUIRE( cres == -1 && errno == EAGAIN, "a non-blocking read of an empty slot didn't fail!" );
+        set_nonblocking( fd, 0 );
+        cres = ioctl( fd, MAILSLOT_GET_NUMA_NODE, &node );
+        REQUIRE( cres == 0 && node >= 0, "the first reader didn't set the NUMA node!" );
+
+        cres = ioctl( fd, MAILSLOT_SET_NUMA_NODE, MAILSLOT_NODE_LOCAL );
+        REQUIRE( cres == 0, "failed to reset the NUMA node!" );
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* snapshot test */
+        int i;
+        struct stat st;
+        struct mailslot_capacity capacity = { 0, 0, 0 };
+        struct mailslot_snap_slot* rec = NULL;
+        struct mailslot_snap_msg* msg = NULL;
+        size_t offset, snap_len, snap_size = MAILSLOT_SNAP_MSG_SIZE( LIMIT_MAX_MSG_SIZE );
+        char* snap = malloc( snap_size );
+        int ctl = open( CTL_FILE, O_RDWR );
+
+        printf("Testing snapshot...          "); /* expecting empty slot and blocking io! (every slot is drained) */
+        REQUIRE( ctl >= 0 && snap != NULL, "failed to open the control device!" );
+        REQUIRE( fstat( fd, &st ) == 0, "failed to get the minor number of the slot!" );
+        cres = write( fd, "first", 5 );
+        REQUIRE( cres == 5, "failed in writing a message!" );
+        cres = write( fd, "second", 6 );
+        REQUIRE( cres == 6, "failed in writing a message!" );
+
+        cres = read( ctl, snap, snap_size );
+        REQUIRE( cres > 0, "failed to read the snapshot!" );
+        snap_len = cres;
+        for ( offset = 0; offset < snap_len; ) {
+            rec = (struct mailslot_snap_slot*)( snap + offset );
+            if ( rec->type == MAILSLOT_SNAP_SLOT && rec->minor == minor( st.st_rdev ) ) {
+                break;
+            }
+            msg = (struct mailslot_snap_msg*)rec;
+            offset += rec->type == MAILSLOT_SNAP_SLOT ? sizeof( *rec ) : MAILSLOT_SNAP_MSG_SIZE( msg->size );
+        }
+        REQUIRE( offset < snap_len && rec->mode == MAILSLOT_MODE_LIST, "the slot is missing from the snapshot!" );
+        msg = (struct mailslot_snap_msg*)( snap + offset + sizeof( *rec ) );
+        REQUIRE( msg->type == MAILSLOT_SNAP_MSG && msg->size == 5 && memcmp( msg + 1, "first", 5 ) == 0,
+                 "the snapshot doesn't hold the messages of the slot!" );
+        cres = read( ctl, buffer, 4096 );
+        REQUIRE( cres == 0, "the snapshot didn't end after the last slot!" );
+        set_nonblocking( fd, 1 );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == -1 && errno == EAGAIN, "the snapshot didn't drain the slot!" );
+        set_nonblocking( fd, 0 );
+
+        cres = write( ctl, snap, 13 ); /* a record split between two writes */
+        REQUIRE( cres == 13, "failed to write the first part of the snapshot!" );
+        cres = write( ctl, snap + 13, snap_len - 13 );
+        REQUIRE( cres == (int)( snap_len - 13 ), "failed to restore the snapshot!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 5 && memcmp( buffer, "first", 5 ) == 0, "failed in reading a restored message!" );
+        cres = read( fd, buffer, 4096 );
+        REQUIRE( cres == 6 && memcmp( buffer, "second", 6 ) == 0, "failed in reading a restored message!" );
+
+        capacity.msgs = 4; /* a full slot smaller than a restore batch */
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to set the capacity!" );
+        for ( i = 0; i < 4; ++i ) {
+            cres = write( fd, "full", 4 );
+            REQUIRE( cres == 4, "failed in writing a message!" );
+        }
+        cres = read( ctl, snap, snap_size );
+        REQUIRE( cres > 0, "failed to read the snapshot!" );
+        snap_len = cres;
+        cres = read( ctl, buffer, 4096 );
+        REQUIRE( cres == 0, "the snapshot didn't end after the last slot!" );
+        cres = write( ctl, snap, snap_len );
+        REQUIRE( cres == (int)snap_len, "failed to restore the snapshot of a full slot!" );
+        for ( i = 0; i < 4; ++i ) {
+            cres = read( fd, buffer, 4096 );
+            REQUIRE( cres == 4 && memcmp( buffer, "full", 4 ) == 0, "failed in reading a restored message!" );
+        }
+        capacity.msgs = MAX_SLOT_SIZE;
+        cres = ioctl( fd, MAILSLOT_SET_CAPACITY, &capacity );
+        REQUIRE( cres == 0, "failed to restore the capacity!" );
+
+        { /* a message whose record can't be copied stays in the slot */
+            struct mailslot_snap_slot slot_rec;
+            long page_size = sysconf( _SC_PAGESIZE );
+            char* pages = mmap( NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            REQUIRE( pages != MAP_FAILED, "failed to map the buffer!" );
+            cres = mprotect( pages, page_size, PROT_READ );
+            REQUIRE( cres == 0, "failed to protect the buffer!" );
+            cres = write( fd, "kept", 4 );
+            REQUIRE( cres == 4, "failed in writing a message!" );
+
+            do { /* a slot record at a time, up to the one of the slot */
+                cres = read( ctl, &slot_rec, sizeof( slot_rec ) );
+                REQUIRE( cres == sizeof( slot_rec ), "the slot is missing from the snapshot!" );
+            } while ( slot_rec.minor != minor( st.st_rdev ) );
+            /* the header falls in the read-only page, the content in the writable one */
+            cres = read( ctl, pages + page_size - sizeof( *msg ), page_size );
+            REQUIRE( cres == -1 && errno == EFAULT, "succeeded in reading to a read-only record!" );
+            munmap( pages, 2 * page_size );
+
+            cres = read( ctl, snap, snap_size );
+            msg = (struct mailslot_snap_msg*)snap;
+            REQUIRE( cres >= (int)MAILSLOT_SNAP_MSG_SIZE( 4 ) && msg->type == MAILSLOT_SNAP_MSG && msg->size == 4 &&
+                     memcmp( msg + 1, "kept", 4 ) == 0, "the message was lost with its record!" );
+            while ( ( cres = read( ctl, snap, snap_size ) ) > 0 ); /* the rest of the snapshot */
+            REQUIRE( cres == 0, "failed to read the snapshot!" );
+        }
+
+        close( ctl );
+        free( snap );
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* slot reset test */
+        int ctl, other;
+        __u64 ring_size;
+        struct stat st;
+        const char* path = "/tmp/test_mailslot_reset";
+
+        printf("Testing slot reset...        ");
+        REQUIRE( fstat( fd, &st ) == 0, "failed to get the device number of the slot!" );
+        unlink( path );
+        cres = mknod( path, S_IFCHR | 0600, makedev( major( st.st_rdev ), minor( st.st_rdev ) + 1 ) );
+        REQUIRE( cres == 0, "failed to create the device file of another slot!" );
+
+        other = open( path, O_RDWR );
+        REQUIRE( other >= 0, "failed to open another slot!" );
+        cres = ioctl( other, MAILSLOT_SET_MODE, MAILSLOT_MODE_SHARED );
+        REQUIRE( cres == 0, "failed to set shared mode!" );
+        close( other ); /* idle and empty: the slot is freed */
+
+        other = open( path, O_RDWR );
+        REQUIRE( other >= 0, "failed to open another slot!" );
+        cres = ioctl( other, MAILSLOT_RING_SIZE, &ring_size );
+        REQUIRE( cres == -1, "a freed slot kept its mode!" );
+
+        ctl = open( CTL_FILE, O_RDWR );
+        REQUIRE( ctl >= 0, "failed to open the control device!" );
+        cres = ioctl( ctl, MAILSLOT_CTL_CREATE, minor( st.st_rdev ) + 1 );
+        REQUIRE( cres == 0, "failed to create the slot!" );
+        cres = ioctl( other, MAILSLOT_SET_MODE, MAILSLOT_MODE_SHARED );
+        REQUIRE( cres == 0, "failed to set shared mode!" );
+        close( other );
+
+        other = open( path, O_RDWR );
+        REQUIRE( other >= 0, "failed to open another slot!" );
+        cres = ioctl( other, MAILSLOT_RING_SIZE, &ring_size );
+        REQUIRE( cres == 0 && ring_size > 0, "a slot created via the control device lost its mode!" );
+        close( other );
+
+        cres = ioctl( ctl, MAILSLOT_CTL_DESTROY, minor( st.st_rdev ) + 1 );
+        REQUIRE( cres == 0, "failed to destroy the slot!" );
+        close( ctl );
+        unlink( path );
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
+    {/* concurrent peek test */
+        int i, pfd[ 2 ];
+        char msg[ 16 ];
+        struct mailslot_peek peek = { .buffer = (__u64)(uintptr_t)msg, .size = sizeof( msg ) };
+
+        printf("Testing concurrent peek...   "); /* expecting empty slot and blocking io! */
+        cres = pipe( pfd );
+        REQUIRE( cres == 0, "failed to create a pipe!" );
+        fcntl( pfd[0], F_SETFL, O_NONBLOCK );
+
+        pid = fork();
+        REQUIRE( pid >= 0, "failed to fork!" );
+
+        if ( pid == 0 ) { /* child: peeks until the parent closes the pipe */
+            close( pfd[1] );
+            while ( read( pfd[0], msg, 1 ) != 0 ) {
+                cres = ioctl( fd, MAILSLOT_PEEK, &peek );
+                REQUIRE( cres >= 0, "failed in peeking a message from child!" );
+            }
+            return;
+        } else { /* parent: the peeks must neither hide the messages from blocking reads, nor reorder them */
+            close( pfd[0] );
+            cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 1000 );
+            REQUIRE( cres == 0, "failed to set the read timeout!" );
+            for ( i = 0; i < 200; ++i ) {
+                cres = write( fd, "first", 6 );
+                REQUIRE( cres == 6, "failed in writing a message!" );
+                cres = write( fd, "second", 7 );
+                REQUIRE( cres == 7, "failed in writing a message!" );
+
+                cres = read( fd, msg, sizeof( msg ) );
+                REQUIRE( cres == 6 && strcmp( msg, "first" ) == 0, "a concurrent peek hid or reordered a message!" );
+                cres = read( fd, msg, sizeof( msg ) );
+                REQUIRE( cres == 7 && strcmp( msg, "second" ) == 0, "a concurrent peek hid or reordered a message!" );
+            }
+            close( pfd[1] );
+            cres = ioctl( fd, MAILSLOT_SET_READ_TIMEOUT, 0 );
+            REQUIRE( cres == 0, "failed to reset the read timeout!" );
+        }
+
+        printf( GREEN_STR( "[OK]\n" ) );
+    }
+
     printf( GREEN_STR( "All tests were successful! No error occured!\n" ) );
 }
 
@@ -0,0 +1,497 @@
+#include "kshim.h"
+#include "../src/mailslot.h"
+
+#define MAX_SUBS 4
+#define MAX_BATCH 4
+#define MAX_SIZE 16384 /* upper limit to max_msg_size, well above MAILSLOT_INLINE_SIZE */
+
+enum { OP_ENQUEUE, OP_ENQUEUE_BATCH, OP_DEQUEUE, OP_PEEK, OP_SET_MODE, OP_SET_CAPACITY, OP_SET_MAX_MSG_SIZE,
+       OP_SUBSCRIBE, OP_UNSUBSCRIBE, OP_SET_BCAST_POLICY, OP_DEQUEUE_BATCH, OP_COUNT };
+
+/* Model of the slot. The messages carry their id in the first 8 bytes and a pattern depending on it after them.
+ * List and ring modes are checked exactly (a FIFO per lane), sharded mode as a bag of messages (the order depends on
+ * the CPU running the harness), subscribers in broadcast mode read in order a subsequence of the messages enqueued
+ * after they subscribed, all of it with the block policy. */
+struct model {
+    int mode;
+    size_t max_msg_size;
+    int max_msgs;
+    size_t max_bytes;
+    u64* lanes[ MAILSLOT_LANES ]; /* ids of the messages of each lane, oldest first */
+    int heads[ MAILSLOT_LANES ], tails[ MAILSLOT_LANES ];
+    size_t* sizes;              /* by id */
+    char* gone;                 /* by id: dequeued */
+    int count;
+    size_t bytes;
+    u64 next_id;
+    u64* log;                   /* ids enqueued in broadcast mode */
+    int logged;
+    struct {
+        mailslot_sub_t* sub;
+        int next;               /* index in log of the next message to read */
+        int lax;                /* subscribed while the drop policy was in use */
+    } subs[ MAX_SUBS ];
+    int policy;
+};
+
+struct input {
+    const u8* data;
+    size_t size;
+};
+
+static char wbuffer[ MAX_BATCH ][ MAX_SIZE ];
+static char rbuffer[ MAX_SIZE ];
+static char rbatch[ MAX_BATCH ][ MAX_SIZE ];
+
+#define CHECK( cond ) \
+    do { \
+        if ( !( cond ) ) { \
+            fprintf( stderr, "fuzz: %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); \
+            abort(); \
+        } \
+    } while ( 0 )
+
+static unsigned int next_byte( struct input* in ) {
+    unsigned int b = 0;
+    if ( in->size > 0 ) {
+        b = *in->data++;
+        in->size--;
+    }
+    return b;
+}
+
+static unsigned int next_u16( struct input* in ) {
+    return next_byte( in ) | ( next_byte( in ) << 8 );
+}
+
+static void fill( char* buffer, u64 id, size_t size ) {
+    size_t i;
+    memcpy( buffer, &id, sizeof( id ) );
+    for ( i = sizeof( id ); i < size; i++ ) {
+        buffer[i] = (char)( id * 131 + i );
+    }
+}
+
+/* Checks the content of a message read in rbuffer, returning its id. */
+static u64 check_content( struct model* m, ssize_t size ) {
+    u64 id;
+    ssize_t i;
+
+    CHECK( size >= (ssize_t)sizeof( id ) );
+    memcpy( &id, rbuffer, sizeof( id ) );
+    CHECK( id < m->next_id );
+    CHECK( m->sizes[ id ] == (size_t)size );
+    for ( i = sizeof( id ); i < size; i++ ) {
+        CHECK( rbuffer[i] == (char)( id * 131 + i ) );
+    }
+    return id;
+}
+
+static int exact( const struct model* m ) {
+    return m->mode == MAILSLOT_MODE_LIST || m->mode == MAILSLOT_MODE_RING || m->mode == MAILSLOT_MODE_SHARED;
+}
+
+/* Returns the lane holding the next message in list mode (any lane in sharded mode), -1 if the model is empty. */
+static int model_front( const struct model* m ) {
+    int lane;
+    for ( lane = MAILSLOT_LANES - 1; lane >= 0; lane-- ) {
+        if ( m->heads[ lane ] != m->tails[ lane ] ) {
+            return lane;
+        }
+    }
+    return -1;
+}
+
+static void model_push( struct model* m, int lane, u64 id ) {
+    m->lanes[ lane ][ m->tails[ lane ]++ ] = id;
+    m->count++;
+    m->bytes += m->sizes[ id ];
+}
+
+/* Removes a message from the model: the oldest of the lane in the exact modes, wherever it is in sharded mode. */
+static void model_pop( struct model* m, u64 id ) {
+    int lane, i;
+
+    if ( exact( m ) ) {
+        lane = model_front( m );
+        CHECK( lane >= 0 && m->lanes[ lane ][ m->heads[ lane ] ] == id );
+        m->heads[ lane ]++;
+    } else {
+        CHECK( !m->gone[ id ] );
+        for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+            for ( i = m->heads[ lane ]; i < m->tails[ lane ]; i++ ) {
+                if ( m->lanes[ lane ][i] == id ) {
+                    m->lanes[ lane ][i] = m->lanes[ lane ][ m->heads[ lane ]++ ];
+                    goto found;
+                }
+            }
+        }
+        CHECK( 0 );
+    }
+found:
+    m->gone[ id ] = 1;
+    m->count--;
+    m->bytes -= m->sizes[ id ];
+}
+
+static int subscribers( const struct model* m ) {
+    int i, n = 0;
+    for ( i = 0; i < MAX_SUBS; i++ ) {
+        n += m->subs[i].sub != NULL;
+    }
+    return n;
+}
+
+static void do_enqueue( mailslot_t* slot, struct model* m, struct input* in, int n ) {
+    struct iov_iter msgs[ MAX_BATCH ];
+    size_t sizes[ MAX_BATCH ], bytes = 0, biggest = 0;
+    u64 first = m->next_id;
+    int i, prio = next_byte( in ) % MAILSLOT_LANES, shard = next_byte( in ) % nr_cpu_ids, error, lane;
+
+    for ( i = 0; i < n; i++ ) {
+        sizes[i] = sizeof( u64 ) + next_u16( in ) % ( MAX_SIZE - sizeof( u64 ) );
+        fill( wbuffer[i], first + i, sizes[i] );
+        import_ubuf( ITER_SOURCE, wbuffer[i], sizes[i], &msgs[i] );
+        bytes += sizes[i];
+        biggest = max( biggest, sizes[i] );
+        m->sizes[ first + i ] = sizes[i];
+    }
+    m->next_id += n;
+
+    error = mailslot_enqueue_batch( slot, msgs, n, prio, shard, 1 );
+    if ( biggest > m->max_msg_size ) {
+        CHECK( error == -EPERM );
+        return;
+    }
+    if ( m->mode == MAILSLOT_MODE_LIST || m->mode == MAILSLOT_MODE_SHARDED ) {
+        if ( n > m->max_msgs || ( m->max_bytes && bytes > m->max_bytes ) ) {
+            CHECK( error == -EMSGSIZE );
+        } else if ( m->count + n > m->max_msgs || ( m->max_bytes && m->bytes + bytes > m->max_bytes ) ) {
+            CHECK( error == -ENOSPC );
+        } else {
+            CHECK( error == 0 );
+        }
+    } else {
+        CHECK( error == 0 || error == -ENOSPC || error == -EMSGSIZE );
+    }
+    if ( error ) {
+        return;
+    }
+
+    lane = m->mode == MAILSLOT_MODE_LIST ? prio : 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( m->mode == MAILSLOT_MODE_BROADCAST ) {
+            m->log[ m->logged++ ] = first + i;
+        } else {
+            model_push( m, lane, first + i );
+        }
+    }
+    mailslot_notify_msg( slot );
+}
+
+/* Header of the record of a dequeued message, whose write fails when told to (as a copy to user space). */
+struct fuzz_hdr {
+    mailslot_hdr_t hdr;
+    int fail;
+    size_t size;
+    int prio;
+};
+
+static int fuzz_hdr_put( mailslot_hdr_t* hdr, const mailslot_meta_t* meta, size_t size ) {
+    struct fuzz_hdr* fh = container_of( hdr, struct fuzz_hdr, hdr );
+    fh->size = size;
+    fh->prio = meta->prio;
+    return fh->fail ? -EFAULT : 0;
+}
+
+/* Dequeues (or peeks) a message, possibly with a header: a message whose header can't be written stays in the slot. */
+static void do_dequeue( mailslot_t* slot, struct model* m, struct input* in, int peek ) {
+    int s = next_byte( in ) % MAX_SUBS, lane;
+    size_t size = next_byte( in ) < 224 ? MAX_SIZE : next_u16( in ) % MAX_SIZE;
+    unsigned int with_hdr = peek ? 0 : next_byte( in );
+    struct fuzz_hdr fh = { .hdr.put = fuzz_hdr_put, .fail = with_hdr >= 192, .size = 0, .prio = -1 };
+    mailslot_hdr_t* hdr = with_hdr >= 128 ? &( fh.hdr ) : NULL;
+    ssize_t res;
+    u64 id;
+
+    if ( m->mode == MAILSLOT_MODE_BROADCAST ) {
+        if ( peek ) {
+            CHECK( mailslot_peek( slot, rbuffer, size, 1 ) == -EINVAL );
+            return;
+        }
+        res = mailslot_dequeue( slot, m->subs[s].sub, rbuffer, size, 1, hdr );
+        if ( m->subs[s].sub == NULL ) {
+            CHECK( res == -EINVAL );
+        } else if ( hdr != NULL && fh.fail && res != 0 && res != -EMSGSIZE ) { /* the subscriber reads it again */
+            CHECK( res == -EFAULT );
+        } else if ( res > 0 ) {
+            CHECK( hdr == NULL || fh.size == (size_t)res );
+            id = check_content( m, res );
+            CHECK( m->subs[s].next < m->logged );
+            if ( m->subs[s].lax || m->policy == MAILSLOT_BCAST_DROP ) {
+                while ( m->subs[s].next < m->logged && m->log[ m->subs[s].next ] != id ) {
+                    m->subs[s].next++;
+                }
+                CHECK( m->subs[s].next < m->logged );
+            } else {
+                CHECK( m->log[ m->subs[s].next ] == id );
+            }
+            m->subs[s].next++;
+            mailslot_notify_space( slot );
+        } else if ( res == 0 ) {
+            CHECK( m->subs[s].lax || m->policy == MAILSLOT_BCAST_DROP || m->subs[s].next == m->logged );
+        } else {
+            CHECK( res == -EMSGSIZE );
+        }
+        return;
+    }
+
+    lane = model_front( m );
+    if ( lane >= 0 && exact( m ) ) {
+        CHECK( mailslot_next_size( slot ) == m->sizes[ m->lanes[ lane ][ m->heads[ lane ] ] ] );
+    }
+    res = peek ? mailslot_peek( slot, rbuffer, size, 1 ) : mailslot_dequeue( slot, NULL, rbuffer, size, 1, hdr );
+    if ( lane < 0 ) {
+        CHECK( res == 0 );
+        return;
+    }
+    if ( exact( m ) && m->sizes[ m->lanes[ lane ][ m->heads[ lane ] ] ] > size ) {
+        CHECK( res == -EMSGSIZE );
+        return;
+    } else if ( res == -EMSGSIZE ) {
+        return;
+    }
+    if ( hdr != NULL && fh.fail ) { /* the message is still in the model, as in the slot */
+        CHECK( res == -EFAULT );
+        return;
+    }
+    CHECK( res > 0 );
+    CHECK( hdr == NULL || ( fh.size == (size_t)res && ( !exact( m ) || fh.prio == lane ) ) );
+    id = check_content( m, res );
+    if ( peek ) {
+        CHECK( !m->gone[ id ] );
+        CHECK( !exact( m ) || m->lanes[ lane ][ m->heads[ lane ] ] == id );
+    } else {
+        model_pop( m, id );
+        mailslot_notify_space( slot );
+    }
+}
+
+/* Dequeues a batch (a single dequeue in broadcast mode): the messages which fit their buffers, in order. */
+static void do_dequeue_batch( mailslot_t* slot, struct model* m, struct input* in ) {
+    struct iovec bufs[ MAX_BATCH ];
+    u32 sizes[ MAX_BATCH ];
+    int i, n = 1 + next_byte( in ) % MAX_BATCH, lane, res, count;
+    u64 id;
+
+    if ( m->mode == MAILSLOT_MODE_BROADCAST ) {
+        do_dequeue( slot, m, in, 0 );
+        return;
+    }
+    for ( i = 0; i < n; i++ ) {
+        bufs[i].iov_base = rbatch[i];
+        bufs[i].iov_len = next_byte( in ) < 224 ? MAX_SIZE : next_u16( in ) % MAX_SIZE;
+    }
+
+    res = mailslot_dequeue_batch( slot, NULL, bufs, n, sizes, 1 );
+    if ( m->count == 0 ) {
+        CHECK( res == 0 );
+        return;
+    }
+    CHECK( res == -EMSGSIZE || ( res > 0 && res <= n ) );
+    count = max( res, 0 );
+    for ( i = 0; i < count; i++ ) {
+        CHECK( sizes[i] <= bufs[i].iov_len );
+        memcpy( rbuffer, rbatch[i], sizes[i] );
+        id = check_content( m, sizes[i] );
+        model_pop( m, id );
+    }
+    lane = model_front( m );
+    if ( exact( m ) && count < n && lane >= 0 ) { /* the batch stopped at a message which doesn't fit */
+        CHECK( m->sizes[ m->lanes[ lane ][ m->heads[ lane ] ] ] > bufs[ count ].iov_len );
+    }
+    if ( count > 0 ) {
+        mailslot_notify_space( slot );
+    }
+}
+
+static void do_set_mode( mailslot_t* slot, struct model* m, struct input* in ) {
+    int mode = next_byte( in ) % 6, error, lane; /* 5: invalid */
+    int busy = m->count > 0 || subscribers( m ) > 0;
+
+    error = mailslot_set_mode( slot, mode, next_byte( in ) < 128 ? 0 : next_u16( in ) * 64 );
+    if ( mode > MAILSLOT_MODE_SHARDED ) {
+        CHECK( error == -EINVAL );
+    } else if ( busy ) {
+        CHECK( error == -EBUSY );
+    } else {
+        CHECK( error == 0 || error == -EINVAL || error == -ENOMEM );
+    }
+    if ( error == 0 ) {
+        m->mode = mode;
+        m->logged = 0;
+        for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+            m->heads[ lane ] = m->tails[ lane ] = 0;
+        }
+    }
+}
+
+static void do_set_capacity( mailslot_t* slot, struct model* m, struct input* in ) {
+    int msgs = next_byte( in ) % 72, error; /* 0: invalid */
+    size_t bytes = next_byte( in ) < 128 ? 0 : next_u16( in );
+
+    error = mailslot_set_capacity( slot, msgs, bytes );
+    if ( msgs == 0 ) {
+        CHECK( error == -EINVAL );
+    } else if ( m->mode == MAILSLOT_MODE_LIST || m->mode == MAILSLOT_MODE_SHARDED ) {
+        CHECK( error == 0 );
+    } else if ( m->count > 0 || subscribers( m ) > 0 ) {
+        CHECK( error == -EBUSY );
+    }
+    if ( error == 0 ) {
+        m->max_msgs = msgs;
+        m->max_bytes = bytes;
+        if ( m->mode == MAILSLOT_MODE_BROADCAST ) {
+            m->logged = 0;
+        }
+    }
+}
+
+static void do_set_max_msg_size( mailslot_t* slot, struct model* m, struct input* in ) {
+    size_t size = 1 + next_u16( in ) % MAX_SIZE;
+    int error = mailslot_set_max_msg_size( slot, size );
+
+    if ( m->mode == MAILSLOT_MODE_LIST || m->mode == MAILSLOT_MODE_SHARDED || m->mode == MAILSLOT_MODE_BROADCAST ) {
+        CHECK( error == 0 );
+    } else if ( m->count > 0 ) {
+        CHECK( error == -EBUSY );
+    }
+    if ( error == 0 ) {
+        m->max_msg_size = size;
+    }
+}
+
+static void do_subscribe( mailslot_t* slot, struct model* m, struct input* in, int subscribe ) {
+    int s = next_byte( in ) % MAX_SUBS;
+    mailslot_sub_t* sub;
+
+    if ( !subscribe ) {
+        if ( m->subs[s].sub != NULL ) {
+            mailslot_unsubscribe( slot, m->subs[s].sub );
+            m->subs[s].sub = NULL;
+            mailslot_notify_space( slot );
+        }
+        return;
+    }
+    if ( m->subs[s].sub != NULL ) {
+        return;
+    }
+    sub = mailslot_subscribe( slot );
+    if ( m->mode != MAILSLOT_MODE_BROADCAST ) {
+        CHECK( IS_ERR( sub ) );
+        return;
+    }
+    CHECK( !IS_ERR( sub ) );
+    m->subs[s].sub = sub;
+    m->subs[s].next = m->logged;
+    m->subs[s].lax = m->policy == MAILSLOT_BCAST_DROP;
+}
+
+static void do_set_bcast_policy( mailslot_t* slot, struct model* m, struct input* in ) {
+    int policy = next_byte( in ) % 3, s; /* 2: invalid */
+    int error = mailslot_set_bcast_policy( slot, policy );
+
+    if ( policy > MAILSLOT_BCAST_DROP ) {
+        CHECK( error == -EINVAL );
+        return;
+    }
+    CHECK( error == 0 );
+    m->policy = policy;
+    for ( s = 0; s < MAX_SUBS; s++ ) { /* messages may have been dropped from now on */
+        m->subs[s].lax |= policy == MAILSLOT_BCAST_DROP;
+    }
+}
+
+/* Each input is a sequence of operations on a fresh slot, applied by a single thread with non-blocking calls. */
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size ) {
+    struct input in = { data, size };
+    struct model m = { 0 };
+    mailslot_t* slot = mailslot_alloc( NUMA_NO_NODE );
+    size_t ops = size + 1;
+    int lane, s;
+
+    CHECK( slot != NULL );
+    mailslot_init( slot, 0 );
+    m.mode = MAILSLOT_MODE_LIST;
+    m.max_msg_size = DEFAULT_MAX_MSG_SIZE;
+    m.max_msgs = MAX_SLOT_SIZE;
+    m.sizes = calloc( ops * MAX_BATCH, sizeof( size_t ) );
+    m.gone = calloc( ops * MAX_BATCH, 1 );
+    m.log = calloc( ops * MAX_BATCH, sizeof( u64 ) );
+    for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+        m.lanes[ lane ] = calloc( ops * MAX_BATCH, sizeof( u64 ) );
+    }
+
+    while ( in.size > 0 ) {
+        switch ( next_byte( &in ) % OP_COUNT ) {
+            case OP_ENQUEUE: do_enqueue( slot, &m, &in, 1 ); break;
+            case OP_ENQUEUE_BATCH: do_enqueue( slot, &m, &in, 1 + next_byte( &in ) % MAX_BATCH ); break;
+            case OP_DEQUEUE: do_dequeue( slot, &m, &in, 0 ); break;
+            case OP_PEEK: do_dequeue( slot, &m, &in, 1 ); break;
+            case OP_SET_MODE: do_set_mode( slot, &m, &in ); break;
+            case OP_SET_CAPACITY: do_set_capacity( slot, &m, &in ); break;
+            case OP_SET_MAX_MSG_SIZE: do_set_max_msg_size( slot, &m, &in ); break;
+            case OP_SUBSCRIBE: do_subscribe( slot, &m, &in, 1 ); break;
+            case OP_UNSUBSCRIBE: do_subscribe( slot, &m, &in, 0 ); break;
+            case OP_SET_BCAST_POLICY: do_set_bcast_policy( slot, &m, &in ); break;
+            case OP_DEQUEUE_BATCH: do_dequeue_batch( slot, &m, &in ); break;
+        }
+        if ( m.mode != MAILSLOT_MODE_BROADCAST ) {
+            CHECK( mailslot_depth( slot ) == m.count );
+            CHECK( mailslot_bytes( slot ) == m.bytes );
+        }
+    }
+
+    for ( s = 0; s < MAX_SUBS; s++ ) {
+        if ( m.subs[s].sub != NULL ) {
+            mailslot_unsubscribe( slot, m.subs[s].sub );
+        }
+    }
+    mailslot_free( slot );
+    for ( lane = 0; lane < MAILSLOT_LANES; lane++ ) {
+        free( m.lanes[ lane ] );
+    }
+    free( m.log );
+    free( m.gone );
+    free( m.sizes );
+    return 0;
+}
+
+#ifdef MAILSLOT_FUZZ_MAIN
+/* Without libFuzzer: replays the inputs given as files (e.g. a crash) or, without arguments, runs random ones. */
+int main( int argc, char** argv ) {
+    static uint8_t data[ 1 << 16 ];
+    size_t size, i;
+    int n;
+    FILE* file;
+
+    for ( n = 1; n < argc; n++ ) {
+        file = fopen( argv[n], "rb" );
+        if ( file == NULL ) {
+            perror( argv[n] );
+            return 1;
+        }
+        size = fread( data, 1, sizeof( data ), file );
+        fclose( file );
+        LLVMFuzzerTestOneInput( data, size );
+    }
+    for ( n = 0; argc == 1 && n < 10000; n++ ) {
+        size = rand() % 4096;
+        for ( i = 0; i < size; i++ ) {
+            data[i] = rand();
+        }
+        LLVMFuzzerTestOneInput( data, size );
+    }
+    return 0;
+}
+#endif
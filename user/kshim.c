@@ -0,0 +1,214 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "kshim.h"
+#include "../src/mailslot_stats.h"
+
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+unsigned int nr_cpu_ids = 1;
+
+DEFINE_STATIC_KEY_FALSE( mailslot_stats_enabled );
+
+static __thread struct task_struct kshim_task;
+
+__attribute__(( constructor )) static void kshim_init( void ) {
+    long cpus = sysconf( _SC_NPROCESSORS_CONF );
+    nr_cpu_ids = cpus > 0 ? cpus : 1;
+}
+
+struct task_struct* kshim_current( void ) {
+    if ( kshim_task.pid == 0 ) {
+        kshim_task.pid = syscall( SYS_gettid );
+    }
+    return &kshim_task;
+}
+
+int raw_smp_processor_id( void ) {
+    int cpu = sched_getcpu();
+    return cpu >= 0 && (unsigned int)cpu < nr_cpu_ids ? cpu : 0;
+}
+
+u64 ktime_get_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* tasks */
+
+int wake_up_process( struct task_struct* task ) {
+    if ( __atomic_exchange_n( &( task->state ), TASK_RUNNING, __ATOMIC_SEQ_CST ) == TASK_RUNNING ) {
+        return 0;
+    }
+    syscall( SYS_futex, &( task->state ), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+    return 1;
+}
+
+/* Sleeps until woken up (the state of the task is set back to TASK_RUNNING) or for timeout jiffies, returning the
+ * ones left. As in the kernel, a task woken up between prepare_to_wait and this call doesn't sleep at all. */
+long schedule_timeout( long timeout ) {
+    struct task_struct* task = current;
+    struct timespec ts, *tsp = NULL;
+    u64 deadline = 0, now;
+
+    if ( timeout != MAX_SCHEDULE_TIMEOUT ) {
+        deadline = ktime_get_ns() + (u64)timeout * 1000000ULL;
+    }
+    while ( __atomic_load_n( &( task->state ), __ATOMIC_ACQUIRE ) != TASK_RUNNING ) {
+        if ( timeout != MAX_SCHEDULE_TIMEOUT ) {
+            now = ktime_get_ns();
+            if ( now >= deadline ) {
+                break;
+            }
+            ts.tv_sec = ( deadline - now ) / 1000000000ULL;
+            ts.tv_nsec = ( deadline - now ) % 1000000000ULL;
+            tsp = &ts;
+        }
+        syscall( SYS_futex, &( task->state ), FUTEX_WAIT_PRIVATE, TASK_INTERRUPTIBLE, tsp, NULL, 0 );
+    }
+    __atomic_store_n( &( task->state ), TASK_RUNNING, __ATOMIC_RELEASE );
+    if ( timeout == MAX_SCHEDULE_TIMEOUT ) {
+        return timeout;
+    }
+    now = ktime_get_ns();
+    return now >= deadline ? 0 : (long)DIV_ROUND_UP( deadline - now, 1000000ULL );
+}
+
+/* wait queues: entries are removed from the queue when woken up, as with autoremove_wake_function */
+
+void init_waitqueue_head( wait_queue_head_t* wq ) {
+    pthread_mutex_init( &( wq->lock ), NULL );
+    INIT_LIST_HEAD( &( wq->head ) );
+}
+
+static void kshim_prepare_to_wait( wait_queue_head_t* wq, struct wait_queue_entry* wait, int state, int exclusive ) {
+    pthread_mutex_lock( &( wq->lock ) );
+    wait->task = current;
+    wait->exclusive = exclusive;
+    if ( list_empty( &( wait->entry ) ) ) {
+        list_add_tail( &( wait->entry ), &( wq->head ) );
+    }
+    __atomic_store_n( &( wait->task->state ), state, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock( &( wq->lock ) );
+}
+
+void prepare_to_wait( wait_queue_head_t* wq, struct wait_queue_entry* wait, int state ) {
+    kshim_prepare_to_wait( wq, wait, state, 0 );
+}
+
+void prepare_to_wait_exclusive( wait_queue_head_t* wq, struct wait_queue_entry* wait, int state ) {
+    kshim_prepare_to_wait( wq, wait, state, 1 );
+}
+
+/* Always takes the lock, so that the entry (on the stack of the waiter) outlives a concurrent wake up. */
+void finish_wait( wait_queue_head_t* wq, struct wait_queue_entry* wait ) {
+    __atomic_store_n( &( current->state ), TASK_RUNNING, __ATOMIC_RELEASE );
+    pthread_mutex_lock( &( wq->lock ) );
+    if ( !list_empty( &( wait->entry ) ) ) {
+        list_del_init( &( wait->entry ) );
+    }
+    pthread_mutex_unlock( &( wq->lock ) );
+}
+
+/* Wakes up all the non-exclusive waiters and up to nr_exclusive exclusive ones (all of them if 0). */
+void kshim_wake_up( wait_queue_head_t* wq, int nr_exclusive ) {
+    struct list_head *pos, *next;
+    struct wait_queue_entry* wait;
+
+    pthread_mutex_lock( &( wq->lock ) );
+    for ( pos = wq->head.next; pos != &( wq->head ); pos = next ) {
+        next = pos->next;
+        wait = container_of( pos, struct wait_queue_entry, entry );
+        list_del_init( pos );
+        if ( wake_up_process( wait->task ) && wait->exclusive && --nr_exclusive == 0 ) {
+            break;
+        }
+    }
+    pthread_mutex_unlock( &( wq->lock ) );
+}
+
+/* per-cpu memory */
+
+void* kshim_alloc_percpu( size_t size ) {
+    void* ptr = NULL;
+    size_t bytes = KSHIM_PERCPU_STRIDE( size ) * nr_cpu_ids;
+
+    if ( posix_memalign( &ptr, L1_CACHE_BYTES, bytes ) != 0 ) {
+        return NULL;
+    }
+    return memset( ptr, 0, bytes );
+}
+
+/* pages */
+
+struct page* alloc_page( gfp_t gfp ) {
+    struct page* page = malloc( sizeof( struct page ) );
+
+    if ( page == NULL ) {
+        return NULL;
+    }
+    if ( posix_memalign( &( page->address ), PAGE_SIZE, PAGE_SIZE ) != 0 ) {
+        free( page );
+        return NULL;
+    }
+    page->refs = 1;
+    return page;
+}
+
+void put_page( struct page* page ) {
+    if ( __atomic_sub_fetch( &( page->refs ), 1, __ATOMIC_SEQ_CST ) == 0 ) {
+        free( page->address );
+        free( page );
+    }
+}
+
+/* pipes: splice is not supported in user space, there are no pipes to splice to */
+
+void generic_pipe_buf_release( struct pipe_inode_info* pipe, struct pipe_buffer* buf ) {
+    put_page( buf->page );
+}
+
+bool generic_pipe_buf_try_steal( struct pipe_inode_info* pipe, struct pipe_buffer* buf ) {
+    return false;
+}
+
+bool generic_pipe_buf_get( struct pipe_inode_info* pipe, struct pipe_buffer* buf ) {
+    __atomic_add_fetch( &( buf->page->refs ), 1, __ATOMIC_SEQ_CST );
+    return true;
+}
+
+ssize_t add_to_pipe( struct pipe_inode_info* pipe, struct pipe_buffer* buf ) {
+    buf->ops->release( pipe, buf );
+    return -EINVAL;
+}
+
+/* statistics are exported through debugfs, which has no user space counterpart */
+
+struct dentry* mailslot_stats_register( int id, struct mailslot_stats __percpu* stats ) {
+    return NULL;
+}
+
+void mailslot_stats_unregister( struct dentry* dir ) {
+}
+
+void mailslot_stats_reset( struct mailslot_stats __percpu* stats ) {
+}
@@ -0,0 +1,478 @@
+/*
+Copyright (C) 2017-2018  Riccardo Ostani.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* User space stand-ins of the kernel API used by the engine (src/mailslot.c), so that the same source builds as a
+ * library for profiling, sanitizers and fuzzing: the headers in user/include/linux/ all include this one.
+ * Allocations map to malloc, spinlocks and mutexes to pthreads, wait queues to a futex per thread, atomics to the
+ * compiler builtins (as mailslot_ring.h does for user space). User copies are plain memcpy.
+ * RCU readers are not tracked: the storage of a slot must not be replaced while other threads poll or sleep on it.
+ * Splice and mmap compile, but are not meant to be driven in user space. */
+
+#ifndef MAILSLOT_KSHIM_H
+#define MAILSLOT_KSHIM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s32 s32;
+typedef __s64 s64;
+typedef unsigned int gfp_t;
+typedef unsigned int __poll_t;
+
+/* annotations */
+#define __user
+#define __rcu
+#define __percpu
+#define __force
+#define ____cacheline_aligned_in_smp __attribute__(( aligned( L1_CACHE_BYTES ) ))
+#define likely( x )   __builtin_expect( !!( x ), 1 )
+#define unlikely( x ) __builtin_expect( !!( x ), 0 )
+
+/* helpers */
+#define L1_CACHE_BYTES 64
+#define PAGE_SIZE      4096UL
+#define PAGE_SHIFT     12
+#define ALIGN( x, a )          ( ( ( x ) + ( a ) - 1 ) & ~( (__typeof__( x ))( a ) - 1 ) )
+#define PAGE_ALIGN( x )        ALIGN( x, PAGE_SIZE )
+#define DIV_ROUND_UP( n, d )   ( ( ( n ) + ( d ) - 1 ) / ( d ) )
+#define min( a, b )            ( ( a ) < ( b ) ? ( a ) : ( b ) )
+#define max( a, b )            ( ( a ) > ( b ) ? ( a ) : ( b ) )
+#define min_t( t, a, b )       min( (t)( a ), (t)( b ) )
+#define max_t( t, a, b )       max( (t)( a ), (t)( b ) )
+#define clamp_t( t, v, lo, hi ) min_t( t, max_t( t, v, lo ), hi )
+#define min_not_zero( a, b )   ( ( a ) == 0 ? ( b ) : ( ( b ) == 0 ? ( a ) : min( a, b ) ) )
+#define container_of( p, t, m ) ( (t*)( (char*)( p ) - offsetof( t, m ) ) )
+#define ARRAY_SIZE( a )        ( sizeof( a ) / sizeof( ( a )[0] ) )
+#define BUILD_BUG_ON( c )      ( (void)sizeof( char[ 1 - 2 * !!( c ) ] ) )
+#define BITS_PER_LONG ( 8 * (int)sizeof( long ) )
+
+static inline int ilog2( unsigned long long n ) {
+    return 63 - __builtin_clzll( n );
+}
+
+static inline unsigned long __fls( unsigned long word ) {
+    return BITS_PER_LONG - 1 - __builtin_clzl( word );
+}
+
+static inline unsigned long rounddown_pow_of_two( unsigned long n ) {
+    return 1UL << __fls( n );
+}
+
+/* errors */
+#define ERESTARTSYS 512
+#define MAX_ERRNO   4095
+#define IS_ERR_VALUE( x )    ( (unsigned long)( x ) >= (unsigned long)-MAX_ERRNO )
+#define ERR_PTR( e )         ( (void*)(long)( e ) )
+#define PTR_ERR( p )         ( (long)( p ) )
+#define IS_ERR( p )          IS_ERR_VALUE( p )
+#define IS_ERR_OR_NULL( p )  ( !( p ) || IS_ERR( p ) )
+#define PTR_ERR_OR_ZERO( p ) ( IS_ERR( p ) ? PTR_ERR( p ) : 0 )
+
+/* logging */
+#define KERN_DEBUG ""
+#define KERN_CONT  ""
+#define printk( ... ) fprintf( stderr, __VA_ARGS__ )
+
+/* memory ordering and atomics: value-returning operations are fully ordered, the others relaxed, as in the kernel */
+#define READ_ONCE( x )           __atomic_load_n( &( x ), __ATOMIC_RELAXED )
+#define WRITE_ONCE( x, v )       __atomic_store_n( &( x ), v, __ATOMIC_RELAXED )
+#define smp_mb()                 __atomic_thread_fence( __ATOMIC_SEQ_CST )
+#define smp_rmb()                 __atomic_thread_fence( __ATOMIC_ACQUIRE )
+#define smp_wmb()                 __atomic_thread_fence( __ATOMIC_RELEASE )
+#define smp_mb__before_atomic()  smp_mb()
+#define smp_mb__after_atomic()   smp_mb()
+#define smp_load_acquire( p )    __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define smp_store_release( p, v ) __atomic_store_n( p, v, __ATOMIC_RELEASE )
+#define cmpxchg( p, o, n ) \
+({ \
+    __typeof__( *( p ) ) __old = ( o ); \
+    __atomic_compare_exchange_n( p, &__old, n, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ); \
+    __old; \
+})
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+
+#define ATOMIC_OPS( prefix, type, vtype ) \
+static inline vtype prefix##_read( const type* v ) { return __atomic_load_n( &v->counter, __ATOMIC_RELAXED ); } \
+static inline void prefix##_set( type* v, vtype i ) { __atomic_store_n( &v->counter, i, __ATOMIC_RELAXED ); } \
+static inline void prefix##_add( vtype i, type* v ) { __atomic_fetch_add( &v->counter, i, __ATOMIC_RELAXED ); } \
+static inline void prefix##_sub( vtype i, type* v ) { __atomic_fetch_sub( &v->counter, i, __ATOMIC_RELAXED ); } \
+static inline void prefix##_inc( type* v ) { prefix##_add( 1, v ); } \
+static inline void prefix##_dec( type* v ) { prefix##_sub( 1, v ); } \
+static inline vtype prefix##_add_return( vtype i, type* v ) { return __atomic_add_fetch( &v->counter, i, __ATOMIC_SEQ_CST ); } \
+static inline vtype prefix##_sub_return( vtype i, type* v ) { return __atomic_sub_fetch( &v->counter, i, __ATOMIC_SEQ_CST ); } \
+static inline vtype prefix##_xchg( type* v, vtype i ) { return __atomic_exchange_n( &v->counter, i, __ATOMIC_SEQ_CST ); } \
+static inline bool prefix##_try_cmpxchg( type* v, vtype* old, vtype i ) { \
+    return __atomic_compare_exchange_n( &v->counter, old, i, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ); \
+}
+
+ATOMIC_OPS( atomic, atomic_t, int )
+ATOMIC_OPS( atomic_long, atomic_long_t, long )
+
+static inline bool atomic_dec_and_test( atomic_t* v ) {
+    return atomic_sub_return( 1, v ) == 0;
+}
+
+static inline int atomic_dec_if_positive( atomic_t* v ) {
+    int old = atomic_read( v );
+    do {
+        if ( old <= 0 ) {
+            return old - 1;
+        }
+    } while ( !atomic_try_cmpxchg( v, &old, old - 1 ) );
+    return old - 1;
+}
+
+typedef struct { atomic_t refs; } refcount_t;
+#define refcount_set( r, n )         atomic_set( &( r )->refs, n )
+#define refcount_inc( r )            atomic_inc( &( r )->refs )
+#define refcount_dec_and_test( r )   atomic_dec_and_test( &( r )->refs )
+
+static inline void set_bit( long nr, unsigned long* addr ) {
+    __atomic_fetch_or( addr, 1UL << nr, __ATOMIC_RELAXED );
+}
+
+static inline void clear_bit( long nr, unsigned long* addr ) {
+    __atomic_fetch_and( addr, ~( 1UL << nr ), __ATOMIC_RELAXED );
+}
+
+/* tasks: a thread, sleeping on its own futex */
+#define TASK_RUNNING       0
+#define TASK_INTERRUPTIBLE 1
+#define MAX_SCHEDULE_TIMEOUT LONG_MAX
+#define HZ 1000 /* a jiffy is a millisecond */
+
+struct task_struct {
+    int state; /* futex word */
+    pid_t pid;
+};
+
+struct task_struct* kshim_current( void );
+#define current kshim_current()
+#define task_tgid_nr( t ) getpid()
+#define signal_pending( t ) 0 /* there are no signals to deliver to a sleeping thread */
+
+int wake_up_process( struct task_struct* task );
+long schedule_timeout( long timeout );
+
+static inline unsigned long msecs_to_jiffies( unsigned int ms ) {
+    return ms;
+}
+
+u64 ktime_get_ns( void );
+#define local_clock() ktime_get_ns()
+#define NSEC_PER_USEC 1000L
+
+/* threads are preempted by the scheduler of the host, there is no need to yield the CPU explicitly */
+#define need_resched() 0
+#define cond_resched() do { } while ( 0 )
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__( "" ::: "memory" )
+#endif
+
+/* locks */
+typedef pthread_spinlock_t spinlock_t;
+#define spin_lock_init( l ) pthread_spin_init( l, PTHREAD_PROCESS_PRIVATE )
+#define spin_unlock( l )    pthread_spin_unlock( l )
+
+/* Unlike the kernel, a thread holding a spinlock can be preempted: the waiters yield the CPU to it rather than
+ * spinning for the rest of their time slice, which would add milliseconds to a wakeup with few CPUs. */
+static inline void spin_lock( spinlock_t* lock ) {
+    int spins = 0;
+
+    while ( pthread_spin_trylock( lock ) != 0 ) {
+        if ( ++spins % 64 == 0 ) {
+            sched_yield();
+        }
+    }
+}
+
+struct mutex { pthread_mutex_t m; };
+#define mutex_init( l )    pthread_mutex_init( &( l )->m, NULL )
+#define mutex_destroy( l ) pthread_mutex_destroy( &( l )->m )
+#define mutex_lock( l )    pthread_mutex_lock( &( l )->m )
+#define mutex_unlock( l )  pthread_mutex_unlock( &( l )->m )
+
+struct percpu_rw_semaphore { pthread_rwlock_t rw; };
+#define percpu_init_rwsem( s )        pthread_rwlock_init( &( s )->rw, NULL )
+#define percpu_free_rwsem( s )        pthread_rwlock_destroy( &( s )->rw )
+#define percpu_down_read( s )         pthread_rwlock_rdlock( &( s )->rw )
+#define percpu_down_read_trylock( s ) ( pthread_rwlock_tryrdlock( &( s )->rw ) == 0 )
+#define percpu_up_read( s )           pthread_rwlock_unlock( &( s )->rw )
+#define percpu_down_write( s )        pthread_rwlock_wrlock( &( s )->rw )
+#define percpu_up_write( s )          pthread_rwlock_unlock( &( s )->rw )
+
+#define lockdep_is_held( l ) ( (void)( l ), 1 )
+
+/* RCU: see the top of the file */
+#define rcu_read_lock()                    do {} while ( 0 )
+#define rcu_read_unlock()                  do {} while ( 0 )
+#define rcu_dereference( p )               __atomic_load_n( &( p ), __ATOMIC_CONSUME )
+#define rcu_dereference_protected( p, c )  ( (void)( c ), ( p ) )
+#define rcu_assign_pointer( p, v )         __atomic_store_n( &( p ), v, __ATOMIC_RELEASE )
+#define RCU_INIT_POINTER( p, v )           ( ( p ) = ( v ) )
+#define synchronize_rcu()                  do {} while ( 0 )
+
+/* lists */
+struct list_head { struct list_head *next, *prev; };
+
+static inline void INIT_LIST_HEAD( struct list_head* list ) {
+    list->next = list->prev = list;
+}
+
+static inline void list_add_tail( struct list_head* entry, struct list_head* head ) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del( struct list_head* entry ) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static inline void list_del_init( struct list_head* entry ) {
+    list_del( entry );
+    INIT_LIST_HEAD( entry );
+}
+
+static inline int list_empty( const struct list_head* head ) {
+    return READ_ONCE( head->next ) == head;
+}
+
+#define list_empty_careful( head ) list_empty( head )
+#define list_first_entry( head, type, member ) container_of( ( head )->next, type, member )
+
+/* wait queues */
+typedef struct wait_queue_head {
+    pthread_mutex_t lock;
+    struct list_head head;
+} wait_queue_head_t;
+
+struct wait_queue_entry {
+    struct list_head entry; /* empty once woken up (autoremove) */
+    struct task_struct* task;
+    int exclusive;
+};
+
+#define DEFINE_WAIT( name ) struct wait_queue_entry name = { .entry = { &( name ).entry, &( name ).entry } }
+
+void init_waitqueue_head( wait_queue_head_t* wq );
+void prepare_to_wait( wait_queue_head_t* wq, struct wait_queue_entry* wait, int state );
+void prepare_to_wait_exclusive( wait_queue_head_t* wq, struct wait_queue_entry* wait, int state );
+void finish_wait( wait_queue_head_t* wq, struct wait_queue_entry* wait );
+void kshim_wake_up( wait_queue_head_t* wq, int nr_exclusive );
+
+#define wake_up_interruptible_poll( wq, key ) kshim_wake_up( wq, 1 )
+#define wake_up_interruptible_all( wq )       kshim_wake_up( wq, 0 )
+
+static inline bool wq_has_sleeper( wait_queue_head_t* wq ) {
+    smp_mb();
+    return !list_empty( &wq->head );
+}
+
+/* poll */
+#define EPOLLIN     0x00000001
+#define EPOLLOUT    0x00000004
+#define EPOLLRDNORM 0x00000040
+#define EPOLLWRNORM 0x00000100
+
+struct file;
+typedef struct poll_table_struct poll_table;
+#define poll_wait( filp, wq, p ) do { (void)( filp ); (void)( wq ); (void)( p ); } while ( 0 )
+
+/* static keys */
+struct static_key_false { int enabled; };
+#define DEFINE_STATIC_KEY_FALSE( name )  struct static_key_false name = { 0 }
+#define DECLARE_STATIC_KEY_FALSE( name ) extern struct static_key_false name
+#define static_branch_unlikely( key )   unlikely( READ_ONCE( ( key )->enabled ) )
+
+/* CPUs and per-cpu memory: each copy on its own cache lines; this_cpu_* operate atomically on the first copy,
+ * since statistics are not what the user space build is about */
+extern unsigned int nr_cpu_ids;
+int raw_smp_processor_id( void );
+#define cpu_possible( cpu ) ( (unsigned int)( cpu ) < nr_cpu_ids )
+#define for_each_possible_cpu( cpu ) for ( ( cpu ) = 0; ( cpu ) < (int)nr_cpu_ids; ( cpu )++ )
+
+#define KSHIM_PERCPU_STRIDE( size ) ALIGN( (size_t)( size ), (size_t)L1_CACHE_BYTES )
+void* kshim_alloc_percpu( size_t size );
+#define alloc_percpu( type )    ( (type*)kshim_alloc_percpu( sizeof( type ) ) )
+#define free_percpu( p )        free( p )
+#define per_cpu_ptr( p, cpu )   ( (__typeof__( p ))( (char*)( p ) + ( cpu ) * KSHIM_PERCPU_STRIDE( sizeof( *( p ) ) ) ) )
+#define this_cpu_add( x, n )    __atomic_fetch_add( &( x ), n, __ATOMIC_RELAXED )
+#define this_cpu_inc( x )       this_cpu_add( x, 1 )
+#define this_cpu_read( x )      __atomic_load_n( &( x ), __ATOMIC_RELAXED )
+#define this_cpu_write( x, v )  __atomic_store_n( &( x ), v, __ATOMIC_RELAXED )
+
+/* memory */
+#define GFP_KERNEL         0u
+#define GFP_KERNEL_ACCOUNT 0u
+#define __GFP_ZERO         1u
+
+#define kmalloc( size, gfp )       malloc( size )
+#define kzalloc( size, gfp )       calloc( 1, size )
+#define kfree( p )                 free( (void*)( p ) )
+#define kvmalloc( size, gfp )      ( ( ( gfp ) & __GFP_ZERO ) ? calloc( 1, size ) : malloc( size ) )
+#define kvzalloc( size, gfp )      calloc( 1, size )
+#define kvmalloc_array( n, s, gfp ) calloc( n, s )
+#define kvcalloc( n, s, gfp )      calloc( n, s )
+#define kvfree( p )                free( (void*)( p ) )
+#define __vmalloc( size, gfp )     ( ( ( gfp ) & __GFP_ZERO ) ? calloc( 1, size ) : malloc( size ) )
+#define vfree( p )                 free( (void*)( p ) )
+#define array_size( n, s )         ( ( n ) * ( s ) )
+
+/* NUMA: a single node, as far as the engine can tell */
+#define NUMA_NO_NODE    ( -1 )
+#define nr_node_ids      1
+#define node_online( n ) ( ( n ) == 0 )
+#define numa_node_id()   0
+
+#define kmalloc_node( size, gfp, node )  kmalloc( size, gfp )
+#define kzalloc_node( size, gfp, node )  kzalloc( size, gfp )
+#define kvzalloc_node( size, gfp, node ) kvzalloc( size, gfp )
+
+struct page {
+    void* address;
+    int refs;
+};
+
+struct page* alloc_page( gfp_t gfp );
+void put_page( struct page* page );
+
+static inline void get_page( struct page* page ) {
+    __atomic_add_fetch( &( page->refs ), 1, __ATOMIC_SEQ_CST );
+}
+
+#define __free_page( page ) put_page( page )
+#define alloc_pages_node( node, gfp, order ) alloc_page( gfp ) /* order 0 only */
+#define page_address( page ) ( ( page )->address )
+
+/* user copies: user space pointers are plain pointers */
+#define copy_to_user( dst, src, n )   ( memcpy( dst, src, n ), 0UL )
+#define copy_from_user( dst, src, n ) ( memcpy( dst, src, n ), 0UL )
+
+/* iterators: a single segment of memory */
+#define ITER_SOURCE 1
+#define ITER_DEST   0
+
+struct iov_iter {
+    const char* base;
+    size_t count;
+};
+
+static inline int import_ubuf( int rw, void __user* buf, size_t len, struct iov_iter* i ) {
+    (void)rw;
+    i->base = buf;
+    i->count = len;
+    return 0;
+}
+
+static inline size_t iov_iter_count( const struct iov_iter* i ) {
+    return i->count;
+}
+
+static inline size_t copy_from_iter( void* addr, size_t bytes, struct iov_iter* i ) {
+    bytes = min( bytes, i->count );
+    memcpy( addr, i->base, bytes );
+    i->base += bytes;
+    i->count -= bytes;
+    return bytes;
+}
+
+/* pipes and mappings, only to compile splice and mmap */
+struct pipe_inode_info {
+    unsigned int head, tail, max_usage;
+};
+
+struct pipe_buffer;
+struct pipe_buf_operations {
+    void (*release)( struct pipe_inode_info*, struct pipe_buffer* );
+    bool (*try_steal)( struct pipe_inode_info*, struct pipe_buffer* );
+    bool (*get)( struct pipe_inode_info*, struct pipe_buffer* );
+};
+
+struct pipe_buffer {
+    struct page* page;
+    unsigned int offset, len;
+    const struct pipe_buf_operations* ops;
+};
+
+static inline unsigned int pipe_occupancy( unsigned int head, unsigned int tail ) {
+    return head - tail;
+}
+
+void generic_pipe_buf_release( struct pipe_inode_info* pipe, struct pipe_buffer* buf );
+bool generic_pipe_buf_try_steal( struct pipe_inode_info* pipe, struct pipe_buffer* buf );
+bool generic_pipe_buf_get( struct pipe_inode_info* pipe, struct pipe_buffer* buf );
+ssize_t add_to_pipe( struct pipe_inode_info* pipe, struct pipe_buffer* buf );
+
+struct vm_area_struct;
+struct vm_operations_struct {
+    void (*open)( struct vm_area_struct* );
+    void (*close)( struct vm_area_struct* );
+};
+
+struct vm_area_struct {
+    unsigned long vm_start;
+    unsigned long vm_pgoff;
+    void* vm_private_data;
+    const struct vm_operations_struct* vm_ops;
+};
+
+#define VM_DONTEXPAND 0
+#define VM_DONTDUMP   0
+#define vma_pages( vma )                  ( (void)( vma ), 1UL )
+#define vm_flags_set( vma, flags )        ( (void)( vma ), (void)( flags ) )
+#define vmalloc_to_page( addr )           ( (void)( addr ), (struct page*)NULL )
+#define vm_insert_page( vma, addr, page ) ( (void)( vma ), (void)( addr ), (void)( page ), -ENODEV )
+
+/* tracepoints: the events compile to empty functions */
+#define TP_PROTO( ... ) __VA_ARGS__
+#define TP_ARGS( ... )  __VA_ARGS__
+#define TRACE_EVENT( name, proto, args, tstruct, assign, print ) \
+    static inline void trace_##name( proto ) {} \
+    static inline bool trace_##name##_enabled( void ) { return false; }
+#define DECLARE_EVENT_CLASS( name, proto, args, tstruct, assign, print )
+#define DEFINE_EVENT( template, name, proto, args ) \
+    static inline void trace_##name( proto ) {} \
+    static inline bool trace_##name##_enabled( void ) { return false; }
+
+/* debugfs */
+struct dentry;
+
+#endif
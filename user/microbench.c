@@ -0,0 +1,318 @@
+#include "kshim.h"
+#include "../src/mailslot.h"
+
+#include <time.h>
+
+#define DEFAULT_MSGS 1000000
+#define DEFAULT_SIZE 12
+
+struct worker {
+    pthread_t thread;
+    mailslot_t* slot;
+    mailslot_sub_t* sub; /* of a reader in broadcast mode */
+    long msgs;
+    size_t size;
+    int prio;
+    int error;
+};
+
+static const char* mode_names[] = { "list", "ring", "shared", "broadcast", "sharded" };
+static unsigned int busy_poll = 0; /* microseconds a reader spins before sleeping */
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_u64( const void* a, const void* b ) {
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int parse_mode( const char* name ) {
+    int mode;
+
+    for ( mode = 0; mode < (int)ARRAY_SIZE( mode_names ); mode++ ) {
+        if ( strcmp( name, mode_names[ mode ] ) == 0 ) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+static void usage( const char* prog ) {
+    fprintf( stderr, "usage: %s [-m list|ring|shared|broadcast|sharded] [-n msgs] [-s size] [-w writers] [-r readers] "
+                     "[-c capacity] [-l lanes] [-b busy poll usecs] [-L round trips]\n", prog );
+}
+
+/* Returns the share of msgs moved by the i-th of n threads. */
+static long share( long msgs, int n, int i ) {
+    return msgs / n + ( i < msgs % n ? 1 : 0 );
+}
+
+/* Same loop as the write of the driver, minus the system call. */
+static ssize_t send_msg( mailslot_t* slot, const char* buffer, size_t size, int prio ) {
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    ssize_t res;
+
+    while ( ( res = mailslot_enqueue( slot, buffer, size, prio, raw_smp_processor_id(), 0 ) ) == -ENOSPC ) {
+        res = mailslot_wait_space( slot, 1, size, &timeout );
+        if ( res ) {
+            return res;
+        }
+    }
+    if ( res >= 0 ) {
+        mailslot_notify_msg( slot );
+    }
+    return res;
+}
+
+/* Same loop as the read of the driver: plain readers get messages handed to them, subscribers wait for them
+ * (either after spinning, with busy poll). */
+static ssize_t receive_msg( mailslot_t* slot, mailslot_sub_t* sub, char* buffer, size_t size ) {
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    ssize_t res;
+
+    while ( ( res = mailslot_dequeue( slot, sub, buffer, size, 0, NULL ) ) == 0 ) {
+        if ( busy_poll > 0 && mailslot_busy_poll( slot, sub, busy_poll ) ) {
+            continue;
+        }
+        if ( sub != NULL ) {
+            res = mailslot_wait_msg( slot, sub, &timeout );
+        } else {
+            res = mailslot_wait_handoff( slot, buffer, size, NULL, &timeout );
+        }
+        if ( res ) {
+            break;
+        }
+    }
+    if ( res > 0 ) {
+        mailslot_notify_space( slot );
+    }
+    return res;
+}
+
+static void* run_writer( void* arg ) {
+    struct worker* w = arg;
+    long i;
+    ssize_t res;
+    char* buffer = malloc( w->size );
+
+    if ( buffer == NULL ) {
+        w->error = -ENOMEM;
+        return NULL;
+    }
+    memset( buffer, 'x', w->size );
+    for ( i = 0; i < w->msgs; ++i ) {
+        res = send_msg( w->slot, buffer, w->size, w->prio );
+        if ( res < 0 ) {
+            w->error = res;
+            break;
+        }
+    }
+    free( buffer );
+    return NULL;
+}
+
+static void* run_reader( void* arg ) {
+    struct worker* w = arg;
+    long i;
+    ssize_t res;
+    char* buffer = malloc( w->size );
+
+    if ( buffer == NULL ) {
+        w->error = -ENOMEM;
+        return NULL;
+    }
+    for ( i = 0; i < w->msgs; ++i ) {
+        res = receive_msg( w->slot, w->sub, buffer, w->size );
+        if ( res < 0 ) {
+            w->error = res;
+            break;
+        }
+    }
+    free( buffer );
+    return NULL;
+}
+
+/* Echoes back each message of the slot of the first worker through the slot of the second one. */
+static void* run_echo( void* arg ) {
+    struct worker* w = arg;
+    long i;
+    ssize_t res = 0;
+    char* buffer = malloc( w->size );
+
+    if ( buffer == NULL ) {
+        w->error = -ENOMEM;
+        return NULL;
+    }
+    for ( i = 0; i < w->msgs && res >= 0; ++i ) {
+        res = receive_msg( w[0].slot, NULL, buffer, w->size );
+        if ( res > 0 ) {
+            res = send_msg( w[1].slot, buffer, res, 0 );
+        }
+    }
+    w->error = res < 0 ? res : 0;
+    free( buffer );
+    return NULL;
+}
+
+/* Round trips of a message through two slots with an echo thread: with busy poll, both ends spin on their slot
+ * instead of sleeping, hence the latency left is the one of the queue rather than that of a wake up. */
+static int run_latency( mailslot_t* slots[ 2 ], long trips, size_t size, u64* samples ) {
+    struct worker echo[ 2 ] = { { .slot = slots[0], .msgs = trips, .size = size }, { .slot = slots[1] } };
+    char* buffer = malloc( size );
+    ssize_t res = 0;
+    u64 start;
+    long i;
+
+    if ( buffer == NULL ) {
+        return -ENOMEM;
+    }
+    memset( buffer, 'x', size );
+    pthread_create( &echo[0].thread, NULL, run_echo, echo );
+    for ( i = 0; i < trips && res >= 0; ++i ) {
+        start = ktime_get_ns();
+        res = send_msg( slots[0], buffer, size, 0 );
+        if ( res >= 0 ) {
+            res = receive_msg( slots[1], NULL, buffer, size );
+        }
+        samples[i] = ktime_get_ns() - start;
+    }
+    pthread_join( echo[0].thread, NULL );
+    free( buffer );
+    return res < 0 ? res : echo[0].error;
+}
+
+static mailslot_t* create_slot( int mode, size_t size, int capacity ) {
+    int error;
+    mailslot_t* slot = mailslot_alloc( NUMA_NO_NODE );
+
+    if ( slot == NULL ) {
+        fprintf( stderr, "cannot allocate the slot\n" );
+        return NULL;
+    }
+    mailslot_init( slot, 0 );
+    error = mailslot_set_max_msg_size( slot, size );
+    if ( error == 0 ) {
+        error = mailslot_set_mode( slot, mode, 0 );
+    }
+    if ( error == 0 && capacity > 0 ) {
+        error = mailslot_set_capacity( slot, capacity, 0 );
+    }
+    if ( error ) {
+        fprintf( stderr, "cannot configure the slot: %s\n", strerror( -error ) );
+        mailslot_free( slot );
+        return NULL;
+    }
+    return slot;
+}
+
+/* Writer and reader threads move messages through the engine directly, as processes do through the device file:
+ * what is left is the cost of the queue itself (locking, allocations, copies and wake ups). */
+int main( int argc, char** argv ) {
+    int opt, i, error = 0, mode = MAILSLOT_MODE_LIST, writers = 1, readers = 1, capacity = 0, lanes = 1;
+    long msgs = DEFAULT_MSGS, trips = 0;
+    size_t size = DEFAULT_SIZE;
+    struct worker* workers;
+    mailslot_t* slot;
+    mailslot_t* slots[ 2 ];
+    u64* samples;
+    double start, elapsed;
+
+    while ( ( opt = getopt( argc, argv, "m:n:s:w:r:c:l:b:L:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'm': mode = parse_mode( optarg ); break;
+            case 'n': msgs = atol( optarg ); break;
+            case 's': size = strtoul( optarg, NULL, 10 ); break;
+            case 'w': writers = atoi( optarg ); break;
+            case 'r': readers = atoi( optarg ); break;
+            case 'c': capacity = atoi( optarg ); break;
+            case 'l': lanes = atoi( optarg ); break;
+            case 'b': busy_poll = strtoul( optarg, NULL, 10 ); break;
+            case 'L': trips = atol( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( mode < 0 || msgs <= 0 || size == 0 || size > LIMIT_MAX_MSG_SIZE || writers <= 0 || readers <= 0 ||
+         capacity < 0 || lanes <= 0 || lanes > MAILSLOT_LANES || trips < 0 ||
+         ( trips > 0 && mode == MAILSLOT_MODE_BROADCAST ) ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( trips > 0 ) {
+        samples = malloc( trips * sizeof( u64 ) );
+        slots[0] = create_slot( mode, size, capacity );
+        slots[1] = create_slot( mode, size, capacity );
+        if ( samples == NULL || slots[0] == NULL || slots[1] == NULL ) {
+            return 1;
+        }
+        error = run_latency( slots, trips, size, samples );
+        if ( error ) {
+            fprintf( stderr, "mailslot: %s\n", strerror( -error ) );
+            return 1;
+        }
+        qsort( samples, trips, sizeof( u64 ), compare_u64 );
+        printf( "path=user mode=%s size=%zu busy_poll_us=%u trips=%ld rtt_p50_us=%.2f rtt_p99_us=%.2f rtt_p999_us=%.2f\n",
+                mode_names[ mode ], size, busy_poll, trips, samples[ trips / 2 ] / 1e3,
+                samples[ trips * 99 / 100 ] / 1e3, samples[ trips * 999 / 1000 ] / 1e3 );
+        mailslot_free( slots[0] );
+        mailslot_free( slots[1] );
+        free( samples );
+        return 0;
+    }
+
+    slot = create_slot( mode, size, capacity );
+    workers = calloc( writers + readers, sizeof( struct worker ) );
+    if ( slot == NULL || workers == NULL ) {
+        return 1;
+    }
+
+    for ( i = 0; i < writers + readers; ++i ) {
+        workers[i].slot = slot;
+        workers[i].size = size;
+        if ( i < writers ) {
+            workers[i].msgs = share( msgs, writers, i );
+            workers[i].prio = i % lanes;
+        } else if ( mode == MAILSLOT_MODE_BROADCAST ) { /* every subscriber reads every message */
+            workers[i].msgs = msgs;
+            workers[i].sub = mailslot_subscribe( slot );
+            if ( IS_ERR( workers[i].sub ) ) {
+                fprintf( stderr, "cannot subscribe: %s\n", strerror( -PTR_ERR( workers[i].sub ) ) );
+                return 1;
+            }
+        } else {
+            workers[i].msgs = share( msgs, readers, i - writers );
+        }
+    }
+
+    start = now();
+    for ( i = 0; i < writers + readers; ++i ) {
+        pthread_create( &workers[i].thread, NULL, i < writers ? run_writer : run_reader, &workers[i] );
+    }
+    for ( i = 0; i < writers + readers; ++i ) {
+        pthread_join( workers[i].thread, NULL );
+        if ( workers[i].error && error == 0 ) {
+            error = workers[i].error;
+        }
+    }
+    elapsed = now() - start;
+
+    if ( error ) {
+        fprintf( stderr, "mailslot: %s\n", strerror( -error ) );
+        return 1;
+    }
+    printf( "path=user mode=%s size=%zu writers=%d readers=%d msgs=%ld seconds=%.3f msgs/sec=%.0f MiB/sec=%.1f\n",
+            mode_names[ mode ], size, writers, readers, msgs, elapsed, msgs / elapsed, msgs * size / elapsed / ( 1 << 20 ) );
+
+    for ( i = writers; i < writers + readers; ++i ) {
+        if ( workers[i].sub != NULL ) {
+            mailslot_unsubscribe( slot, workers[i].sub );
+        }
+    }
+    mailslot_free( slot );
+    free( workers );
+    return 0;
+}